@@ -6,7 +6,10 @@
  * @author Sergei Lodyagin
  */
 
-#include "Repository.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <limits>
 #include "SSingleton.hpp"
 #include "dom.h"
 #include "browser.h"
@@ -28,10 +31,10 @@ operator>> (std::istream& in, node_id_t& id)
   in >> id.browser_id;
   SCHECK(in.get() == ':');
 
-  id.path.reserve(10);
+  id.path.clear();
   while(in) {
     SCHECK(in.get() == '/');
-    node_id_t::vector::value_type l;
+    node_id_t::path_type::value_type l;
     in >> l;
     id.path.push_back(l);
   }
@@ -52,15 +55,21 @@ operator<<(std::ostream& out, const node_obj& nd)
     case xpath::node_type::node:
     {
       // tag name
-      out << '<' << nd.tag;
+      out << '<' << nd.tag.str();
 
       // attributes
-      for (const auto p : nd.attrs)
-        out << ' ' << p.first << "=\"" << p.second << '"';
+      for (uint32_t k = 0; k < nd.n_attrs; k++) {
+        const node_obj::attr_t& a = nd.attrs[k];
+        out << ' ';
+        out.write(a.name.data, a.name.length);
+        out << "=\"";
+        out.write(a.value.data, a.value.length);
+        out << '"';
+      }
       out << '>';
 
       // bounding rect
-      const CefRect& r = nd.bounding_rect;
+      const cef_rect_t& r = nd.bounding_rect;
       out << " [" << r.x << ", " << r.y << ", " << r.width
          << ", " << r.height << "]";
 
@@ -72,19 +81,588 @@ operator<<(std::ostream& out, const node_obj& nd)
   }
 }
 
+constexpr size_t node_arena::min_chunk_size;
+constexpr size_t node_arena::max_chunk_size;
+
+void* node_arena::allocate(size_t size)
+{
+  constexpr size_t align = alignof(std::max_align_t);
+  size = (size + align - 1) & ~(align - 1);
+
+  if (size > left) {
+    // a big object gets its own chunk
+    last_chunk = std::min(
+      std::max(2 * last_chunk, min_chunk_size),
+      max_chunk_size
+    );
+    const size_t n = std::max(size, last_chunk);
+    chunks.emplace_back(new char[n]);
+    top = chunks.back().get();
+    left = n;
+    reserved += n;
+  }
+
+  void* res = top;
+  top += size;
+  left -= size;
+  return res;
+}
+
+node_arena::string_ref node_arena::copy(const std::string& s)
+{
+  char* p = static_cast<char*>(allocate(s.size()));
+  ::memcpy(p, s.data(), s.size());
+  return { p, static_cast<uint32_t>(s.size()) };
+}
+
+const xpath::child_path_t::value_type* 
+node_arena::copy_path(const xpath::child_path_t& path)
+{
+  SCHECK(!path.empty());
+  using value_type = xpath::child_path_t::value_type;
+  const size_t n = path.size() - 1;
+  auto* p = static_cast<value_type*>
+    (allocate(n * sizeof(value_type)));
+  std::copy(path.begin() + 1, path.end(), p);
+  return p;
+}
+
+std::string node_obj::GetElementAttribute(
+  const std::string& name
+) const
+{
+  for (uint32_t k = 0; k < n_attrs; k++) {
+    const attr_t& a = attrs[k];
+    if (a.name.length == name.size()
+        && ::memcmp(a.name.data, name.data(), name.size()) 
+           == 0)
+      return a.value.str();
+  }
+  return std::string();
+}
+
+node_shard::node_shard(int browser_id_)
+  : browser_id(browser_id_)
+{
+  SCHECK(browser_id > 0);
+}
+
+node_shard::list_type node_shard::create_several_objects(
+  dom_visitor::query_base& param
+)
+{
+  static std::atomic<uint64_t> n_queries(0);
+
+  node_arena* a = new node_arena;
+  a->query = ++n_queries;
+  {
+    RLOCK(arenas_mx);
+    a->generation = generation;
+    arenas.emplace(
+      a->query, 
+      std::unique_ptr<node_arena>(a)
+    );
+  }
+
+  list_type res(browser_id, a->query);
+  param.arena = a;
+  try {
+    const size_t n = param.n_objects(*this);
+    res.reserve(n);
+    for (size_t k = 0; k < n; k++)
+      res.push_back(param.create_next_derivation(*this));
+  }
+  catch (...) {
+    param.arena = nullptr;
+    RLOCK(arenas_mx);
+    arenas.erase(a->query);
+    throw;
+  }
+  param.arena = nullptr;
+
+  RLOCK(arenas_mx);
+  if (res.empty()) {
+    arenas.erase(a->query);
+    res.query = 0;
+    return res;
+  }
+
+  a->last_use = node_arena::next_tick();
+  a->complete = true;
+  n_objects_ += a->n_objects();
+  memory_ += a->memory();
+  return res;
+}
+
+size_t node_shard::drop(uint64_t query, bool is_eviction)
+{
+  const auto it = arenas.find(query);
+  if (it == arenas.end())
+    return 0;
+
+  const node_arena* a = it->second.get();
+  if (is_eviction)
+    n_evicted_ += a->n_objects();
+  n_objects_ -= a->n_objects();
+  const size_t freed = a->memory();
+  memory_ -= freed;
+  // objects are trivially destructible
+  arenas.erase(it);
+  return freed;
+}
+
+void node_shard::release(const list_type& objs)
+{
+  SCHECK(objs.get_browser_id() == browser_id);
+  RLOCK(arenas_mx);
+  drop(objs.get_query(), false);
+}
+
+void node_shard::touch(const list_type& objs)
+{
+  RLOCK(arenas_mx);
+  const auto it = arenas.find(objs.get_query());
+  if (it != arenas.end())
+    it->second->last_use = node_arena::next_tick();
+}
+
+bool node_shard::pin(const list_type& objs)
+{
+  RLOCK(arenas_mx);
+  const auto it = arenas.find(objs.get_query());
+  if (it == arenas.end())
+    return false;
+
+  ++it->second->n_pins;
+  return true;
+}
+
+void node_shard::unpin(const list_type& objs)
+{
+  RLOCK(arenas_mx);
+  const auto it = arenas.find(objs.get_query());
+  if (it == arenas.end())
+    return;
+
+  SCHECK(it->second->n_pins > 0);
+  --it->second->n_pins;
+}
+
+void node_shard::new_generation()
+{
+  RLOCK(arenas_mx);
+  const uint64_t old = generation++;
+
+  // pinned arenas are evicted by the next navigation
+  // after unpin()
+  std::vector<uint64_t> evicted;
+  for (const auto& a : arenas)
+    if (a.second->is_evictable() 
+        && a.second->generation <= old)
+      evicted.push_back(a.first);
+  for (const uint64_t q : evicted)
+    drop(q, true);
+}
+
+void node_shard::lru_queries(
+  uint64_t before,
+  std::vector<std::pair<uint64_t, uint64_t>>& out
+) const
+{
+  RLOCK(arenas_mx);
+  for (const auto& a : arenas)
+    if (a.second->is_evictable() 
+        && a.second->last_use < before)
+      out.emplace_back(a.second->last_use, a.first);
+}
+
+size_t node_shard::evict(uint64_t query, uint64_t use)
+{
+  RLOCK(arenas_mx);
+  const auto it = arenas.find(query);
+  if (it == arenas.end() 
+      || !it->second->is_evictable()
+      || it->second->last_use != use)
+    return 0;
+
+  return drop(query, true);
+}
+
+uint64_t node_arena::next_tick()
+{
+  static std::atomic<uint64_t> clock(0);
+  return ++clock;
+}
+
 node_repository::list_type node_repository
 //
 ::create_several_objects(
   int browser_id,
   dom_visitor::query_base& param
 )
+{
+  // queries used after this are not evicted here
+  const uint64_t before = node_arena::next_tick();
+  list_type res = shard(browser_id)
+    ->create_several_objects(param);
+  enforce_cap(before);
+  return res;
+}
+
+void node_repository::enforce_cap(uint64_t before)
+{
+  struct candidate
+  {
+    uint64_t use;
+    uint64_t query;
+    std::shared_ptr<node_shard> shard;
+  };
+
+  // the memory is summed once and decreased by
+  // evictions, queries of all browsers are sorted by
+  // the last use once
+  const size_t cap = memory_cap;
+  size_t memory = 0;
+  std::vector<candidate> lru;
+  {
+    RLOCK(shards_mx);
+    for (const auto& s : shards)
+      memory += s.second->memory();
+    if (memory <= cap)
+      return;
+
+    std::vector<std::pair<uint64_t, uint64_t>> queries;
+    for (const auto& s : shards) {
+      queries.clear();
+      s.second->lru_queries(before, queries);
+      for (const auto& q : queries)
+        lru.push_back({q.first, q.second, s.second});
+    }
+  }
+
+  std::sort(
+    lru.begin(), 
+    lru.end(),
+    [](const candidate& a, const candidate& b)
+    {
+      return a.use < b.use;
+    }
+  );
+
+  for (const candidate& c : lru) {
+    if (memory <= cap)
+      break;
+
+    const size_t freed = c.shard->evict(c.query, c.use);
+    if (freed == 0)
+      continue; // used, pinned or released meanwhile
+
+    memory -= std::min(memory, freed);
+    LOG_DEBUG(log, "the query of the browser " 
+      << c.shard->get_current_browser_id() 
+      << " is evicted, the memory cap is " << cap);
+  }
+}
+
+void node_repository::release(const list_type& objs)
+{
+  if (objs.get_query() == 0)
+    return;
+
+  if (const auto s = find_shard(objs.get_browser_id()))
+    s->release(objs);
+}
+
+void node_repository::touch(const list_type& objs)
+{
+  if (objs.get_query() == 0)
+    return;
+
+  if (const auto s = find_shard(objs.get_browser_id()))
+    s->touch(objs);
+}
+
+bool node_repository::pin(const list_type& objs)
+{
+  // an empty result has nothing to evict
+  if (objs.get_query() == 0)
+    return true;
+
+  const auto s = find_shard(objs.get_browser_id());
+  return s && s->pin(objs);
+}
+
+void node_repository::unpin(const list_type& objs)
+{
+  if (objs.get_query() == 0)
+    return;
+
+  if (const auto s = find_shard(objs.get_browser_id()))
+    s->unpin(objs);
+}
+
+void node_repository::new_generation(int browser_id)
+{
+  shard(browser_id)->new_generation();
+}
+
+void node_repository::remove_shard(int browser_id)
+{
+  std::shared_ptr<node_shard> s;
+  {
+    RLOCK(shards_mx);
+    const auto it = shards.find(browser_id);
+    if (it == shards.end())
+      return;
+    s = std::move(it->second);
+    shards.erase(it);
+  }
+  n_removed += s->size();
+  // the objects are deleted outside shards_mx (or by
+  // the last shard() holder)
+}
+
+void node_repository::clear()
+{
+  std::unordered_map<int, std::shared_ptr<node_shard>> old;
+  {
+    RLOCK(shards_mx);
+    old.swap(shards);
+  }
+  for (const auto& s : old)
+    n_removed += s.second->size();
+}
+
+std::shared_ptr<node_shard> node_repository
+//
+::shard(int browser_id)
 {
   SCHECK(browser_id > 0);
-  RLOCK(this->objectsM);
-  current_browser_id = browser_id;
-  return Spark::create_several_objects(param);
+  RLOCK(shards_mx);
+  std::shared_ptr<node_shard>& s = shards[browser_id];
+  if (!s)
+    s.reset(new node_shard(browser_id));
+  return s;
+}
+
+std::shared_ptr<node_shard> node_repository
+//
+::find_shard(int browser_id) const
+{
+  RLOCK(shards_mx);
+  const auto it = shards.find(browser_id);
+  return it != shards.end() 
+    ? it->second : std::shared_ptr<node_shard>();
+}
+
+size_t node_repository::size() const
+{
+  RLOCK(shards_mx);
+  size_t n = 0;
+  for (const auto& s : shards)
+    n += s.second->size();
+  return n;
+}
+
+node_repository::stats node_repository::get_stats() const
+{
+  stats res;
+  res.n_removed = n_removed;
+
+  RLOCK(shards_mx);
+  for (const auto& s : shards) {
+    res.n_objects += s.second->size();
+    res.n_queries += s.second->n_arenas();
+    res.memory += s.second->memory();
+    res.n_evicted += s.second->n_evicted();
+  }
+  return res;
+}
+
+node_repository::BatchVisitor::BatchVisitor(
+  node_repository& rep,
+  int browser_id_,
+  const std::vector<std::string>& xpaths
+) 
+  : node_rep(rep),
+    batch(xpaths),
+    browser_id(browser_id_)
+{
+  SCHECK(browser_id > 0);
+}
+
+void node_repository::BatchVisitor
+//
+::Visit(CefRefPtr<CefDOMDocument> d)
+{
+  // one SerializeSubtree() call instead of DOM calls
+  // per node, rects are fetched for results only
+  const CefRefPtr<CefDOMNode> root = d->GetDocument();
+  const auto snapshot = ::xpath::snapshot::document
+    ::capture(root, false);
+  const auto results = batch.execute(
+    dom_visitor::snapshot_node(snapshot->root())
+  );
+
+  result_lists.clear();
+  result_lists.reserve(results.size());
+  for (const auto& nodes : results) {
+    dom_visitor::node_list list(nodes);
+    list.load_rects(root);
+    result_lists.push_back(
+      node_rep.create_several_objects(browser_id, list)
+    );
+  }
+  // node objects are copies, the snapshot is released
+  // with results
+}
+
+std::vector<node_repository::list_type> node_repository
+//
+::query_batch(
+  int browser_id,
+  const std::vector<std::string>& xpaths
+)
+{
+  CefRefPtr<CefDOMVisitor> visitor = 
+    new BatchVisitor(*this, browser_id, xpaths);
+
+  curr::RHolder<shared::browser>(browser_id) -> br
+    -> GetMainFrame() -> VisitDOM(visitor); 
+
+  return dynamic_cast<BatchVisitor*>(visitor.get())
+    ->get_result_lists();
+}
+
+namespace dom_visitor {
+
+node_list::node_list(
+  const std::vector<snapshot_node>& nodes
+)
+{
+  entries.reserve(nodes.size());
+  for (const snapshot_node& n : nodes) {
+    if (n.is_attribute()) {
+      LOG_WARN(log, "an attribute node is skipped");
+      continue;
+    }
+    entries.push_back(
+      {n, ::xpath::runtime::root_path(n)}
+    );
+  }
+}
+
+bool find_live_nodes(
+  CefRefPtr<CefDOMNode> root,
+  const std::vector<const ::xpath::child_path_t*>& paths,
+  std::vector<CefRefPtr<CefDOMNode>>& nodes
+)
+{
+  nodes.reserve(nodes.size() + paths.size());
+
+  // The walk keeps the live chain of the previous path.
+  // chain[k + 1] is the child number idx[k] of chain[k].
+  using index_t = ::xpath::node_difference_type;
+  std::vector<CefRefPtr<CefDOMNode>> chain(1, root);
+  std::vector<index_t> idx;
+
+  for (const ::xpath::child_path_t* pp : paths) {
+    // path[0] is the document node
+    const ::xpath::child_path_t& path = *pp;
+    size_t k = 0;
+    while (k < idx.size() && k + 1 < path.size()
+           && idx[k] == (index_t) path[k + 1])
+      ++k;
+
+    // continue from the previous sibling on the path
+    CefRefPtr<CefDOMNode> n;
+    index_t i = 0;
+    if (k < idx.size() && k + 1 < path.size()
+        && idx[k] < (index_t) path[k + 1])
+    {
+      n = chain[k + 1];
+      i = idx[k];
+    }
+    chain.resize(k + 1);
+    idx.resize(k);
+
+    for (size_t l = k + 1; l < path.size(); l++) {
+      if (!n.get()) {
+        n = chain.back()->GetFirstChild();
+        i = 0;
+      }
+      for (; n.get() && i < (index_t) path[l]; ++i)
+        n = n->GetNextSibling();
+      if (!n.get())
+        break;
+
+      chain.push_back(n);
+      idx.push_back(i);
+      n = nullptr;
+    }
+
+    if (chain.size() != path.size())
+      return false;
+    nodes.push_back(chain.back());
+  }
+  return true;
+}
+
+void node_list::load_rects(CefRefPtr<CefDOMNode> root)
+{
+  rects.clear();
+  if (entries.empty())
+    return;
+
+  std::vector<const ::xpath::child_path_t*> paths;
+  paths.reserve(entries.size());
+  for (const entry& e : entries)
+    paths.push_back(&e.child_path);
+
+  std::vector<CefRefPtr<CefDOMNode>> nodes;
+  if (!find_live_nodes(root, paths, nodes)) {
+    LOG_WARN(log, "a node is not found in the DOM, "
+             "no rects are loaded");
+    return;
+  }
+
+  root->GetBoundingClientRects(nodes, rects);
+  if (rects.size() != nodes.size()) {
+    // an older library
+    rects.clear();
+    for (const auto& n : nodes)
+      rects.push_back(n->GetBoundingClientRect());
+  }
+}
+
+size_t node_list::n_objects(const renderer::node_shard&)
+{
+  cur = 0;
+  return entries.size();
+}
+
+renderer::node_obj* node_list::create_next_derivation(
+  const renderer::node_shard& rep
+)
+{
+  SCHECK(rep.get_current_browser_id() > 0);
+  SCHECK(cur < entries.size());
+
+  SCHECK(arena);
+  entry& e = entries[cur];
+  const CefRect rect = cur < rects.size()
+    ? rects[cur]
+    : (*e)->GetBoundingClientRect();
+  ++cur;
+  return new (*arena) renderer::node_obj(
+    rep.get_current_browser_id(),
+    e,
+    rect,
+    *arena
+  );
 }
 
+} // dom_visitor
 
 } // renderer
 
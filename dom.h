@@ -10,17 +10,26 @@
 #define OFFSCREEN_DOM_H
 
 #include <iostream>
+#include <atomic>
 #include <chrono>
+#include <limits>
+#include <memory>
+#include <type_traits>
+#include <unordered_map>
+#include <vector>
 #include "RHolder.h"
-#include "Repository.h"
+#include "RMutex.h"
 #include "SSingleton.h"
 #include "xpath.h"
+#include "xpath_plan.h"
+#include "xpath_snapshot.h"
 #include "browser.h"
 
 namespace renderer { namespace dom_visitor {
 class query_base;
 template<class Query>
 class query;
+class node_list;
 }}
 
 namespace shared {
@@ -31,7 +40,7 @@ namespace shared {
 class node_id_t
 {
 public:
-  using vector = std::vector<ptrdiff_t>;
+  using path_type = ::xpath::child_path_t;
 
   node_id_t() {}
 
@@ -41,12 +50,8 @@ public:
   ) 
     : browser_id(browser_id_)
   {
-    path.reserve(10);
-    auto bg = child_path.begin();
-    std::copy(
-      ++bg, child_path.end(), 
-      std::back_inserter(path)
-    );
+    SCHECK(!child_path.empty());
+    path.assign(child_path.begin() + 1, child_path.end());
   }
 
   bool operator<(const node_id_t& o) const
@@ -57,13 +62,26 @@ public:
       return path < o.path;
   }
 
+  bool operator==(const node_id_t& o) const
+  {
+    return browser_id == o.browser_id && path == o.path;
+  }
+
+  size_t hash() const
+  {
+    size_t h = std::hash<int>()(browser_id);
+    for (const auto k : path)
+      ::xpath::hash_combine(h, k);
+    return h;
+  }
+
   operator std::string() const
   {
     return curr::sformat(*this);
   }
 
   int browser_id = 0;
-  vector path;
+  path_type path;
 };
 
 std::ostream&
@@ -74,21 +92,155 @@ operator>> (std::istream& in, node_id_t& path);
 
 } // shared
 
+namespace std {
+
+template<>
+struct hash<shared::node_id_t>
+{
+  size_t operator()(const shared::node_id_t& id) const
+  {
+    return id.hash();
+  }
+};
+
+}
+
 namespace renderer {
 
 class node_ptr;
 class node_repository;
+class node_shard;
+
+//! The memory of node objects created by one query (one
+//! node_repository::create_several_objects() call). It
+//! is freed at once by node_repository::release(). The
+//! objects are not shared with other queries.
+class node_arena
+{
+public:
+  //! A string copied into the arena (not 0-terminated)
+  struct string_ref
+  {
+    const char* data;
+    uint32_t length;
+
+    std::string str() const
+    {
+      return std::string(data, length);
+    }
+  };
+
+  node_arena() {}
+  node_arena(const node_arena&) = delete;
+  node_arena& operator=(const node_arena&) = delete;
+
+  //! Returns size bytes aligned for any type
+  void* allocate(size_t size);
+
+  string_ref copy(const std::string& s);
+
+  //! Copies the path except the first (context) index
+  const xpath::child_path_t::value_type* 
+  copy_path(const xpath::child_path_t& path);
+
+  //! The number of node objects in the arena
+  size_t n_objects() const
+  {
+    return n_objects_;
+  }
+
+  //! The bytes held by the arena: its chunks and itself
+  size_t memory() const
+  {
+    return sizeof(node_arena) + reserved;
+  }
+
+  //! A new value of the global use clock (see
+  //! last_use)
+  static uint64_t next_tick();
+
+  //! The query number, it is unique in the process
+  uint64_t get_query() const
+  {
+    return query;
+  }
 
+protected:
+  friend class node_obj;
+  friend class node_shard;
+
+  //! Chunks grow from the min size to the max one, so a
+  //! small query does not hold a big chunk
+  static constexpr size_t min_chunk_size = 1024;
+  static constexpr size_t max_chunk_size = 16 * 1024;
+
+  std::vector<std::unique_ptr<char[]>> chunks;
+  char* top = nullptr;
+  size_t left = 0;
+  size_t last_chunk = 0;
+  //! bytes of all chunks
+  size_t reserved = 0;
+  size_t n_objects_ = 0;
+
+  //! see get_query()
+  uint64_t query = 0;
+
+  //! The page load of the browser (see
+  //! node_shard::new_generation())
+  uint64_t generation = 0;
+
+  //! The last creation or node_repository::touch() time
+  std::atomic<uint64_t> last_use = { 0 };
+
+  //! All objects are created, the arena can be evicted
+  bool complete = false;
+
+  //! The node_repository::pin() count, a pinned arena
+  //! is not evicted
+  unsigned n_pins = 0;
+
+  bool is_evictable() const
+  {
+    return complete && n_pins == 0;
+  }
+};
+
+//! A node copy. It is allocated in the node_arena of the
+//! query with all its data, so it is trivially
+//! destructible: the arena is freed without visiting
+//! objects.
 class node_obj
 {
   template<class Query>
   friend class ::renderer::dom_visitor::query;
+  friend class ::renderer::dom_visitor::node_list;
 
   friend std::ostream&
   operator<<(std::ostream&, const node_obj&);
 
+  friend class node_shard;
+
 public:
-  using Par = ::renderer::dom_visitor::query_base;
+  //! A (name, value) attribute
+  struct attr_t
+  {
+    node_arena::string_ref name;
+    node_arena::string_ref value;
+  };
+
+  static void* operator new(size_t size, node_arena& a)
+  {
+    ++a.n_objects_;
+    return a.allocate(size);
+  }
+
+  //! The memory belongs to the arena
+  static void operator delete(void*) {}
+
+  static void operator delete(void*, node_arena& a)
+  {
+    --a.n_objects_;
+  }
 
   using iterator_base = 
     xpath::node_iterators::iterator_base<node_ptr>;
@@ -118,7 +270,7 @@ public:
 
   std::string universal_id() const 
   { 
-    return id;
+    return get_id();
   }
 
   bool IsElement() const
@@ -128,42 +280,112 @@ public:
 
   std::string GetElementTagName() const
   {
-    return tag;
+    return tag.str();
+  }
+
+  //! The attribute value or "" if it is absent
+  std::string GetElementAttribute(const std::string& name) 
+    const;
+
+  size_t GetNumberOfElementAttributes() const
+  {
+    return n_attrs;
   }
 
   CefRect GetBoundingClientRect() const
   {
-    return bounding_rect;
+    return CefRect(
+      bounding_rect.x, 
+      bounding_rect.y, 
+      bounding_rect.width, 
+      bounding_rect.height
+    );
   }
 
   shared::node_id_t get_id() const
   {
+    shared::node_id_t id;
+    id.browser_id = browser_id;
+    id.path.assign(path, path + path_len);
     return id;
   }
 
 protected:
+  //! The bounding rect is already known (see
+  //! dom_visitor::query::n_objects()). The object must
+  //! be allocated in the arena a.
   template<class It>
-  node_obj(int browser_id, /*FIXME const*/ It& it)
-    : id(browser_id, it.path()),
+  node_obj(
+    int browser_id_, 
+    /*FIXME const*/ It& it,
+    const CefRect& rect,
+    node_arena& a
+  )
+    : browser_id(browser_id_),
+      path(a.copy_path(it.path())),
+      path_len(it.path().size() - 1),
       type(it->get_type()),
-      tag(it->tag_name()),
-      bounding_rect((*it)->GetBoundingClientRect())
+      tag(a.copy(it->tag_name())),
+      bounding_rect{
+        rect.x, rect.y, rect.width, rect.height
+      }
   {
+    n_attrs = it->n_attrs();
+    if (n_attrs == 0)
+      return;
+
+    attrs = static_cast<attr_t*>
+      (a.allocate(n_attrs * sizeof(attr_t)));
+    uint32_t k = 0;
     auto as = it->attribute();
-    for (std::pair<std::string, std::string> p : *as)
-      attrs.insert(p);
+    for (std::pair<std::string, std::string> p : *as) {
+      SCHECK(k < n_attrs);
+      attrs[k++] = { a.copy(p.first), a.copy(p.second) };
+    }
+    n_attrs = k;
   }
 
-  const shared::node_id_t id;
+  template<class It>
+  node_obj(
+    int browser_id_, 
+    /*FIXME const*/ It& it,
+    node_arena& a
+  )
+    : node_obj(
+        browser_id_, 
+        it, 
+        (*it)->GetBoundingClientRect(),
+        a
+      )
+  {}
+
+  const int browser_id;
+
+  //! shared::node_id_t::path in the arena
+  const xpath::child_path_t::value_type* const path;
+  const xpath::child_path_t::size_type path_len;
+
   const xpath::node_type type;
-  const std::string tag;
-  std::map<std::string, std::string> attrs;
-  const CefRect bounding_rect;
+  //! the lower case tag name (it is not interned, see
+  //! xpath::intern_tag())
+  const node_arena::string_ref tag;
+
+  //! attributes in the document order
+  attr_t* attrs = nullptr;
+  uint32_t n_attrs = 0;
+
+  //! not CefRect: it may have a destructor
+  const cef_rect_t bounding_rect;
 
 private:
   using log = curr::Logger<node_obj>;
 };
 
+static_assert(
+  std::is_trivially_destructible<node_obj>::value,
+  "node_obj: arenas are freed without destructors"
+);
+
 std::ostream&
 operator<<(std::ostream& out, const node_obj& nd);
 
@@ -195,6 +417,21 @@ public:
 
 using node = ::xpath::node<wrap>;
 
+//! A node of a DOM snapshot (see xpath_snapshot.h)
+using snapshot_node = 
+  ::xpath::node<::xpath::snapshot::node_ptr>;
+
+//! Finds live nodes by their child paths from the
+//! document node root (path[0] is the root). The paths
+//! are in the document order, so one walk shares their
+//! prefixes and goes forward by siblings. Returns false
+//! if a node is not found.
+bool find_live_nodes(
+  CefRefPtr<CefDOMNode> root,
+  const std::vector<const ::xpath::child_path_t*>& paths,
+  std::vector<CefRefPtr<CefDOMNode>>& nodes
+);
+
 class query_base
 {
 public:
@@ -208,25 +445,19 @@ public:
     LOG_TRACE(log, "dom_visitor::~query_base()");
   }
 
+  //! The number of objects to create
   virtual size_t n_objects(
-    const curr::ObjectCreationInfo& oi
+    const renderer::node_shard& rep
   ) = 0;
 
-  virtual shared::node_id_t get_id(
-    const curr::ObjectCreationInfo& oi
-  ) const = 0;
-
+  //! Creates the next object in the arena
   virtual renderer::node_obj* create_next_derivation(
-    const curr::ObjectCreationInfo& oi
+    const renderer::node_shard& rep
   ) = 0;
 
-  renderer::node_obj* create_derivation
-    (const curr::ObjectCreationInfo& oi) const
-  { THROW_NOT_IMPLEMENTED; }
-
-  renderer::node_obj* transform_object
-    (const renderer::node_obj*) const
-  { THROW_NOT_IMPLEMENTED; }
+  //! The arena for objects being created, it is set by
+  //! node_shard::create_several_objects()
+  renderer::node_arena* arena = nullptr;
 
 private:
   using log = curr::Logger<query_base>;
@@ -240,10 +471,22 @@ class query
 public:
   using xpath_query = Query;
   using xpath_query_result = typename Query::result;
+  using node_ptr_type = typename Query::node_ptr_type;
+
+  // An object identifies a node by its child path from
+  // the document context (node_obj::get_id()). Upward
+  // and sibling axes leave uninitialized indexes there,
+  // so their ids collide.
+  static_assert(
+    ::xpath::step::path_order<typename Query::axis_type>
+      ::value != 0,
+    "dom_visitor::query: the axis must select nodes "
+    "by paths down from the context"
+  );
 
   struct result : query_base::result, xpath_query_result {};
 
-  node context;
+  ::xpath::node<node_ptr_type> context;
 
   query(const Query& q) : Query(q) {}
 
@@ -252,47 +495,325 @@ public:
     LOG_TRACE(log, "dom_visitor::~query()");
   }
 
-  size_t n_objects(const curr::ObjectCreationInfo& oi)
-    override
+  //! Skips first n matches (it is for the repository
+  //! query and visit())
+  query&& skip(size_t n) &&
+  {
+    skip_n = n;
+    return std::move(*this);
+  }
+
+  //! Stops after n matches
+  query&& limit(size_t n) &&
+  {
+    limit_n = n;
+    return std::move(*this);
+  }
+
+  //! Selects only the k-th (0-based) match
+  query&& nth(size_t k) &&
+  {
+    return std::move(*this).skip(k).limit(1);
+  }
+
+  //! Counts matches up to the limit only, the traversal
+  //! stops there. Bounding rects of the counted matches
+  //! are fetched here in one batch.
+  size_t n_objects(const renderer::node_shard&) override
   {
     LOG_TRACE(log, "n_objects");
-    result = this->execute(context);
-    return result.size(&cur);
+    rects.clear();
+    n_created = 0;
+
+    typename Query::iterator nd;
+    if (!start(&nd))
+      return 0;
+
+    // collect nodes for rects in the same pass
+    std::vector<CefRefPtr<CefDOMNode>> nodes;
+    std::vector<::xpath::child_path_t> paths;
+    size_t n = 0;
+    for (auto it = cur; n < limit_n && it != nd; ++it) {
+      add_rect_node(
+        nodes, 
+        paths,
+        it, 
+        static_cast<node_ptr_type*>(nullptr)
+      );
+      ++n;
+    }
+
+    load_rects(
+      nodes, 
+      paths, 
+      static_cast<node_ptr_type*>(nullptr)
+    );
+    return n;
   }
 
-  shared::node_id_t get_id(
-    const curr::ObjectCreationInfo& oi
-  ) const override;
+  //! Calls fun(node, child_path) for each match in the
+  //! document order, stops when fun returns false or
+  //! after the limit. Returns the number of calls. It is
+  //! a single pass (see xpath::step::forward_scan).
+  template<class Fun>
+  size_t for_each(Fun&& fun)
+  {
+    if (limit_n == 0)
+      return 0;
+
+    result = this->execute(context);
+    size_t skipped = 0, n = 0;
+    result.for_each(
+      [this, &fun, &skipped, &n](
+        const ::xpath::node<node_ptr_type>& nd,
+        const ::xpath::child_path_t& path
+      )
+      {
+        if (skipped < skip_n) {
+          ++skipped;
+          return true;
+        }
+        ++n;
+        return fun(nd, path) && n < limit_n;
+      }
+    );
+    return n;
+  }
 
   renderer::node_obj* create_next_derivation(
-    const curr::ObjectCreationInfo& oi
+    const renderer::node_shard& rep
   ) override;
 
+  //! Sets the context to the document node. A query
+  //! over snapshot nodes captures the document here.
+  void set_document(CefRefPtr<CefDOMDocument> d)
+  {
+    set_document(d, static_cast<node_ptr_type*>(nullptr));
+  }
+
   //! release all CefDOMNodes
   void release()
   {
-    context = renderer::dom_visitor::node();
+    context = ::xpath::node<node_ptr_type>();
     result = xpath_query_result();
     cur = typename Query::iterator();
+    snapshot.reset();
+    live_root = nullptr;
+    rects.clear();
   }
 
 protected:
+  //! Executes the query and moves cur to the first match
+  //! after skip_n ones. Returns false if there are no
+  //! such matches.
+  bool start(typename Query::iterator* nd)
+  {
+    result = this->execute(context);
+    cur = result.begin();
+    if (cur.is_empty())
+      return false;
+
+    *nd = result.end();
+    for (size_t k = 0; k < skip_n; k++) {
+      if (cur == *nd)
+        return false;
+      ++cur;
+    }
+    return cur != *nd;
+  }
+
+  void add_rect_node(
+    std::vector<CefRefPtr<CefDOMNode>>& nodes,
+    std::vector<::xpath::child_path_t>&,
+    /*FIXME const*/ typename Query::iterator& it,
+    wrap*
+  )
+  {
+    nodes.push_back((wrap) *it);
+  }
+
+  //! A snapshot node is found in the live DOM by its
+  //! path
+  void add_rect_node(
+    std::vector<CefRefPtr<CefDOMNode>>&,
+    std::vector<::xpath::child_path_t>& paths,
+    /*FIXME const*/ typename Query::iterator& it,
+    ::xpath::snapshot::node_ptr*
+  )
+  {
+    if (live_root.get())
+      paths.push_back(it.path());
+  }
+
+  //! Gets bounding rects of the nodes with one
+  //! CefDOMNode::GetBoundingClientRects() call (one
+  //! layout update instead of a call per node). Rects
+  //! stay empty if the call is missing (an older
+  //! library), create_next_derivation() asks each node
+  //! then.
+  void load_rects(
+    const std::vector<CefRefPtr<CefDOMNode>>& nodes,
+    const std::vector<::xpath::child_path_t>&,
+    wrap*
+  )
+  {
+    if (nodes.empty())
+      return;
+
+    context->GetBoundingClientRects(nodes, rects);
+    if (rects.size() != nodes.size()) {
+      LOG_DEBUG(log, "no batch rects, got " 
+                << rects.size() << " of " 
+                << nodes.size());
+      rects.clear();
+    }
+  }
+
+  //! The snapshot is captured without rects (a layout
+  //! update per element), only matches get them. Rects
+  //! stay empty if a node is not found (the DOM is
+  //! changed).
+  void load_rects(
+    std::vector<CefRefPtr<CefDOMNode>>& nodes,
+    const std::vector<::xpath::child_path_t>& paths,
+    ::xpath::snapshot::node_ptr*
+  )
+  {
+    if (paths.empty())
+      return;
+
+    std::vector<const ::xpath::child_path_t*> ps;
+    ps.reserve(paths.size());
+    for (const auto& p : paths)
+      ps.push_back(&p);
+
+    if (!find_live_nodes(live_root, ps, nodes)) {
+      LOG_WARN(log, "a match is not found in the DOM, "
+               "no rects are loaded");
+      return;
+    }
+
+    live_root->GetBoundingClientRects(nodes, rects);
+    if (rects.size() != nodes.size()) {
+      // an older library
+      rects.clear();
+      for (const auto& n : nodes)
+        rects.push_back(n->GetBoundingClientRect());
+    }
+  }
+
+  void set_document(CefRefPtr<CefDOMDocument> d, wrap*)
+  {
+    context = wrap(d->GetDocument());
+  }
+
+  void set_document(
+    CefRefPtr<CefDOMDocument> d, 
+    ::xpath::snapshot::node_ptr*
+  )
+  {
+    live_root = d->GetDocument();
+    snapshot = ::xpath::snapshot::document::capture
+      (live_root, false);
+    context = snapshot->root();
+  }
+
   xpath_query_result result;
   typename Query::iterator cur;
 
+  //! the document copy for snapshot queries
+  std::shared_ptr<const ::xpath::snapshot::document> 
+    snapshot;
+
+  //! the live document node of the snapshot (see
+  //! set_document())
+  CefRefPtr<CefDOMNode> live_root;
+
+  //! bounding rects of the matches from n_objects()
+  std::vector<CefRect> rects;
+
+  //! node objects created since n_objects()
+  size_t n_created = 0;
+
+  size_t skip_n = 0;
+  size_t limit_n = std::numeric_limits<size_t>::max();
+
 private:
   using log = curr::Logger<query>;
 };
 
+//! Nodes already selected (see
+//! node_repository::query_batch()) as a repository
+//! parameter. Nodes are from a snapshot, so node
+//! objects are created without DOM calls except
+//! load_rects(). Attribute nodes are skipped.
+class node_list : public query_base
+{
+public:
+  explicit node_list(
+    const std::vector<snapshot_node>& nodes
+  );
+
+  //! Finds live nodes of the list by their child paths
+  //! from the document node root and gets their
+  //! bounding rects with one
+  //! CefDOMNode::GetBoundingClientRects() call. So only
+  //! results need a layout, the snapshot can be
+  //! captured without rects. Without this call objects
+  //! get rects of the snapshot.
+  void load_rects(CefRefPtr<CefDOMNode> root);
+
+  size_t n_objects(const renderer::node_shard& rep) 
+    override;
+
+  renderer::node_obj* create_next_derivation(
+    const renderer::node_shard& rep
+  ) override;
+
+protected:
+  //! A node with its child path. It has the iterator
+  //! interface used by the node_obj constructor.
+  struct entry
+  {
+    snapshot_node nd;
+    ::xpath::child_path_t child_path;
+
+    const ::xpath::child_path_t& path() const
+    {
+      return child_path;
+    }
+
+    const snapshot_node* operator->() const
+    {
+      return &nd;
+    }
+
+    const snapshot_node& operator*() const
+    {
+      return nd;
+    }
+  };
+
+  std::vector<entry> entries;
+  size_t cur = 0;
+
+  //! rects of entries from load_rects()
+  std::vector<CefRect> rects;
+
+private:
+  using log = curr::Logger<node_list>;
+};
+
 template<
+  class NodePtr,
   class axis,
   template<class> class Test,
   class TestArg
 >
 query<
   ::xpath::step::query<
-    wrap,
-    Test<::xpath::step::prim_iterator_t<wrap, axis>>,
+    NodePtr,
+    Test<::xpath::step::prim_iterator_t<NodePtr, axis>>,
     axis, 
     true
   >
@@ -302,20 +823,40 @@ build_query(TestArg&& test_arg, bool f)
   return 
 query<
   ::xpath::step::query<
-    wrap,
-    Test<::xpath::step::prim_iterator_t<wrap, axis>>,
+    NodePtr,
+    Test<::xpath::step::prim_iterator_t<NodePtr, axis>>,
     axis, 
     true
   >
 >
   (::xpath::step::build_query
-    <wrap, axis, Test, TestArg>
+    <NodePtr, axis, Test, TestArg>
   (
     std::forward<TestArg>(test_arg),
     f
   ));
 }
 
+//! A live DOM query
+template<
+  class axis,
+  template<class> class Test,
+  class TestArg
+>
+query<
+  ::xpath::step::query<
+    wrap,
+    Test<::xpath::step::prim_iterator_t<wrap, axis>>,
+    axis, 
+    true
+  >
+>
+build_query(TestArg&& test_arg, bool f)
+{
+  return build_query<wrap, axis, Test, TestArg>
+    (std::forward<TestArg>(test_arg), f);
+}
+
 template<
   template<class> class Test,
   class TestArg,
@@ -323,7 +864,7 @@ template<
 >
 query<
   ::xpath::step::query<
-    wrap, 
+    typename NestedQuery::node_ptr_type,
     Test<typename NestedQuery::iterator>,
     typename NestedQuery::xpath_query,
     false
@@ -334,34 +875,190 @@ build_query(
   NestedQuery&& nested_query
 )
 {
+  using node_ptr_type = typename NestedQuery::node_ptr_type;
+
   return 
 query<
   ::xpath::step::query<
-    wrap, 
+    node_ptr_type,
     Test<typename NestedQuery::iterator>,
     typename NestedQuery::xpath_query,
     false
   >
 >
   (::xpath::step::build_query
-    <wrap, Test, TestArg, typename NestedQuery::xpath_query>
+    <
+      node_ptr_type, 
+      Test, 
+      TestArg, 
+      typename NestedQuery::xpath_query
+    >
   (
     std::forward<TestArg>(test_arg),
     std::forward<NestedQuery>(nested_query)
   ));
 }
 
+//! q1 | q2, the result is in the document order without
+//! duplicates (see xpath::step::make_union)
+template<class Query1, class Query2>
+auto make_union(
+  const query<Query1>& q1, 
+  const query<Query2>& q2
+) -> query<decltype(
+       ::xpath::step::make_union(
+         std::declval<const Query1&>(), 
+         std::declval<const Query2&>()
+       )
+     )>
+{
+  return ::xpath::step::make_union(
+    static_cast<const Query1&>(q1), 
+    static_cast<const Query2&>(q2)
+  );
+}
+
 } // dom_visitor
 
+//! Node objects of one browser (a node_repository
+//! shard). Queries for different browsers use different
+//! shards and do not share locks. Objects are indexed
+//! by their query arena only, so a result is deleted at
+//! once with its arena.
+class node_shard
+{
+public:
+  //! Objects of one query result in the document
+  //! order. It keeps the query number, so release(),
+  //! touch() and pin() find the arena without reading
+  //! objects, they may be evicted already.
+  class list_type : public std::vector<node_obj*>
+  {
+  public:
+    list_type() {}
+
+    list_type(int browser_id_, uint64_t query_)
+      : browser_id(browser_id_),
+        query(query_)
+    {}
+
+    int get_browser_id() const
+    {
+      return browser_id;
+    }
+
+    //! node_arena::get_query() of the objects, 0 for an
+    //! empty result
+    uint64_t get_query() const
+    {
+      return query;
+    }
+
+  protected:
+    friend class node_shard;
+
+    int browser_id = 0;
+    uint64_t query = 0;
+  };
+
+  explicit node_shard(int browser_id_);
+
+  //! All objects of the shard are of this browser
+  int get_current_browser_id() const
+  {
+    return browser_id;
+  }
+
+  //! Creates objects in a new arena
+  list_type create_several_objects(
+    dom_visitor::query_base& param
+  );
+
+  //! Deletes objects of the query result and frees its
+  //! arena. It does nothing if the result is evicted
+  //! already.
+  void release(const list_type& objs);
+
+  //! Marks the query of objs as used now (for the LRU
+  //! eviction)
+  void touch(const list_type& objs);
+
+  //! Protects the query result from eviction until
+  //! unpin(). Returns false if it is evicted or released
+  //! already.
+  bool pin(const list_type& objs);
+
+  void unpin(const list_type& objs);
+
+  //! Starts a new page load. Objects of previous page
+  //! loads are evicted.
+  void new_generation();
+
+  //! Appends (last use, query) of queries which can be
+  //! evicted and are used before `before'
+  void lru_queries(
+    uint64_t before,
+    std::vector<std::pair<uint64_t, uint64_t>>& out
+  ) const;
+
+  //! Evicts the query if it is not used or pinned after
+  //! lru_queries() returned `use'. Returns the freed
+  //! bytes.
+  size_t evict(uint64_t query, uint64_t use);
+
+  //! The number of arenas (queries)
+  size_t n_arenas() const
+  {
+    RLOCK(arenas_mx);
+    return arenas.size();
+  }
+
+  //! The number of objects
+  size_t size() const
+  {
+    return n_objects_;
+  }
+
+  //! The arena bytes (see node_arena::memory())
+  size_t memory() const
+  {
+    return memory_;
+  }
+
+  //! The number of evicted objects
+  size_t n_evicted() const
+  {
+    return n_evicted_;
+  }
+
+protected:
+  //! Frees the query arena with its objects, arenas_mx
+  //! must be locked. Returns the freed bytes.
+  size_t drop(uint64_t query, bool is_eviction);
+
+  const int browser_id;
+  uint64_t generation = 0;
+
+  mutable curr::RMutex arenas_mx = 
+    { "renderer::node_shard::arenas_mx" };
+
+  //! arenas by node_arena::get_query()
+  std::unordered_map<
+    uint64_t, 
+    std::unique_ptr<node_arena>
+  > arenas;
+
+  std::atomic<size_t> n_objects_ = { 0 };
+  std::atomic<size_t> memory_ = { 0 };
+  std::atomic<size_t> n_evicted_ = { 0 };
+};
+
 class node_repository :
-  public curr::SAutoSingleton<node_repository>,
-  public curr::SparkRepository<
-    renderer::node_obj, 
-    dom_visitor::query_base,
-    std::map,
-    shared::node_id_t
-  >
+  public curr::SAutoSingleton<node_repository>
 {
+public:
+  using list_type = node_shard::list_type;
+
 protected:
 
 template<class Query>
@@ -385,8 +1082,7 @@ public:
   void Visit(CefRefPtr<CefDOMDocument> d) override
   {
     
-    query.context = renderer::dom_visitor::wrap
-      (d->GetDocument());
+    query.set_document(d);
     result_list = node_rep.create_several_objects
       (browser_id, query);
     // reset the context to release the DOM
@@ -408,20 +1104,74 @@ private:
   IMPLEMENT_REFCOUNTING();
 };
 
+//! Passes query matches to a function, does not create
+//! node objects
+template<class Query, class Fun>
+class FunVisitor : public CefDOMVisitor
+{
+public:
+  FunVisitor(Query&& q, Fun&& f) 
+    : query(std::move(q)),
+      fun(std::forward<Fun>(f))
+  {}
+
+  // DOM is valid only inside this function
+  // do not store DOM externally!
+  void Visit(CefRefPtr<CefDOMDocument> d) override
+  {
+    query.set_document(d);
+    n_visited = query.for_each(fun);
+    // reset the context to release the DOM
+    query.release();
+  }
+
+  size_t get_n_visited() const
+  {
+    return n_visited;
+  }
+
+protected:
+  Query query;
+  typename std::decay<Fun>::type fun;
+  size_t n_visited = 0;
+
+private:
+  IMPLEMENT_REFCOUNTING();
+};
+
+//! Runs a runtime::batch and creates node objects for
+//! each of its plans
+class BatchVisitor : public CefDOMVisitor
+{
 public:
-  using Spark = curr::SparkRepository<
-    renderer::node_obj, 
-    dom_visitor::query_base,
-    std::map,
-    shared::node_id_t
-  >;
+  BatchVisitor(
+    node_repository& rep,
+    int browser_id_,
+    const std::vector<std::string>& xpaths
+  );
 
-  node_repository()
-    : Spark("renderer::node_repository", 0)
+  // DOM is valid only inside this function
+  // do not store DOM externally!
+  void Visit(CefRefPtr<CefDOMDocument> d) override;
+
+  std::vector<list_type> get_result_lists() const
   {
-    this->complete_construction();
+    return result_lists;
   }
 
+protected:
+  node_repository& node_rep;
+  const ::xpath::runtime::batch batch;
+  std::vector<list_type> result_lists;
+  int browser_id;
+
+private:
+  IMPLEMENT_REFCOUNTING();
+};
+
+public:
+  node_repository() {}
+
   template<class Query>
   list_type query(int browser_id, Query&& q)
   {
@@ -437,66 +1187,164 @@ public:
       (visitor.get())->get_result_list();
   }
 
-  //! Adds current_browser_id (thread protected) set
+  //! Calls fun(node, child_path) for query matches
+  //! inside VisitDOM while it returns true. Nodes are
+  //! valid only inside fun. Snapshot nodes have no
+  //! bounding rects. Returns the number of calls.
+  template<class Query, class Fun>
+  size_t visit(int browser_id, Query&& q, Fun&& fun)
+  {
+    CefRefPtr<CefDOMVisitor> visitor = 
+      new FunVisitor<Query, Fun>
+        (std::move(q), std::forward<Fun>(fun));
+
+    curr::RHolder<shared::browser>(browser_id) -> br
+      -> GetMainFrame() -> VisitDOM(visitor); 
+
+    return dynamic_cast<FunVisitor<Query, Fun>*>
+      (visitor.get())->get_n_visited();
+  }
+
+  //! Evaluates XPath strings (see xpath_plan.h) in one
+  //! VisitDOM. Paths starting with // share a single
+  //! document traversal. Returns the result list of
+  //! each xpath in the same order. Throws
+  //! xpath::runtime::syntax_error.
+  std::vector<list_type> query_batch(
+    int browser_id,
+    const std::vector<std::string>& xpaths
+  );
+
+  //! Creates objects in the browser shard and evicts
+  //! least recently used queries above the memory cap
   list_type create_several_objects(
     int browser_id,
     dom_visitor::query_base& param
   );
 
-  int get_current_browser_id() const
+  //! The objects of the browser. The shard is created on
+  //! the first use. remove_shard() does not destroy it
+  //! while the pointer is held.
+  std::shared_ptr<node_shard> shard(int browser_id);
+
+  //! Deletes objects of a query result (e.g., a query()
+  //! result). The object memory is freed per query, not
+  //! per object.
+  //!
+  //! A result is valid until release(), a navigation
+  //! (new_generation()) or the eviction above the memory
+  //! cap, whichever is first. Pin results held across
+  //! other queries. release(), touch() and pin() of an
+  //! evicted result do nothing.
+  void release(const list_type& objs);
+
+  //! Marks a query result as recently used
+  void touch(const list_type& objs);
+
+  //! Protects a query result from eviction (both by a
+  //! navigation and by the memory cap) until unpin().
+  //! Returns false if the result is not valid already.
+  bool pin(const list_type& objs);
+
+  void unpin(const list_type& objs);
+
+  //! Evicts objects of previous page loads of the
+  //! browser, it is called on a navigation
+  void new_generation(int browser_id);
+
+  //! Deletes all objects of the browser (see
+  //! OnBrowserDestroyed)
+  void remove_shard(int browser_id);
+
+  //! Deletes all objects
+  void clear();
+
+  //! The arena memory limit for all browsers. Least
+  //! recently used queries are evicted above it.
+  void set_memory_cap(size_t bytes)
   {
-    return current_browser_id;
+    memory_cap = bytes;
   }
 
+  size_t get_memory_cap() const
+  {
+    return memory_cap;
+  }
+
+  struct stats
+  {
+    size_t n_objects = 0;
+    //! the number of query results (arenas)
+    size_t n_queries = 0;
+    //! arena bytes
+    size_t memory = 0;
+    //! evicted objects (not release()d)
+    size_t n_evicted = 0;
+    //! objects of removed shards (remove_shard(),
+    //! clear())
+    size_t n_removed = 0;
+  };
+
+  stats get_stats() const;
+
+  static constexpr size_t default_memory_cap = 
+    64 * 1024 * 1024;
+
+  //! The number of objects in all shards
+  size_t size() const;
+
 protected:
-  int current_browser_id = 0;
-};
+  //! Evicts least recently used queries used before
+  //! `before' while the memory is above the cap
+  void enforce_cap(uint64_t before);
 
-namespace dom_visitor {
+  //! It guards only the shards map, not the objects
+  mutable curr::RMutex shards_mx = 
+    { "renderer::node_repository::shards_mx" };
 
-template<class Query>
-shared::node_id_t query<Query>
-//
-::get_id(
-  const curr::ObjectCreationInfo& oi
-) const
-{
-  const auto* rep = 
-    dynamic_cast<const renderer::node_repository*>
-    (oi.repository);
-  SCHECK(rep);
+  std::unordered_map<int, std::shared_ptr<node_shard>> 
+    shards;
 
-  const auto id = shared::node_id_t(
-    rep->get_current_browser_id(), cur.path()
-    );
+  std::atomic<size_t> memory_cap = { default_memory_cap };
 
-  LOG_TRACE(log, "get_id " << cur.path() << " -> " << id);
-  return id;
-}
+  //! objects of removed shards
+  std::atomic<size_t> n_removed = { 0 };
+
+  //! The shard of the browser or nullptr, it is not
+  //! created
+  std::shared_ptr<node_shard> find_shard(int browser_id) 
+    const;
+
+private:
+  using log = curr::Logger<node_repository>;
+};
+
+namespace dom_visitor {
 
 template<class Query>
 renderer::node_obj* query<Query>
 //
-::create_next_derivation(
-  const curr::ObjectCreationInfo& oi
-)
+::create_next_derivation(const renderer::node_shard& rep)
 {
-  const auto* rep = dynamic_cast<const node_repository*>
-    (oi.repository);
-  SCHECK(rep);
-  SCHECK(rep->get_current_browser_id() > 0);
+  SCHECK(rep.get_current_browser_id() > 0);
 
   LOG_TRACE(log, 
             "create_next_derivation "
             << "cur.path() == " << cur.path()
-            << ", oi.objectId == " << oi.objectId
     );
-  auto obj = new renderer::node_obj(
-    rep->get_current_browser_id(),
+  const CefRect rect = n_created < rects.size()
+    ? rects[n_created]
+    : (*cur)->GetBoundingClientRect();
+  SCHECK(arena);
+  auto obj = new (*arena) renderer::node_obj(
+    rep.get_current_browser_id(),
     /*FIXME*/ const_cast<typename Query::iterator&>
-    (cur)
+    (cur),
+    rect,
+    *arena
     );
   ++cur;
+  ++n_created;
   return obj;
 }
 
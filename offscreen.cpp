@@ -19,6 +19,7 @@
 #include "offscreen.h"
 #include "task.h"
 #include "browser.h"
+#include "dom.h"
 #include "proc_browser.h"
 #include "dom_event.h"
 #include "search.h"
@@ -213,6 +214,10 @@ void load::OnLoadStart
   REQUIRE_RENDERER_THREAD(); // for VisitDOM
 try {
   if (fr->IsMain()) {
+    // node objects of the previous page are invalid
+    ::renderer::node_repository::instance()
+      .new_generation(br->GetIdentifier());
+
     fr->VisitDOM(
       new Visitor(
         RHolder<shared::browser>(br->GetIdentifier())
@@ -262,6 +267,9 @@ void renderer::OnBrowserDestroyed(CefRefPtr<CefBrowser> br)
     browser_repository::instance().delete_object_by_id
       (br_id, true);
   }
+
+  ::renderer::node_repository::instance()
+    .remove_shard(br_id);
 }
 
 }}
@@ -23,13 +23,22 @@ using namespace curr;
 
 namespace renderer {
 
-void node_obj::take_screenshot(
+namespace {
+
+using log = curr::Logger<node_obj>;
+
+//! Takes the screenshot of the rect r of the browser.
+//! It uses only copies of the node data (the node
+//! object can be evicted before a delayed screenshot).
+//! descr is the node for messages.
+void take_screenshot(
+  int browser_id,
+  const CefRect& r,
+  const std::string& descr,
   const std::string& fname,
   bool prepend_timestamp
 )
 {
-  LOG_TRACE(log, "take_screenshot()");
-
   using namespace std;
   using namespace std::chrono;
   using namespace curr::types;
@@ -37,7 +46,6 @@ void node_obj::take_screenshot(
   static const char* time_format = "utc%y%m%d_%H%M%S";
 
   LOG_INFO(log, "Taking the screenshot");
-  const CefRect& r = bounding_rect;
 
 #ifndef HAS_PUT_TIME
   // GCC has no std::put_time
@@ -76,7 +84,7 @@ void node_obj::take_screenshot(
     : fname;
 
   if (r.width == 0 || r.height == 0) {
-    LOG_ERROR(log, "the node " << *this
+    LOG_ERROR(log, "the node " << descr
       << "area is empty, do not store " << png_name);
     return;
   }
@@ -87,7 +95,7 @@ void node_obj::take_screenshot(
       CefProcessMessage::Create("take_screenshot");
 
     LOG_TRACE(log, "1");
-    msg->GetArgumentList()->SetInt(0, id.browser_id);
+    msg->GetArgumentList()->SetInt(0, browser_id);
     LOG_TRACE(log, "2");
     msg->GetArgumentList()->SetInt(1, r.x);
     LOG_TRACE(log, "3");
@@ -103,7 +111,7 @@ void node_obj::take_screenshot(
     );
     LOG_TRACE(log, "7");
 
-    RHolder<shared::browser>(id.browser_id)
+    RHolder<shared::browser>(browser_id)
       -> get_cef_browser() 
       -> SendProcessMessage(PID_BROWSER, msg);
   }
@@ -112,31 +120,63 @@ void node_obj::take_screenshot(
 
 // TODO make a function wrapper like CefRunnableMethod
 // but without Cef ref counting (is it possible?)
+//! It keeps copies of the node data, not the node
+//! object
 class tmp_task : public CefTask
 {
 public:
   tmp_task(
-    node_obj& obj_,
-    const std::string& fname_
+    const node_obj& obj,
+    const std::string& fname_,
+    bool prepend_timestamp_
   ) 
-    : obj(obj_), 
-      fname(fname_)
+    : browser_id(obj.get_id().browser_id),
+      rect(obj.GetBoundingClientRect()),
+      descr(sformat(obj)),
+      fname(fname_),
+      prepend_timestamp(prepend_timestamp_)
   {}
 
   void Execute() override
   {
     std::cout << "test_task::Execute()" << std::endl;
-    obj.take_screenshot(fname, true);
+    take_screenshot(
+      browser_id, 
+      rect, 
+      descr, 
+      fname, 
+      prepend_timestamp
+    );
   }
 
 protected:
-  node_obj& obj;
-  std::string fname;
+  const int browser_id;
+  const CefRect rect;
+  const std::string descr;
+  const std::string fname;
+  const bool prepend_timestamp;
 
 private:
   IMPLEMENT_REFCOUNTING(test_task);
 };
 
+}
+
+void node_obj::take_screenshot(
+  const std::string& fname,
+  bool prepend_timestamp
+)
+{
+  LOG_TRACE(log, "take_screenshot()");
+  renderer::take_screenshot(
+    browser_id,
+    GetBoundingClientRect(),
+    sformat(*this),
+    fname,
+    prepend_timestamp
+  );
+}
+
 void node_obj::take_screenshot_delayed(
   const std::string& fname,
   node_obj::duration delay,
@@ -147,7 +187,7 @@ void node_obj::take_screenshot_delayed(
 
   CefPostDelayedTask(
     TID_RENDERER, 
-    new tmp_task(*this, fname),
+    new tmp_task(*this, fname, prepend_timestamp),
     std::chrono::duration_cast<std::chrono::milliseconds>
       (delay).count()
   );
@@ -20,6 +20,14 @@ void get_png::Execute()
   using namespace renderer;
   using namespace shared;
 
+  if (flash_num < 1) {
+    LOG_ERROR(log, "task1: the flash number " << flash_num
+      << " is not 1-based");
+    return;
+  }
+
+  // only the flash_num-th object is created, the
+  // traversal stops on it
   auto list = node_repository::instance().query(
     browser_id,
     dom_visitor::build_query<::xpath::test::fun>(
@@ -34,31 +42,21 @@ void get_png::Execute()
         "object",
         true
       )
-    )
+    ).nth(flash_num - 1)
   );
 
+  // the traversal stops on the selected object, so it is
+  // the only one counted
   LOG_INFO(log, 
     "task1: got " << list.size() << " objects");
 
-  if (list.empty())
+  if (list.empty()) {
+    LOG_ERROR(log, "No flash no " << flash_num
+      << " on the page");
     return;
-
-  for (auto ptr : list)
-    LOG_INFO(log, ptr->universal_id() << '\t' << *ptr);
-
-  auto flash = list.cbegin();
-  for(int k = 1; k < flash_num; k++)
-  {
-    if (flash == list.cend()) {
-      LOG_ERROR(log, "No flash no " << flash_num
-        << " on the page, there are only "
-        << list.size() << " flash objects"
-      );
-      return;
-    }
-    ++flash;
   }
 
+  const auto flash = list.cbegin();
   LOG_DEBUG(log, "task1: " << **flash << " is selected");
 
   string fname = sformat(
@@ -70,6 +68,8 @@ void get_png::Execute()
 
   (*flash)->take_screenshot_delayed
     (fname, seconds(23), false);
+  // the delayed task keeps copies of the node data
+  node_repository::instance().release(list);
 }
 
 }
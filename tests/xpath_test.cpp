@@ -3,6 +3,9 @@
 #include <string.h>
 #include <atomic>
 #include <functional>
+#include <unordered_set>
+#include <chrono>
+#include <thread>
 #include <boost/filesystem.hpp>
 #include "include/cef_command_line.h"
 #include "include/cef_task.h"
@@ -10,6 +13,8 @@
 #include "Event.h"
 #include "RHolder.hpp"
 #include "xpath.h"
+#include "xpath_bitmap.h"
+#include "xpath_plan.h"
 #include "dom.h"
 #include "offscreen.h"
 #include "browser.h"
@@ -50,6 +55,19 @@ void test_dom(const fun_t& fun)
     -> GetMainFrame() -> VisitDOM(new DOMVisitor(fun));
 }
 
+//! Returns the mean time of fun() in microseconds
+template<class Fun>
+double bench(int n_runs, Fun fun)
+{
+  using namespace std::chrono;
+
+  const auto start = steady_clock::now();
+  for (int k = 0; k < n_runs; k++)
+    fun();
+  return duration_cast<duration<double, std::micro>>
+    (steady_clock::now() - start).count() / n_runs;
+}
+
 }
 
 TEST(XpathBasic, Wrap) {
@@ -61,6 +79,40 @@ TEST(XpathBasic, Wrap) {
   });
 }
 
+TEST(XpathBasic, TagAtoms) {
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer::dom_visitor;
+    using ::xpath::intern_tag;
+    using ::xpath::atom_name;
+
+    EXPECT_EQ(::xpath::empty_atom, intern_tag(""));
+    EXPECT_EQ(intern_tag("div"), intern_tag("div"));
+    EXPECT_NE(intern_tag("div"), intern_tag("DIV"));
+    EXPECT_EQ("div", atom_name(intern_tag("div")));
+
+    // a lookup does not add names, a cached unknown name
+    // is found after it is added
+    using ::xpath::find_tag;
+    EXPECT_EQ(::xpath::unknown_atom, find_tag("x-unknown-tag"));
+    EXPECT_EQ(::xpath::unknown_atom, find_tag("x-unknown-tag"));
+    const auto atom = intern_tag("x-unknown-tag");
+    EXPECT_EQ(atom, find_tag("x-unknown-tag"));
+    EXPECT_EQ(intern_tag("div"), find_tag("div"));
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const auto end = node(r).descendant()->end();
+    auto it = node(r).descendant()->begin();
+    auto sit = snapshot_node(doc->root()).descendant()->begin();
+    for (; it != end; ++it, ++sit) {
+      // the capture keeps names without interning them
+      EXPECT_EQ(it->tag_name(), sit->tag_name());
+      EXPECT_EQ(intern_tag(it->tag_name()), it->tag_atom());
+      EXPECT_EQ(it->tag_atom(), sit->tag_atom());
+    }
+  });
+}
+
 template<class It>
 void distance_test(
   It begin, 
@@ -323,6 +375,208 @@ TEST(Xpath, DescendantAxis) {
   });
 }
 
+//! Checks -- visits the axis nodes in the reverse order
+template<class Axis>
+void reverse_test(const std::shared_ptr<Axis>& ax)
+{
+  using node_ptr = typename Axis::iterator::node_ptr_type;
+
+  std::vector<node_ptr> nodes;
+  for (auto it = ax->begin(); it != ax->end(); ++it)
+    nodes.push_back(*it);
+
+  auto it = ax->end();
+  for (auto p = nodes.rbegin(); p != nodes.rend(); ++p) {
+    --it;
+    EXPECT_TRUE((*it)->IsSame(*p));
+  }
+  EXPECT_EQ(ax->begin(), it);
+}
+
+//! Checks the node axes against each other
+template<class Node>
+void axes_test(const Node& n, size_t n_nodes)
+{
+  const size_t n_anc = n.ancestor()->size();
+  const size_t n_desc = n.descendant()->size();
+  EXPECT_EQ(n_anc + 1, n.ancestor_or_self()->size());
+  EXPECT_EQ(n_desc + 1, n.descendant_or_self()->size());
+  EXPECT_EQ(n_anc ? 1 : 0, n.parent()->size());
+
+  // the document is partitioned by these axes
+  EXPECT_EQ(
+    n_nodes,
+    n_anc + n_desc + n.following()->size() 
+      + n.preceding()->size() + 1
+  );
+
+  reverse_test(n.parent());
+  reverse_test(n.ancestor());
+  reverse_test(n.ancestor_or_self());
+  reverse_test(n.descendant_or_self());
+  reverse_test(n.following());
+  reverse_test(n.preceding());
+}
+
+//! Checks the forward iterator against the cycled one
+template<class axis, class Node, class Axis>
+void forward_test(const Node& n, const std::shared_ptr<Axis>& ax)
+{
+  using node_ptr = typename Axis::iterator::node_ptr_type;
+  using forward_iterator = 
+    ::xpath::node_iterators::forward_iterator<node_ptr, axis>;
+
+  auto it = ax->begin();
+  const auto end = ax->end();
+  size_t n_fwd = 0;
+  for (forward_iterator f(n), f_end; f != f_end; ++f) {
+    ASSERT_TRUE(it != end);
+    EXPECT_TRUE((*it)->IsSame((node_ptr) *f));
+    EXPECT_EQ((std::string) it.path(), (std::string) f.path());
+    ++it;
+    ++n_fwd;
+  }
+  EXPECT_EQ(ax->size(), n_fwd);
+}
+
+template<class Node>
+void forward_axes_test(const Node& n)
+{
+  using namespace ::xpath::axis;
+
+  forward_test<self>(n, n.self());
+  forward_test<child>(n, n.child());
+  forward_test<following_sibling>(n, n.following_sibling());
+  forward_test<descendant>(n, n.descendant());
+  forward_test<descendant_or_self>(n, n.descendant_or_self());
+}
+
+TEST(Xpath, AncestorAxes) {
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer::dom_visitor;
+
+    node root(r);
+    EXPECT_EQ(0, root.parent()->size());
+    EXPECT_EQ(0, root.ancestor()->size());
+    EXPECT_EQ(1, root.ancestor_or_self()->size());
+    EXPECT_TRUE(
+      (*root.ancestor_or_self()->begin())->IsSame(root)
+    );
+
+    auto head = root.descendant()->begin() + 3;
+    EXPECT_EQ("head", head->tag_name());
+    EXPECT_EQ("html", head->parent()->begin()->tag_name());
+    EXPECT_EQ(2, head->ancestor()->size());
+    EXPECT_EQ("html", head->ancestor()->begin()->tag_name());
+    EXPECT_TRUE(
+      (*(head->ancestor()->begin() + 1))->IsSame(root)
+    );
+    EXPECT_EQ(
+      "head", 
+      head->ancestor_or_self()->begin()->tag_name()
+    );
+
+    auto body = head->following_sibling()->begin() + 1;
+    const auto img = body
+      ->child()->begin()
+      ->child()->begin()
+      ->child()->begin()
+      ->child()->begin()
+      ->child()->begin();
+    EXPECT_EQ("img", img->tag_name());
+    EXPECT_EQ(7, img->ancestor()->size());
+    EXPECT_EQ(
+      "body", 
+      (img->ancestor()->begin() + 4)->tag_name()
+    );
+    distance_test(
+      img->ancestor()->begin(),
+      img->ancestor()->end(),
+      7
+    );
+    distance_test(
+      img->ancestor_or_self()->begin(),
+      img->ancestor_or_self()->end(),
+      8
+    );
+
+    // descendant_or_self starts from the context node
+    auto ds = head->descendant_or_self();
+    EXPECT_EQ("head", ds->begin()->tag_name());
+    EXPECT_EQ(".", (std::string) ds->begin().path());
+    EXPECT_EQ("meta", (ds->begin() + 1)->tag_name());
+    EXPECT_EQ("0", (std::string) (ds->begin() + 1).path());
+    distance_test(ds->begin(), ds->end(), ds->size());
+  });
+}
+
+TEST(Xpath, FollowingPrecedingAxes) {
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer::dom_visitor;
+
+    node root(r);
+    const size_t n_nodes = root.descendant()->size() + 1;
+    EXPECT_EQ(0, root.following()->size());
+    EXPECT_EQ(0, root.preceding()->size());
+
+    auto head = root.descendant()->begin() + 3;
+    EXPECT_EQ("head", head->tag_name());
+
+    // the preceding axis is reversed
+    EXPECT_EQ(2, head->preceding()->size());
+    EXPECT_TRUE(
+      (*head->preceding()->begin())
+        ->IsSame(*(root.child()->begin() + 1))
+    );
+
+    // the first following node is after the head subtree
+    auto body = head->following_sibling()->begin() + 1;
+    auto meta = head->child()->begin();
+    EXPECT_TRUE(
+      (*(head->following()->begin() + 1))->IsSame(*body)
+    );
+
+    distance_test(
+      head->following()->begin(),
+      head->following()->end(),
+      head->following()->size()
+    );
+
+    const auto img = body
+      ->child()->begin()
+      ->child()->begin()
+      ->child()->begin()
+      ->child()->begin()
+      ->child()->begin();
+    distance_test(
+      img->preceding()->begin(),
+      img->preceding()->end(),
+      img->preceding()->size()
+    );
+
+    axes_test(root, n_nodes);
+    axes_test(*head, n_nodes);
+    axes_test(*body, n_nodes);
+    axes_test(*meta, n_nodes);
+    axes_test(*img, n_nodes);
+
+    // the same over a snapshot
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const snapshot_node sroot = doc->root();
+    EXPECT_EQ(doc->size(), n_nodes);
+    axes_test(sroot, n_nodes);
+    for (int k : { 3, 10, 30, 60 }) {
+      const auto it = node(r).descendant()->begin() + k;
+      const auto sit = sroot.descendant()->begin() + k;
+      EXPECT_EQ(it->following()->size(), sit->following()->size());
+      EXPECT_EQ(it->preceding()->size(), sit->preceding()->size());
+      axes_test(*sit, n_nodes);
+    }
+  });
+}
+
 TEST(Xpath, AttributeAxis) {
   test_dom([](CefRefPtr<CefDOMNode> r)
   {
@@ -393,6 +647,98 @@ TEST(Xpath, AttributeAxis) {
       html->attribute()->end(),
       3
     );
+
+    // name and value tests on the attribute axis
+    EXPECT_EQ(1, html->attribute<::xpath::test::name>("lang")
+      ->xsize());
+    EXPECT_EQ("en", html->attribute<::xpath::test::name>("lang")
+      ->xbegin()->attr_value());
+    EXPECT_EQ(0, head->attribute<::xpath::test::name>("lang")
+      ->xsize());
+  });
+}
+
+TEST(Xpath, AttributeQuery) {
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::attribute;
+    using ::xpath::axis::descendant;
+    using ::xpath::test::attr_equals;
+    using ::xpath::snapshot::node_ptr;
+
+    // //object/@data
+    auto objects = ::xpath::step::build_query
+      <wrap, descendant, ::xpath::test::name>("object", true)
+        .execute(node(r));
+    ASSERT_EQ(1, objects.size());
+    const node object = *objects.begin();
+
+    auto data = ::xpath::step::build_query
+      <wrap, attribute, ::xpath::test::name>("data", true)
+        .execute(object);
+    ASSERT_EQ(1, data.size());
+    EXPECT_TRUE(data.begin()->is_attribute());
+    EXPECT_EQ("data", data.begin()->attr_name());
+    EXPECT_EQ(
+      "http://cu3ox.com/demo/horiz_lines/cu3ox.swf",
+      data.begin()->attr_value()
+    );
+
+    auto type = ::xpath::step::build_query
+      <wrap, attribute, attr_equals>(
+        make_pair("type", "application/x-shockwave-flash"),
+        true
+      ).execute(object);
+    EXPECT_EQ(1, type.size());
+    EXPECT_EQ("type", type.begin()->attr_name());
+
+    // the same over a snapshot
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    auto sobjects = ::xpath::step::build_query
+      <node_ptr, descendant, ::xpath::test::name>("object", true)
+        .execute(doc->root());
+    ASSERT_EQ(1, sobjects.size());
+    auto sdata = ::xpath::step::build_query
+      <node_ptr, attribute, ::xpath::test::name>("data", true)
+        .execute(*sobjects.begin());
+    ASSERT_EQ(1, sdata.size());
+    EXPECT_EQ(
+      data.begin()->attr_value(), 
+      sdata.begin()->attr_value()
+    );
+  });
+}
+
+TEST(Xpath, EmptyAttributeAxis) {
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::attribute;
+    using ::xpath::snapshot::node_ptr;
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const snapshot_node root(doc->root());
+    const auto head = root.descendant()->begin() + 3;
+    ASSERT_EQ("head", head->tag_name());
+    ASSERT_EQ(0, head->n_attrs());
+
+    // @x on an element without attributes and on the
+    // document node does not read attributes
+    for (const snapshot_node& n : { *head, root }) {
+      EXPECT_EQ(0, ::xpath::step::build_query
+        <node_ptr, attribute, ::xpath::test::name>("x", true)
+          .execute(n).size());
+      EXPECT_EQ(0, ::xpath::step::build_query
+        <node_ptr, attribute, ::xpath::test::attr_equals>(
+          make_pair("x", ""),
+          true
+        ).execute(n).size());
+    }
+    EXPECT_FALSE(head->attribute()->begin()->has_attr_node());
+    EXPECT_EQ("", head->attribute()->begin()->attr_name());
   });
 }
 
@@ -549,109 +895,1818 @@ TEST(Xpath, Query)
   });
 }
 
-TEST(Xpath, NodeCreationInRepository)
+TEST(Xpath, NodeSet)
 {
-  using namespace renderer;
-  using namespace shared;
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using namespace ::xpath::step;
+    using namespace ::xpath;
+    using node = renderer::dom_visitor::node;
 
-  auto list = node_repository::instance().query(
-    browser_id,
-    dom_visitor::build_query<::xpath::test::fun>(
-      [](const dom_visitor::node::generic_iterator& it)
+    auto qr =
+    build_query<::xpath::test::fun>(
+      [](const node::generic_iterator& it)
       {
         return (*it)["href"].substr(0, 4) == "http";
       },
-      dom_visitor::build_query
-        <xpath::axis::descendant, xpath::test::name>
-      (
+      build_query<axis::descendant, ::xpath::test::name>(
         "a",
         true
       )
-    )
-  );
+    ).execute(renderer::dom_visitor::node(r));
 
-#if 0
-  for (auto ptr : list)
-    std::cout << ptr->universal_id() << '\t' 
-    << *ptr << std::endl;
-#endif
+    const auto ns = qr.materialize();
+    EXPECT_EQ(10, ns.size());
+    EXPECT_EQ(10, ns.end() - ns.begin());
+    EXPECT_FALSE(ns.empty());
+
+    // the same order as the query result
+    size_t k = 0;
+    for (auto it = qr.begin(); it != qr.end(); ++it, ++k) {
+      EXPECT_EQ((string) it.path(), (string) ns.at(k).path);
+      EXPECT_EQ((*it)["href"], ns[k]["href"]);
+      EXPECT_EQ((*it)["href"], (ns.begin() + k)->operator[]("href"));
+    }
+    EXPECT_EQ(10, k);
 
-  EXPECT_EQ(10, node_repository::instance().size());
+    // reverse iteration
+    auto rit = ns.rbegin();
+    for (k = ns.size(); k > 0; --k, ++rit)
+      EXPECT_EQ(ns[k - 1]["href"], (*rit)["href"]);
+    EXPECT_TRUE(rit == ns.rend());
+
+    // an empty result
+    auto qr0 = build_query<axis::descendant, ::xpath::test::name>(
+      "no-such-tag",
+      true
+    ).execute(renderer::dom_visitor::node(r));
+    EXPECT_TRUE(qr0.materialize().empty());
+  });
 }
 
-TEST(Xpath, FirstExprOfStepIsFalse)
+TEST(Xpath, Snapshot)
 {
   test_dom([](CefRefPtr<CefDOMNode> r)
   {
     using namespace std;
     using namespace renderer::dom_visitor;
     using namespace ::xpath::step;
-    using namespace ::xpath;
+    using ::xpath::axis::descendant;
+    using ::xpath::snapshot::document;
+    using ::xpath::snapshot::node_ptr;
     using node = renderer::dom_visitor::node;
-  
-    {
-    // single-checking query
-    auto qr = build_query
-      <axis::descendant, xpath::test::name>
-    (
-      "no-such-tag-name",
-      true
-    ).execute(renderer::dom_visitor::node(r));
-    auto bg = qr.begin();
-    auto nd = qr.end();
-    EXPECT_EQ(1, bg.get_ovf()); // debug only
-    EXPECT_EQ(1, nd.get_ovf());
-    EXPECT_TRUE(bg.is_empty());
-    EXPECT_TRUE(nd.is_empty());
-    EXPECT_TRUE(bg.ovf_equal(nd));
-    EXPECT_EQ(0, size<decltype(qr)::query_type>(qr));
-    EXPECT_EQ(bg.get_ovf(), nd.get_ovf());
-    }
 
-    {
-    // double-checkin query
-    auto qr = build_query<::xpath::test::fun>(
+    const auto doc = document::capture(r);
+    const snapshot_node root = doc->root();
+
+    EXPECT_EQ(
+      node(r).descendant()->size(),
+      root.descendant()->size()
+    );
+    EXPECT_EQ(doc->size(), root.descendant()->size() + 1);
+
+    const int n_tags = count_if(
+      root.descendant()->begin(),
+      root.descendant()->end(),
+      [](const snapshot_node& n) { return n->IsElement(); }
+    );
+    EXPECT_EQ(n_tags, 67);
+
+    auto html = root.child()->begin() + 2;
+    EXPECT_EQ("html", html->tag_name());
+    EXPECT_EQ(3, html->n_attrs());
+
+    // the same query over the live DOM and the snapshot
+    auto qr = ::xpath::step::build_query<wrap, ::xpath::test::fun>(
       [](const node::generic_iterator& it)
       {
-        return true;
+        return (*it)["href"].substr(0, 4) == "http";
       },
-      build_query<axis::descendant, xpath::test::name>
-      (
-        "no-such-tag-name",
-        true
-      )
-    ).execute(renderer::dom_visitor::node(r));
-    auto bg = qr.begin();
-    auto nd = qr.end();
-    EXPECT_EQ(1, bg.get_ovf());
-    EXPECT_EQ(1, nd.get_ovf());
-    EXPECT_TRUE(bg.is_empty());
-    EXPECT_TRUE(nd.is_empty());
-    EXPECT_TRUE(bg.ovf_equal(nd));
-    EXPECT_EQ(0, size<decltype(qr)::query_type>(qr));
-    }
+      ::xpath::step::build_query
+        <wrap, descendant, ::xpath::test::name>("a", true)
+    ).execute(node(r));
 
-    {
-    auto qr = build_query<::xpath::test::fun>(
-      [](const node::generic_iterator& it)
+    auto sqr = ::xpath::step::build_query
+      <node_ptr, ::xpath::test::fun>
+    (
+      [](const snapshot_node::generic_iterator& it)
       {
-        return false;
+        return (*it)["href"].substr(0, 4) == "http";
       },
-      build_query<axis::descendant, xpath::test::name>
-      (
-        "no-such-tag-name",
-        true
-      )
-    ).execute(renderer::dom_visitor::node(r));
-    auto bg = qr.begin();
-    auto nd = qr.end();
-    EXPECT_EQ(1, bg.get_ovf());
-    EXPECT_EQ(1, nd.get_ovf());
-    EXPECT_TRUE(bg.is_empty());
-    EXPECT_TRUE(nd.is_empty());
-    EXPECT_TRUE(bg.ovf_equal(nd));
-    EXPECT_EQ(0, size<decltype(qr)::query_type>(qr));
+      ::xpath::step::build_query
+        <node_ptr, descendant, ::xpath::test::name>("a", true)
+    ).execute(root);
+
+    EXPECT_EQ(10, sqr.size());
+
+    auto it = qr.begin();
+    for (auto sit = sqr.begin(); sit != sqr.end(); ++sit) {
+      EXPECT_EQ((string) it.path(), (string) sit.path());
+      EXPECT_EQ((*it)["href"], (*sit)["href"]);
+      ++it;
+    }
+  });
+}
+
+TEST(Xpath, SnapshotTagIndex)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::descendant;
+    using ::xpath::snapshot::document;
+    using ::xpath::snapshot::node_ptr;
+    using node = renderer::dom_visitor::node;
+
+    const auto doc = document::capture(r);
+    const snapshot_node root = doc->root();
+    const auto body = (root.descendant()->begin() + 3)
+      ->following_sibling()->begin() + 1;
+    EXPECT_EQ("body", body->tag_name());
+    const auto live_body = (node(r).descendant()->begin() + 3)
+      ->following_sibling()->begin() + 1;
+    EXPECT_EQ("body", live_body->tag_name());
+
+    for (const string tag : { 
+      "a", "img", "script", "meta", "div", "no-such-tag" 
+    })
+    {
+      auto qr = ::xpath::step::build_query
+        <wrap, descendant, ::xpath::test::name>(tag, true)
+          .execute(node(r));
+      auto sqr = ::xpath::step::build_query
+        <node_ptr, descendant, ::xpath::test::name>(tag, true)
+          .execute(root);
+
+      EXPECT_EQ(qr.size(), sqr.size()) << tag;
+      auto it = qr.begin();
+      for (auto sit = sqr.begin(); sit != sqr.end(); ++sit) {
+        EXPECT_EQ((string) it.path(), (string) sit.path());
+        ++it;
+      }
+
+      // a subtree context
+      EXPECT_EQ(
+        ::xpath::step::build_query
+          <wrap, descendant, ::xpath::test::name>(tag, true)
+            .execute(*live_body).size(),
+        ::xpath::step::build_query
+          <node_ptr, descendant, ::xpath::test::name>(tag, true)
+            .execute(*body).size()
+      ) << tag;
+    }
+  });
+}
+
+TEST(Xpath, SnapshotLabels)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::snapshot::document;
+    using ::xpath::snapshot::node_ptr;
+
+    const auto doc = document::capture(r, false);
+    const snapshot_node root = doc->root();
+    const auto begin = root.descendant()->begin();
+    const auto end = root.descendant()->end();
+
+    vector<string> paths;
+    for (auto it = begin; it != end; ++it) {
+      const node_ptr p = *it;
+      EXPECT_EQ(it.path().size() - 1, p.depth());
+      EXPECT_TRUE(p.GetParent().is_ancestor_of(p));
+      EXPECT_TRUE(doc->root().is_ancestor_of(p));
+      EXPECT_FALSE(p.is_ancestor_of(p.GetParent()));
+      if (p.GetNextSibling())
+        EXPECT_FALSE(p.is_ancestor_of(p.GetNextSibling()));
+      paths.push_back(it.path());
+    }
+    EXPECT_EQ(doc->size() - 1, paths.size());
+
+    // the reverse pre-order
+    auto it = end;
+    for (auto p = paths.rbegin(); p != paths.rend(); ++p) {
+      --it;
+      EXPECT_EQ(*p, (string) it.path());
     }
+    EXPECT_EQ(begin, it);
+  });
+}
+
+TEST(Xpath, SerializeSubtree)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::snapshot::document;
+    using node = renderer::dom_visitor::node;
+
+    // a short buffer is not written
+    const size_t size = r->SerializeSubtree(true, nullptr, 0);
+    ASSERT_GT(size, 12);
+    string buf(size - 1, '\0');
+    EXPECT_EQ(size, r->SerializeSubtree(true, &buf[0], size - 1));
+    EXPECT_EQ(string(size - 1, '\0'), buf);
+
+    buf.resize(size);
+    EXPECT_EQ(size, r->SerializeSubtree(true, &buf[0], size));
+    uint32_t header[3];
+    memcpy(header, buf.data(), sizeof(header));
+    EXPECT_EQ(1, header[0]); // the version
+    EXPECT_EQ(node(r).descendant()->size() + 1, header[1]);
+    EXPECT_EQ(1, header[2]); // with rects
+    EXPECT_LT(r->SerializeSubtree(false, nullptr, 0), size);
+
+    // the snapshot has the same data as the live DOM
+    const auto doc = document::capture(r);
+    auto it = node(r).descendant()->begin();
+    const auto end = node(r).descendant()->end();
+    auto sit = snapshot_node(doc->root()).descendant()->begin();
+    for (; it != end; ++it, ++sit) {
+      EXPECT_EQ(it->get_type(), sit->get_type());
+      EXPECT_EQ((string) it.path(), (string) sit.path());
+      if (!(*it)->IsElement())
+        continue;
+
+      EXPECT_EQ(it->tag_name(), sit->tag_name());
+      EXPECT_EQ(it->n_attrs(), sit->n_attrs());
+      EXPECT_EQ(
+        (*it)->GetBoundingClientRect(), 
+        (*sit)->GetBoundingClientRect()
+      );
+      auto as = it->attribute();
+      auto sas = sit->attribute();
+      auto a = as->begin();
+      for (auto sa = sas->begin(); sa != sas->end(); ++sa) {
+        EXPECT_EQ(
+          (std::pair<string, string>) *a, 
+          (std::pair<string, string>) *sa
+        );
+        ++a;
+      }
+    }
+  });
+}
+
+TEST(Xpath, BoundingClientRects)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer::dom_visitor;
+
+    std::vector<CefRefPtr<CefDOMNode>> nodes;
+    for (const auto& n : *node(r).descendant())
+      nodes.push_back((wrap) n);
+
+    std::vector<CefRect> rects;
+    r->GetBoundingClientRects(nodes, rects);
+    ASSERT_EQ(nodes.size(), rects.size());
+    for (size_t k = 0; k < nodes.size(); k++) {
+      if (nodes[k]->IsElement())
+        EXPECT_EQ(nodes[k]->GetBoundingClientRect(), rects[k]);
+      else
+        EXPECT_EQ(CefRect(), rects[k]);
+    }
+
+    r->GetBoundingClientRects({}, rects);
+    EXPECT_TRUE(rects.empty());
+  });
+}
+
+TEST(Xpath, AttrEquals)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::descendant;
+    using ::xpath::snapshot::document;
+    using ::xpath::snapshot::node_ptr;
+    using ::xpath::test::attr_equals;
+    using node = renderer::dom_visitor::node;
+
+    const auto doc = document::capture(r, false);
+    const auto idoc = document::capture(r, false, true);
+    EXPECT_FALSE(doc->has_attr_index());
+    EXPECT_TRUE(idoc->has_attr_index());
+
+    for (const pair<string, string> nv : { 
+      make_pair("type", "application/x-shockwave-flash"),
+      make_pair("type", "text/javascript"),
+      make_pair("type", "no-such-type")
+    })
+    {
+      auto qr = ::xpath::step::build_query
+        <wrap, descendant, attr_equals>(nv, true)
+          .execute(node(r));
+      auto sqr = ::xpath::step::build_query
+        <node_ptr, descendant, attr_equals>(nv, true)
+          .execute(doc->root());
+      auto iqr = ::xpath::step::build_query
+        <node_ptr, descendant, attr_equals>(nv, true)
+          .execute(idoc->root());
+
+      const size_t n = qr.size();
+      EXPECT_EQ(n, sqr.size()) << nv.second;
+      EXPECT_EQ(n, iqr.size()) << nv.second;
+      auto it = qr.begin();
+      for (auto iit = iqr.begin(); iit != iqr.end(); ++iit) {
+        EXPECT_EQ((string) it.path(), (string) iit.path());
+        EXPECT_EQ(nv.second, (*iit)[nv.first]);
+        ++it;
+      }
+
+      // as a predicate of a name step
+      auto nqr = ::xpath::step::build_query
+        <wrap, attr_equals>(
+          nv,
+          ::xpath::step::build_query
+            <wrap, descendant, ::xpath::test::name>("script", true)
+        ).execute(node(r));
+      auto niqr = ::xpath::step::build_query
+        <node_ptr, attr_equals>(
+          nv,
+          ::xpath::step::build_query
+            <node_ptr, descendant, ::xpath::test::name>
+              ("script", true)
+        ).execute(idoc->root());
+      EXPECT_EQ(nqr.size(), niqr.size()) << nv.second;
+    }
+  });
+}
+
+TEST(Xpath, RuntimePlan)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using namespace ::xpath::runtime;
+    using ::xpath::node_type;
+    using node = renderer::dom_visitor::node;
+
+    const node root(r);
+
+    // see Xpath.Query
+    EXPECT_EQ(12, select("//a", root).size());
+    EXPECT_EQ(12, select("//a | //a", root).size());
+    EXPECT_EQ(12, select("/descendant::a", root).size());
+
+    const auto html = select("/HTML", root);
+    ASSERT_EQ(1, html.size());
+    EXPECT_EQ("html", html[0].tag_name());
+    const auto up = select("//head/..", root);
+    ASSERT_EQ(1, up.size());
+    EXPECT_TRUE(up[0]->IsSame((wrap) html[0]));
+
+    // [n] and [last()] count elements only with *
+    const auto head = select("/html/head", root);
+    ASSERT_EQ(1, head.size());
+    vector<node> head_elements;
+    for (const node& n : *head[0].child())
+      if (n.get_type() == node_type::node)
+        head_elements.push_back(n);
+    ASSERT_LT(1, head_elements.size());
+    const auto first = select("/html/head/*[1]", root);
+    const auto last = select("/html/head/*[last()]", root);
+    ASSERT_EQ(1, first.size());
+    ASSERT_EQ(1, last.size());
+    EXPECT_TRUE(first[0]->IsSame((wrap) head_elements[0]));
+    EXPECT_TRUE(
+      last[0]->IsSame((wrap) head_elements.back())
+    );
+    EXPECT_EQ(
+      head_elements.size(),
+      select("/html/head/*", root).size()
+    );
+
+    // attributes
+    const auto data = select("//object/@data", root);
+    ASSERT_EQ(1, data.size());
+    EXPECT_TRUE(data[0].is_attribute());
+    EXPECT_EQ(
+      "http://cu3ox.com/demo/horiz_lines/cu3ox.swf",
+      data[0].attr_value()
+    );
+    EXPECT_EQ(1, select(
+      "//object[@type='application/x-shockwave-flash']",
+      root
+    ).size());
+    EXPECT_EQ(0, select(
+      "//object[@type!='application/x-shockwave-flash']",
+      root
+    ).size());
+    EXPECT_EQ(1, select("//object[@data]", root).size());
+    EXPECT_EQ(0, select("//object[@no-such]", root).size());
+    EXPECT_EQ(1, select("//object/@data/..", root).size());
+
+    // reverse axes: [1] is the nearest
+    const auto parent = select("//object/..", root);
+    const auto anc = select("//object/ancestor::*[1]", root);
+    ASSERT_EQ(1, parent.size());
+    ASSERT_EQ(1, anc.size());
+    EXPECT_TRUE(anc[0]->IsSame((wrap) parent[0]));
+    const auto top = 
+      select("//object/ancestor::*[last()]", root);
+    ASSERT_EQ(1, top.size());
+    EXPECT_EQ("html", top[0].tag_name());
+
+    // a union is in the document order
+    const auto scripts = select("//script", root);
+    const auto both = select("//a | //script", root);
+    EXPECT_EQ(scripts.size() + 12, both.size());
+    EXPECT_EQ("script", both[0].tag_name());
+
+    // the same over a snapshot
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    for (const char* path : {
+      "//a", "//a | //script", "/html/head/*[last()]",
+      "//object/@data", "//script/following::a",
+      "//a/preceding-sibling::*[1]", "//body//div/a"
+    })
+    {
+      const auto res = select(path, root);
+      const auto sres = 
+        select(path, snapshot_node(doc->root()));
+      ASSERT_EQ(res.size(), sres.size()) << path;
+      for (size_t i = 0; i < res.size(); i++)
+        EXPECT_EQ(
+          res[i].is_attribute() 
+            ? res[i].attr_name() : res[i].tag_name(),
+          sres[i].is_attribute() 
+            ? sres[i].attr_name() : sres[i].tag_name()
+        ) << path;
+    }
+
+    // the plan cache
+    clear_cache();
+    const auto p = compile("//a");
+    EXPECT_EQ(p, compile("//a"));
+    EXPECT_EQ(1, cache_size());
+    EXPECT_EQ("//a", p->text());
+    ASSERT_EQ(1, p->paths().size());
+    // //a is the single descendant step
+    ASSERT_EQ(1, p->paths()[0].steps.size());
+    EXPECT_EQ(axis_id::descendant, p->paths()[0].steps[0].axis);
+
+    // the least recently used plans are dropped
+    const size_t capacity = get_cache_capacity();
+    set_cache_capacity(2);
+    compile("//b");
+    compile("//a");
+    compile("//c");
+    EXPECT_EQ(2, cache_size());
+    EXPECT_EQ(p, compile("//a"));
+    set_cache_capacity(capacity);
+
+    // HTML attribute names are case insensitive
+    EXPECT_EQ(
+      select("//object[@data]", root).size(),
+      select("//object[@DATA]", root).size()
+    );
+    EXPECT_EQ(1, select("//object/@Data", root).size());
+
+    for (const char* bad : {
+      "//a[", "no-such-axis::a", "//a[@x='y]", "/html/",
+      "//a[0]", "//a[text()]", "//a)"
+    })
+      EXPECT_THROW(compile(bad), syntax_error) << bad;
+  });
+}
+
+TEST(Xpath, PositionPredicates)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using namespace ::xpath::step;
+    using ::xpath::axis::descendant;
+    using ::xpath::snapshot::node_ptr;
+    using ::xpath::test::position;
+    using node = renderer::dom_visitor::node;
+
+    const auto links = []()
+    {
+      return build_query
+        <wrap, descendant, ::xpath::test::name>("a", true);
+    };
+    auto all = links().execute(node(r)).materialize();
+    ASSERT_EQ(12, all.size());
+
+    // [3]
+    auto third = build_query<wrap, position>(
+      ::xpath::test::nth(3), links()
+    ).execute(node(r));
+    ASSERT_EQ(1, third.size());
+    EXPECT_EQ(
+      (string) all.at(2).path, 
+      (string) third.begin().path()
+    );
+    EXPECT_EQ(0, build_query<wrap, position>(
+      ::xpath::test::nth(13), links()
+    ).execute(node(r)).size());
+
+    // [last()]
+    auto last = build_query<wrap, position>(
+      ::xpath::test::last(), links()
+    ).execute(node(r));
+    ASSERT_EQ(1, last.size());
+    EXPECT_EQ(
+      (string) all.at(11).path, 
+      (string) last.begin().path()
+    );
+
+    // [position() < 4]
+    auto first3 = build_query<wrap, position>(
+      ::xpath::test::position_less(4), links()
+    ).execute(node(r)).materialize();
+    ASSERT_EQ(3, first3.size());
+    for (size_t i = 0; i < 3; i++)
+      EXPECT_EQ(
+        (string) all.at(i).path, 
+        (string) first3.at(i).path
+      );
+    EXPECT_EQ(0, build_query<wrap, position>(
+      ::xpath::test::position_less(1), links()
+    ).execute(node(r)).size());
+
+    // over a predicate and a snapshot: the 2nd http link
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    auto http2 = build_query<node_ptr, position>(
+      ::xpath::test::nth(2),
+      build_query<node_ptr, ::xpath::test::fun>(
+        [](const snapshot_node::generic_iterator& it)
+        {
+          return (*it)["href"].substr(0, 4) == "http";
+        },
+        build_query
+          <node_ptr, descendant, ::xpath::test::name>
+            ("a", true)
+      )
+    ).execute(doc->root());
+    ASSERT_EQ(1, http2.size());
+    EXPECT_EQ("http", (*http2.begin())["href"].substr(0, 4));
+
+    // the same positions in runtime plans
+    using ::xpath::runtime::select;
+    using ::xpath::runtime::compile;
+    EXPECT_EQ(
+      3, 
+      select("/descendant::a[position() < 4]", node(r)).size()
+    );
+    EXPECT_EQ(
+      4, 
+      select("/descendant::a[position() <= 4]", node(r)).size()
+    );
+    const auto rthird = select("/descendant::a[3]", node(r));
+    ASSERT_EQ(1, rthird.size());
+    EXPECT_EQ(
+      (string) all.at(2).path, 
+      (string) ::xpath::runtime::root_path(rthird[0])
+    );
+    EXPECT_EQ(
+      3, 
+      compile("/descendant::a[3]")->paths()[0].steps[0].limit
+    );
+    // //a[n] is /descendant-or-self::node()/child::a[n]
+    EXPECT_EQ(
+      3, 
+      compile("//a[position() < 4]")
+        ->paths()[0].steps.back().limit
+    );
+  });
+}
+
+TEST(Xpath, ForwardIterator)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::descendant;
+    using ::xpath::snapshot::node_ptr;
+    using ::xpath::step::prim_iterator_t;
+    using ::xpath::step::forward_scan;
+
+    const node root(r);
+    const node head = *(root.descendant()->begin() + 3);
+    ASSERT_EQ("head", head.tag_name());
+    const node meta = *head.child()->begin();
+    forward_axes_test(root);
+    forward_axes_test(head);
+    forward_axes_test(meta);
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const snapshot_node sroot = doc->root();
+    forward_axes_test(sroot);
+    forward_axes_test(*(sroot.descendant()->begin() + 3));
+
+    // the live DOM name test scans forward, the snapshot
+    // one seeks by the tag index
+    using live_it = prim_iterator_t<wrap, descendant>;
+    using snap_it = prim_iterator_t<node_ptr, descendant>;
+    EXPECT_TRUE((forward_scan<
+      ::xpath::test::name<live_it>, live_it
+    >::value));
+    EXPECT_FALSE((forward_scan<
+      ::xpath::test::name<snap_it>, snap_it
+    >::value));
+    EXPECT_FALSE((forward_scan<
+      ::xpath::test::fun<live_it>, live_it
+    >::value));
+
+    auto qr = build_query<::xpath::test::name>(
+      "a",
+      build_query<descendant, ::xpath::test::name>
+        ("a", true)
+    ).execute(root);
+    const auto fwd = qr.materialize();
+    const ::xpath::node_set<wrap> cycled(qr.begin(), qr.end());
+    ASSERT_EQ(12, fwd.size());
+    ASSERT_EQ(cycled.size(), fwd.size());
+    for (size_t i = 0; i < fwd.size(); i++)
+      EXPECT_EQ(
+        (string) cycled.at(i).path, 
+        (string) fwd.at(i).path
+      );
+    EXPECT_EQ(12, qr.size());
+
+    // for_each stops when the function returns false
+    size_t n_calls = 0;
+    EXPECT_EQ(3, qr.for_each(
+      [&n_calls](const node&, const ::xpath::child_path_t&)
+      {
+        return ++n_calls < 3;
+      }
+    ));
+  });
+}
+
+TEST(Xpath, UnionQuery)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::descendant;
+    using ::xpath::step::union_query;
+    using ::xpath::snapshot::node_ptr;
+    using name_test = ::xpath::test::name<
+      ::xpath::step::prim_iterator_t<wrap, descendant>
+    >;
+
+    auto as = 
+      build_query<descendant, ::xpath::test::name>
+        ("a", true);
+    auto imgs = 
+      build_query<descendant, ::xpath::test::name>
+        ("img", true);
+
+    // //a | //img over one axis is one step
+    auto shared = make_union(as, imgs);
+    static_assert(
+      is_same<
+        decltype(shared)::xpath_query,
+        ::xpath::step::query<
+          wrap,
+          ::xpath::test::either<name_test, name_test>,
+          descendant,
+          true
+        >
+      >::value,
+      "make_union must merge steps over the same axis"
+    );
+
+    // the same by merging two traversals
+    const union_query<
+      decltype(as)::xpath_query, 
+      decltype(imgs)::xpath_query
+    > merged(as, imgs);
+
+    const node root(r);
+    const auto sh = shared.execute(root).materialize();
+    const auto mg = merged.execute(root).materialize();
+    ASSERT_EQ(17, sh.size());
+    ASSERT_EQ(sh.size(), mg.size());
+    for (size_t k = 0; k < sh.size(); k++) {
+      EXPECT_EQ(
+        (string) sh.at(k).path, 
+        (string) mg.at(k).path
+      );
+      EXPECT_TRUE(sh[k]->IsSame((wrap) mg[k]));
+      if (k > 0)
+        EXPECT_TRUE(mg.at(k - 1).path < mg.at(k).path);
+    }
+
+    // //a | //a[starts-with(@href, 'http')] has no
+    // duplicates
+    auto http = build_query<::xpath::test::fun>(
+      [](const node::generic_iterator& it)
+      {
+        return (*it)["href"].substr(0, 4) == "http";
+      },
+      build_query<descendant, ::xpath::test::name>
+        ("a", true)
+    );
+    auto all_as = make_union(as, http).execute(root);
+    EXPECT_EQ(12, all_as.size());
+
+    // one side is empty
+    auto objects = make_union(
+      build_query<descendant, ::xpath::test::name>
+        ("embed", true),
+      build_query<descendant, ::xpath::test::name>
+        ("object", true)
+    ).execute(root);
+    EXPECT_EQ(1, objects.size());
+
+    // over a snapshot
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    auto sas = build_query
+      <node_ptr, descendant, ::xpath::test::name>
+        ("a", true);
+    auto simgs = build_query
+      <node_ptr, descendant, ::xpath::test::name>
+        ("img", true);
+    const union_query<
+      decltype(sas)::xpath_query, 
+      decltype(simgs)::xpath_query
+    > smerged(sas, simgs);
+    const auto smg = smerged
+      .execute(snapshot_node(doc->root()))
+      .materialize();
+    ASSERT_EQ(mg.size(), smg.size());
+    for (size_t k = 0; k < smg.size(); k++)
+      EXPECT_EQ(
+        (string) mg.at(k).path, 
+        (string) smg.at(k).path
+      );
+  });
+}
+
+TEST(Xpath, NodeBitmap)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::descendant;
+    using ::xpath::snapshot::node_ptr;
+    using ::xpath::snapshot::node_bitmap;
+    using ::xpath::snapshot::index_t;
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const snapshot_node root = doc->root();
+
+    auto select = [&doc, &root](const std::string& tag)
+    {
+      return node_bitmap::select(
+        doc.get(),
+        build_query<node_ptr, descendant, ::xpath::test::name>
+          (tag, true).execute(root)
+      );
+    };
+
+    const node_bitmap as = select("a");
+    const node_bitmap imgs = select("img");
+    const node_bitmap params = select("param");
+    EXPECT_EQ(12, as.count());
+    EXPECT_EQ(5, imgs.count());
+    EXPECT_TRUE((as & imgs).empty());
+    // empty sets are equal whatever the document
+    EXPECT_EQ(node_bitmap(), as & imgs);
+    EXPECT_EQ(node_bitmap(doc.get()), node_bitmap());
+    EXPECT_EQ(17, (as | imgs).count());
+    EXPECT_EQ(as, (as | imgs) - imgs);
+    EXPECT_EQ(imgs, (as | imgs) & imgs);
+
+    // nodes inside <object> by their subtree ranges
+    const node_bitmap objects = select("object");
+    ASSERT_EQ(1, objects.count());
+    const index_t obj = objects.indexes().front();
+    node_bitmap in_object(doc.get());
+    for (index_t i = obj + 1; i < doc->subtree_end(obj); i++)
+      in_object.set(i);
+
+    size_t n_inside = 0;
+    for (const index_t i : params.indexes())
+      if (node_ptr(doc.get(), obj)
+            .is_ancestor_of(node_ptr(doc.get(), i)))
+        ++n_inside;
+    EXPECT_EQ(n_inside, (params & in_object).count());
+    EXPECT_EQ(
+      params.count() - n_inside, 
+      (params - in_object).count()
+    );
+
+    // back to a node-set with child paths from the root
+    const auto ns = (as | imgs).materialize();
+    const auto expected = make_union(
+      build_query<node_ptr, descendant, ::xpath::test::name>
+        ("a", true),
+      build_query<node_ptr, descendant, ::xpath::test::name>
+        ("img", true)
+    ).execute(root).materialize();
+    ASSERT_EQ(expected.size(), ns.size());
+    for (size_t k = 0; k < ns.size(); k++) {
+      EXPECT_EQ(
+        (string) expected.at(k).path, 
+        (string) ns.at(k).path
+      );
+      EXPECT_TRUE(expected[k]->IsSame((node_ptr) ns[k]));
+    }
+    EXPECT_EQ(
+      as, 
+      node_bitmap::select(doc.get(), as.materialize())
+    );
+  });
+}
+
+TEST(Xpath, NodeKey)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::snapshot::node_ptr;
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const snapshot_node root = doc->root();
+
+    // keys are distinct, equal nodes have equal keys
+    unordered_set<snapshot_node> nodes;
+    unordered_set<uint64_t> keys;
+    const auto ds = root.descendant_or_self();
+    for (auto it = ds->begin(); it != ds->end(); ++it) {
+      EXPECT_TRUE(nodes.insert(*it).second);
+      EXPECT_TRUE(keys.insert(it->key()).second);
+      const node_ptr p = *it;
+      EXPECT_EQ(*it, snapshot_node(node_ptr(doc.get(), p.index())));
+    }
+    EXPECT_EQ(doc->size(), nodes.size());
+
+    // the second pass finds all nodes
+    for (auto it = ds->begin(); it != ds->end(); ++it)
+      EXPECT_EQ(1, nodes.count(*it));
+
+    // attributes of the same element are different
+    const auto objects = root.descendant
+      <::xpath::test::name>("object");
+    ASSERT_EQ(1, objects->size());
+    const snapshot_node object = *objects->begin();
+    const auto attrs = object.attribute();
+    ASSERT_LT(1, attrs->size());
+    const snapshot_node a0 = *attrs->begin();
+    const snapshot_node a1 = *(attrs->begin() + 1);
+    EXPECT_EQ(a0.key(), a1.key());
+    EXPECT_NE(a0, a1);
+    EXPECT_NE(a0, object);
+    EXPECT_TRUE(a0.is_same(object));
+    EXPECT_TRUE(nodes.insert(a0).second);
+    EXPECT_TRUE(nodes.insert(a1).second);
+
+    // keys of another capture differ
+    const auto doc2 = ::xpath::snapshot::document::capture(r);
+    EXPECT_NE(doc->serial(), doc2->serial());
+    EXPECT_NE(doc->root().key(), doc2->root().key());
+    EXPECT_EQ(0, nodes.count(snapshot_node(doc2->root())));
+  });
+}
+
+TEST(Xpath, StringFunctions)
+{
+  using ::xpath::string_fn;
+  using ::xpath::string_match;
+
+  const std::string s = "http://cu3ox.com/demo.swf";
+  auto match = [&s](string_fn fn, const std::string& arg)
+  {
+    return string_match(fn, s.data(), s.size(), arg);
+  };
+  EXPECT_TRUE(match(string_fn::starts_with, "http"));
+  EXPECT_FALSE(match(string_fn::starts_with, "https"));
+  EXPECT_TRUE(match(string_fn::ends_with, ".swf"));
+  EXPECT_FALSE(match(string_fn::ends_with, ".sw"));
+  EXPECT_TRUE(match(string_fn::contains, "cu3ox"));
+  EXPECT_TRUE(match(string_fn::contains, "f"));
+  EXPECT_TRUE(match(string_fn::contains, s));
+  EXPECT_FALSE(match(string_fn::contains, s + "x"));
+  EXPECT_FALSE(match(string_fn::contains, "demo.swf/"));
+  EXPECT_TRUE(match(string_fn::contains, ""));
+  EXPECT_TRUE(match(string_fn::equals, s));
+  EXPECT_TRUE(string_match(string_fn::contains, "", 0, ""));
+  EXPECT_FALSE(string_match(string_fn::equals, "", 0, "x"));
+
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::descendant;
+    using ::xpath::snapshot::node_ptr;
+    using ::xpath::test::attr_string;
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const snapshot_node sroot = doc->root();
+    const node root(r);
+
+    // the same as a lambda over strings
+    auto http = build_query<::xpath::test::fun>(
+      [](const node::generic_iterator& it)
+      {
+        return (*it)["href"].substr(0, 4) == "http";
+      },
+      build_query<descendant, ::xpath::test::name>
+        ("a", true)
+    ).execute(root);
+    ASSERT_EQ(10, http.size());
+
+    auto live = build_query<attr_string>(
+      ::xpath::test::starts_with("href", "http"),
+      build_query<descendant, ::xpath::test::name>
+        ("a", true)
+    ).execute(root);
+    EXPECT_EQ(10, live.size());
+
+    auto snap = build_query<attr_string>(
+      ::xpath::test::starts_with("href", "http"),
+      build_query
+        <node_ptr, descendant, ::xpath::test::name>
+          ("a", true)
+    ).execute(sroot);
+    EXPECT_EQ(10, snap.size());
+
+    auto swf = build_query
+      <node_ptr, descendant, attr_string>(
+        ::xpath::test::ends_with("data", ".swf"),
+        true
+      ).execute(sroot);
+    EXPECT_EQ(1, swf.size());
+    EXPECT_EQ("object", swf.begin()->tag_name());
+
+    auto cu3ox = build_query
+      <node_ptr, descendant, attr_string>(
+        ::xpath::test::contains("data", "cu3ox"),
+        true
+      ).execute(sroot);
+    EXPECT_EQ(1, cu3ox.size());
+
+    // runtime plans
+    using ::xpath::runtime::select;
+    EXPECT_EQ(
+      10, 
+      select("//a[starts-with(@href, 'http')]", root).size()
+    );
+    EXPECT_EQ(
+      10, 
+      select("//a[starts-with(@href, 'http')]", sroot).size()
+    );
+    EXPECT_EQ(
+      1, 
+      select("//*[contains(@data, '.swf')]", sroot).size()
+    );
+    EXPECT_EQ(
+      0, 
+      select("//a[ends-with(@href, '.nothing')]", root).size()
+    );
+  });
+}
+
+TEST(Xpath, ChildPath)
+{
+  using ::xpath::child_path_t;
+  using shared::node_id_t;
+
+  child_path_t p = child_path_t::uninitialized();
+  EXPECT_EQ(".", (std::string) p);
+
+  // grow over the inline buffer and back
+  const size_t deep = 3 * child_path_t::inline_capacity;
+  for (size_t k = 0; k < deep; k++)
+    p.push_back(k);
+  ASSERT_EQ(deep + 1, p.size());
+  EXPECT_EQ(deep - 1, p.back());
+  ++p.back();
+  EXPECT_EQ(deep, p.back());
+
+  const child_path_t copy = p;
+  EXPECT_EQ(p, copy);
+  child_path_t moved = std::move(p);
+  EXPECT_EQ(copy, moved);
+  EXPECT_TRUE(p.empty());
+
+  while (moved.size() > 3)
+    moved.pop_back();
+  EXPECT_EQ("0/1", (std::string) moved);
+  moved.resize(4);
+  EXPECT_EQ("0/1/0", (std::string) moved);
+
+  const auto u = child_path_t::uninitialized();
+  const child_path_t a { u, 2, 0 };
+  const child_path_t b { u, 2, 1 };
+  const child_path_t c { u, 2 };
+  EXPECT_TRUE(a < b);
+  EXPECT_TRUE(c < a);
+  EXPECT_FALSE(a < a);
+  EXPECT_NE(a, b);
+
+  // node ids skip the context index
+  const node_id_t ida(1, a), idb(1, b), idc(2, c);
+  EXPECT_EQ("1:/2/0", (std::string) ida);
+  EXPECT_TRUE(ida < idb);
+  EXPECT_TRUE(idb < idc);
+  EXPECT_EQ(2, ida.path.size());
+}
+
+TEST(Xpath, NodeCreationInRepository)
+{
+  using namespace renderer;
+  using namespace shared;
+
+  auto list = node_repository::instance().query(
+    browser_id,
+    dom_visitor::build_query<::xpath::test::fun>(
+      [](const dom_visitor::node::generic_iterator& it)
+      {
+        return (*it)["href"].substr(0, 4) == "http";
+      },
+      dom_visitor::build_query
+        <xpath::axis::descendant, xpath::test::name>
+      (
+        "a",
+        true
+      )
+    )
+  );
+
+#if 0
+  for (auto ptr : list)
+    std::cout << ptr->universal_id() << '\t' 
+    << *ptr << std::endl;
+#endif
+
+  EXPECT_EQ(10, node_repository::instance().size());
+}
+
+TEST(Xpath, RepositoryQueryLimit)
+{
+  using namespace renderer;
+  using namespace shared;
+  using node = dom_visitor::node;
+
+  const auto http_links = []()
+  {
+    return dom_visitor::build_query<::xpath::test::fun>(
+      [](const node::generic_iterator& it)
+      {
+        return (*it)["href"].substr(0, 4) == "http";
+      },
+      dom_visitor::build_query
+        <xpath::axis::descendant, xpath::test::name>
+      (
+        "a",
+        true
+      )
+    );
+  };
+
+  std::vector<std::string> hrefs, ids;
+  EXPECT_EQ(10, node_repository::instance().visit(
+    browser_id,
+    http_links(),
+    [&](const node& n, const xpath::child_path_t& path)
+    {
+      hrefs.push_back(n["href"]);
+      ids.push_back(node_id_t(browser_id, path));
+      return true;
+    }
+  ));
+  ASSERT_EQ(10, hrefs.size());
+
+  // the visit stops when the function returns false
+  size_t n_calls = 0;
+  EXPECT_EQ(1, node_repository::instance().visit(
+    browser_id,
+    http_links(),
+    [&n_calls](const node&, const xpath::child_path_t&)
+    {
+      return ++n_calls < 1;
+    }
+  ));
+  EXPECT_EQ(1, n_calls);
+
+  // skip and limit
+  std::vector<std::string> window;
+  EXPECT_EQ(3, node_repository::instance().visit(
+    browser_id,
+    http_links().skip(2).limit(3),
+    [&window](const node& n, const xpath::child_path_t&)
+    {
+      window.push_back(n["href"]);
+      return true;
+    }
+  ));
+  EXPECT_EQ(
+    std::vector<std::string>(hrefs.begin() + 2, hrefs.begin() + 5),
+    window
+  );
+  EXPECT_EQ(0, node_repository::instance().visit(
+    browser_id,
+    http_links().skip(10),
+    [](const node&, const xpath::child_path_t&) { return true; }
+  ));
+
+  // the repository creates only the selected object
+  auto list = node_repository::instance().query(
+    browser_id,
+    http_links().nth(4)
+  );
+  ASSERT_EQ(1, list.size());
+  EXPECT_EQ(ids[4], (*list.begin())->universal_id());
+}
+
+//! Detection-like queries for the batch tests
+const std::vector<std::string> batch_paths = {
+  "//a",
+  "//a[@href]",
+  "//object[@type='application/x-shockwave-flash']",
+  "//object/@data",
+  "//script[@type='text/javascript']",
+  "//head/*[1]",
+  "//img | //a",
+  "//div//a",
+  "//embed",
+  "//node()[@id]",
+  "/html/body",
+  "//script[last()]"
+};
+
+TEST(Xpath, RuntimeBatch)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using namespace ::xpath::runtime;
+
+    const batch b(batch_paths);
+    ASSERT_EQ(batch_paths.size(), b.size());
+    // 13 paths, all but /html/body are shared
+    EXPECT_EQ(12, b.n_shared());
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const auto res = b.execute(node(r));
+    const auto sres = b.execute(snapshot_node(doc->root()));
+    ASSERT_EQ(b.size(), res.size());
+    ASSERT_EQ(b.size(), sres.size());
+
+    for (size_t k = 0; k < b.size(); k++) {
+      const auto one = select(batch_paths[k], node(r));
+      ASSERT_EQ(one.size(), res[k].size()) << batch_paths[k];
+      EXPECT_EQ(one.size(), sres[k].size()) << batch_paths[k];
+      for (size_t i = 0; i < one.size(); i++) {
+        EXPECT_EQ(
+          (string) root_path(one[i]),
+          (string) root_path(res[k][i])
+        ) << batch_paths[k];
+        EXPECT_EQ(
+          (string) root_path(one[i]),
+          (string) root_path(sres[k][i])
+        ) << batch_paths[k];
+      }
+    }
+  });
+}
+
+TEST(Xpath, RepositoryQueryBatch)
+{
+  using namespace renderer;
+  using namespace shared;
+  using node = dom_visitor::node;
+
+  std::vector<std::string> ids;
+  std::vector<CefRect> rects;
+  node_repository::instance().visit(
+    browser_id,
+    dom_visitor::build_query
+      <xpath::axis::descendant, xpath::test::name>("a", true),
+    [&ids, &rects](
+      const node& n, 
+      const xpath::child_path_t& path
+    )
+    {
+      ids.push_back(node_id_t(browser_id, path));
+      rects.push_back(n->GetBoundingClientRect());
+      return true;
+    }
+  );
+  ASSERT_EQ(12, ids.size());
+
+  const auto lists = node_repository::instance().query_batch(
+    browser_id,
+    { "//a", "//object", "//no-such-tag" }
+  );
+  ASSERT_EQ(3, lists.size());
+  ASSERT_EQ(12, lists[0].size());
+  EXPECT_EQ(1, lists[1].size());
+  EXPECT_EQ(0, lists[2].size());
+
+  // the snapshot is captured without rects, the rects
+  // of results are fetched from the live DOM
+  size_t i = 0;
+  for (auto ptr : lists[0]) {
+    EXPECT_EQ(rects[i], ptr->GetBoundingClientRect());
+    EXPECT_EQ(ids[i++], ptr->universal_id());
+  }
+  EXPECT_EQ("object", (*lists[1].begin())->GetElementTagName());
+
+  EXPECT_THROW(
+    node_repository::instance().query_batch(
+      browser_id, 
+      { "//a", "//a[" }
+    ),
+    ::xpath::runtime::syntax_error
+  );
+}
+
+TEST(Xpath, RepositoryShards)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer;
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const auto links = ::xpath::runtime::select(
+      "//a", 
+      dom_visitor::snapshot_node(doc->root())
+    );
+    ASSERT_EQ(12, links.size());
+
+    const size_t n0 = node_repository::instance().size();
+    for (const int b : { 101, 102 }) {
+      dom_visitor::node_list list(links);
+      const auto objs = node_repository::instance()
+        .create_several_objects(b, list);
+      ASSERT_EQ(12, objs.size());
+      for (auto ptr : objs)
+        EXPECT_EQ(b, ptr->get_id().browser_id);
+      EXPECT_EQ(12, node_repository::instance().shard(b)->size());
+    }
+    EXPECT_EQ(n0 + 24, node_repository::instance().size());
+  });
+}
+
+TEST(Xpath, NodeArena)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer;
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const auto links = ::xpath::runtime::select(
+      "//a", 
+      dom_visitor::snapshot_node(doc->root())
+    );
+    ASSERT_EQ(12, links.size());
+
+    // a new shard
+    const auto shard = node_repository::instance().shard(103);
+    EXPECT_EQ(0, shard->size());
+    EXPECT_EQ(0, shard->n_arenas());
+
+    // one arena per query
+    dom_visitor::node_list list(links);
+    const auto objs = node_repository::instance()
+      .create_several_objects(103, list);
+    ASSERT_EQ(12, objs.size());
+    EXPECT_EQ(12, shard->size());
+    EXPECT_EQ(1, shard->n_arenas());
+    // the objects with their data are in the arena
+    EXPECT_GE(shard->memory(), 12 * sizeof(node_obj));
+
+    auto it = links.begin();
+    for (auto ptr : objs) {
+      EXPECT_EQ("a", ptr->GetElementTagName());
+      EXPECT_EQ((*it)["href"], ptr->GetElementAttribute("href"));
+      EXPECT_EQ(it->n_attrs(), ptr->GetNumberOfElementAttributes());
+      EXPECT_EQ("", ptr->GetElementAttribute("no-such-attr"));
+      ++it;
+    }
+
+    // the empty result has no arena
+    dom_visitor::node_list none({});
+    EXPECT_TRUE(node_repository::instance()
+      .create_several_objects(103, none).empty());
+    EXPECT_EQ(1, shard->n_arenas());
+
+    // the same nodes again are new objects of the second
+    // query, releasing one result keeps the other
+    dom_visitor::node_list again(links);
+    const auto objs2 = node_repository::instance()
+      .create_several_objects(103, again);
+    ASSERT_EQ(12, objs2.size());
+    EXPECT_EQ(24, shard->size());
+    EXPECT_EQ(2, shard->n_arenas());
+    auto it2 = objs2.begin();
+    for (auto ptr : objs) {
+      EXPECT_NE(ptr, *it2);
+      EXPECT_EQ(ptr->universal_id(), (*it2)->universal_id());
+      ++it2;
+    }
+
+    node_repository::instance().release(objs);
+    EXPECT_EQ(12, shard->size());
+    EXPECT_EQ(1, shard->n_arenas());
+    it = links.begin();
+    for (auto ptr : objs2) {
+      EXPECT_EQ((*it)["href"], ptr->GetElementAttribute("href"));
+      ++it;
+    }
+
+    node_repository::instance().release(objs2);
+    EXPECT_EQ(0, shard->size());
+    EXPECT_EQ(0, shard->n_arenas());
+  });
+}
+
+TEST(Xpath, RepositoryEviction)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer;
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const dom_visitor::snapshot_node root = doc->root();
+    const auto links = ::xpath::runtime::select("//a", root);
+    const auto imgs = ::xpath::runtime::select("//img", root);
+    const auto scripts = 
+      ::xpath::runtime::select("//script", root);
+    ASSERT_FALSE(imgs.empty());
+    ASSERT_FALSE(scripts.empty());
+
+    node_repository& rep = node_repository::instance();
+    const auto create = [&rep](
+      int browser, 
+      const std::vector<dom_visitor::snapshot_node>& nodes
+    )
+    {
+      dom_visitor::node_list list(nodes);
+      return rep.create_several_objects(browser, list);
+    };
+
+    // cleared objects are not evicted ones
+    const auto st0 = rep.get_stats();
+    rep.clear();
+    EXPECT_EQ(0, rep.get_stats().n_objects);
+    EXPECT_EQ(
+      st0.n_removed + st0.n_objects, 
+      rep.get_stats().n_removed
+    );
+    const size_t ev0 = rep.get_stats().n_evicted;
+    EXPECT_EQ(0, ev0);
+
+    const auto oa = create(104, links);
+    const size_t m_a = rep.get_stats().memory;
+    create(104, imgs);
+    const size_t m_img = rep.get_stats().memory - m_a;
+    create(105, scripts);
+
+    auto st = rep.get_stats();
+    EXPECT_EQ(3, st.n_queries);
+    EXPECT_EQ(
+      links.size() + imgs.size() + scripts.size(), 
+      st.n_objects
+    );
+    EXPECT_GT(m_img, 0);
+
+    // a navigation evicts the previous page objects
+    rep.new_generation(105);
+    st = rep.get_stats();
+    EXPECT_EQ(2, st.n_queries);
+    EXPECT_EQ(ev0 + scripts.size(), st.n_evicted);
+
+    // imgs is the least recently used query, it is the
+    // only one evicted to fit the next one
+    rep.touch(oa);
+    rep.set_memory_cap(m_a + m_img + m_a - 1);
+    create(106, links);
+    st = rep.get_stats();
+    EXPECT_EQ(2, st.n_queries);
+    EXPECT_EQ(2 * m_a, st.memory);
+    EXPECT_EQ(
+      ev0 + scripts.size() + imgs.size(), 
+      st.n_evicted
+    );
+    EXPECT_EQ("a", (*oa.begin())->GetElementTagName());
+
+    // a pinned result is held over evictions
+    EXPECT_TRUE(rep.pin(oa));
+    rep.set_memory_cap(0);
+    create(106, imgs);
+    st = rep.get_stats();
+    EXPECT_EQ(2, st.n_queries);
+    EXPECT_EQ(links.size() + imgs.size(), st.n_objects);
+    EXPECT_EQ("a", (*oa.begin())->GetElementTagName());
+    rep.new_generation(104);
+    EXPECT_EQ("a", (*oa.begin())->GetElementTagName());
+
+    // unpinned it is evicted by the next query, the
+    // evicted result is not valid
+    rep.unpin(oa);
+    create(106, imgs);
+    EXPECT_EQ(1, rep.get_stats().n_queries);
+    EXPECT_FALSE(rep.pin(oa));
+    rep.touch(oa);
+    rep.release(oa);
+    EXPECT_EQ(1, rep.get_stats().n_queries);
+
+    rep.set_memory_cap(node_repository::default_memory_cap);
+    rep.clear();
+  });
+}
+
+TEST(Xpath, FirstExprOfStepIsFalse)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using namespace ::xpath::step;
+    using namespace ::xpath;
+    using node = renderer::dom_visitor::node;
+  
+    {
+    // single-checking query
+    auto qr = build_query
+      <axis::descendant, xpath::test::name>
+    (
+      "no-such-tag-name",
+      true
+    ).execute(renderer::dom_visitor::node(r));
+    auto bg = qr.begin();
+    auto nd = qr.end();
+    EXPECT_EQ(1, bg.get_ovf()); // debug only
+    EXPECT_EQ(1, nd.get_ovf());
+    EXPECT_TRUE(bg.is_empty());
+    EXPECT_TRUE(nd.is_empty());
+    EXPECT_TRUE(bg.ovf_equal(nd));
+    EXPECT_EQ(0, size<decltype(qr)::query_type>(qr));
+    EXPECT_EQ(bg.get_ovf(), nd.get_ovf());
+    }
+
+    {
+    // double-checkin query
+    auto qr = build_query<::xpath::test::fun>(
+      [](const node::generic_iterator& it)
+      {
+        return true;
+      },
+      build_query<axis::descendant, xpath::test::name>
+      (
+        "no-such-tag-name",
+        true
+      )
+    ).execute(renderer::dom_visitor::node(r));
+    auto bg = qr.begin();
+    auto nd = qr.end();
+    EXPECT_EQ(1, bg.get_ovf());
+    EXPECT_EQ(1, nd.get_ovf());
+    EXPECT_TRUE(bg.is_empty());
+    EXPECT_TRUE(nd.is_empty());
+    EXPECT_TRUE(bg.ovf_equal(nd));
+    EXPECT_EQ(0, size<decltype(qr)::query_type>(qr));
+    }
+
+    {
+    auto qr = build_query<::xpath::test::fun>(
+      [](const node::generic_iterator& it)
+      {
+        return false;
+      },
+      build_query<axis::descendant, xpath::test::name>
+      (
+        "no-such-tag-name",
+        true
+      )
+    ).execute(renderer::dom_visitor::node(r));
+    auto bg = qr.begin();
+    auto nd = qr.end();
+    EXPECT_EQ(1, bg.get_ovf());
+    EXPECT_EQ(1, nd.get_ovf());
+    EXPECT_TRUE(bg.is_empty());
+    EXPECT_TRUE(nd.is_empty());
+    EXPECT_TRUE(bg.ovf_equal(nd));
+    EXPECT_EQ(0, size<decltype(qr)::query_type>(qr));
+    }
+  });
+}
+
+TEST(XpathBench, StepSize)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer::dom_visitor;
+    using namespace ::xpath::step;
+    using namespace ::xpath;
+    using node = renderer::dom_visitor::node;
+
+    auto qr = build_query<::xpath::test::fun>(
+      [](const node::generic_iterator& it)
+      {
+        return (*it)["href"].substr(0, 4) == "http";
+      },
+      build_query<axis::descendant, ::xpath::test::name>(
+        "a",
+        true
+      )
+    ).execute(renderer::dom_visitor::node(r));
+
+    using query_type = decltype(qr)::query_type;
+    size_t n_dist = 0, n_pass = 0;
+
+    const double t_dist = bench(20, [&]()
+    {
+      n_dist = qr.end() - qr.begin();
+    });
+    const double t_pass = bench(20, [&]()
+    {
+      n_pass = size<query_type>(qr);
+    });
+
+    EXPECT_EQ(10, n_dist);
+    EXPECT_EQ(10, n_pass);
+    LOG_INFO(log, "step::size: operator- " << t_dist 
+      << " us, single pass " << t_pass << " us");
+  });
+}
+
+TEST(XpathBench, AttrLookup)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer::dom_visitor;
+
+    const auto begin = node(r).descendant()->begin();
+    const auto end = node(r).descendant()->end();
+    size_t n_map = 0, n_scan = 0;
+
+    // every node is a fresh copy, as in query predicates
+    const double t_map = bench(20, [&]()
+    {
+      n_map = 0;
+      for (auto it = begin; it != end; ++it) {
+        const node nd = *it;
+        const auto& attrs = nd.attributes();
+        const auto p = attrs.find("href");
+        if (p != attrs.end() && !p->second.empty())
+          ++n_map;
+      }
+    });
+    const double t_scan = bench(20, [&]()
+    {
+      n_scan = 0;
+      for (auto it = begin; it != end; ++it) {
+        const node nd = *it;
+        if (!nd["href"].empty())
+          ++n_scan;
+      }
+    });
+
+    EXPECT_EQ(n_map, n_scan);
+    EXPECT_LT(0, n_scan);
+    LOG_INFO(log, "node::operator[]: attribute map " 
+      << t_map << " us, lookup by name " << t_scan 
+      << " us");
+  });
+}
+
+TEST(XpathBench, RuntimePlan)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace std;
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::descendant;
+    using ::xpath::test::attr_equals;
+
+    const string path = 
+      "//object[@type='application/x-shockwave-flash']";
+    size_t n_tmpl = 0, n_plan = 0, n_parse = 0;
+
+    const double t_tmpl = bench(20, [&]()
+    {
+      n_tmpl = ::xpath::step::build_query<wrap, attr_equals>(
+        make_pair("type", "application/x-shockwave-flash"),
+        ::xpath::step::build_query
+          <wrap, descendant, ::xpath::test::name>
+            ("object", true)
+      ).execute(node(r)).size();
+    });
+    const double t_plan = bench(20, [&]()
+    {
+      n_plan = ::xpath::runtime::select(path, node(r)).size();
+    });
+    const double t_parse = bench(20, [&]()
+    {
+      n_parse = ::xpath::runtime::plan(path)
+        .execute(node(r)).size();
+    });
+
+    EXPECT_EQ(1, n_tmpl);
+    EXPECT_EQ(n_tmpl, n_plan);
+    EXPECT_EQ(n_tmpl, n_parse);
+    LOG_INFO(log, path << ": template query " << t_tmpl 
+      << " us, cached plan " << t_plan 
+      << " us, plan without the cache " << t_parse << " us");
+  });
+}
+
+TEST(XpathBench, RuntimeBatch)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer::dom_visitor;
+    using namespace ::xpath::runtime;
+
+    const batch b(batch_paths);
+    size_t n_sep = 0, n_batch = 0;
+
+    const double t_sep = bench(20, [&]()
+    {
+      n_sep = 0;
+      for (const std::string& path : batch_paths)
+        n_sep += select(path, node(r)).size();
+    });
+    const double t_batch = bench(20, [&]()
+    {
+      n_batch = 0;
+      for (const auto& res : b.execute(node(r)))
+        n_batch += res.size();
+    });
+
+    EXPECT_EQ(n_sep, n_batch);
+    LOG_INFO(log, batch_paths.size() << " queries: "
+      << "separate traversals " << t_sep 
+      << " us, one traversal " << t_batch << " us");
+  });
+}
+
+TEST(XpathBench, ForwardScan)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::descendant;
+
+    auto qr = build_query<descendant, ::xpath::test::name>
+      ("a", true).execute(node(r));
+    size_t n_cycled = 0, n_fwd = 0;
+
+    const double t_cycled = bench(20, [&]()
+    {
+      n_cycled = 
+        ::xpath::node_set<wrap>(qr.begin(), qr.end()).size();
+    });
+    const double t_fwd = bench(20, [&]()
+    {
+      n_fwd = qr.materialize().size();
+    });
+
+    EXPECT_EQ(12, n_cycled);
+    EXPECT_EQ(n_cycled, n_fwd);
+    LOG_INFO(log, "descendant::a: cycled iterators " 
+      << t_cycled << " us, forward iterators " << t_fwd 
+      << " us");
+  });
+}
+
+TEST(XpathBench, StringFunctions)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer::dom_visitor;
+    using ::xpath::axis::descendant_or_self;
+    using ::xpath::snapshot::node_ptr;
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const snapshot_node root = doc->root();
+    size_t n_fun = 0, n_str = 0;
+
+    const double t_fun = bench(20, [&]()
+    {
+      n_fun = build_query
+        <node_ptr, descendant_or_self, ::xpath::test::fun>(
+          [](const snapshot_node::generic_iterator& it)
+          {
+            return (*it)["href"].find("cu3ox") 
+              != std::string::npos;
+          },
+          true
+        ).execute(root).size();
+    });
+    const double t_str = bench(20, [&]()
+    {
+      n_str = build_query
+        <node_ptr, descendant_or_self, 
+         ::xpath::test::attr_string>(
+          ::xpath::test::contains("href", "cu3ox"),
+          true
+        ).execute(root).size();
+    });
+
+    EXPECT_EQ(n_fun, n_str);
+    LOG_INFO(log, "contains(@href, 'cu3ox'): lambda " 
+      << t_fun << " us, attr_string " << t_str << " us");
+  });
+}
+
+TEST(XpathBench, SubtreeExport)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer::dom_visitor;
+
+    size_t n_live = 0, n_snap = 0;
+
+    // the same data read with calls per node
+    const double t_live = bench(20, [&]()
+    {
+      n_live = 0;
+      for (const auto& n : *node(r).descendant()) {
+        if (!n->IsElement())
+          continue;
+        n.tag_name();
+        for (const auto& a : *n.attribute())
+          (std::pair<std::string, std::string>) a;
+        n->GetBoundingClientRect();
+        n_live++;
+      }
+    });
+    const double t_snap = bench(20, [&]()
+    {
+      const auto doc = ::xpath::snapshot::document::capture(r);
+      n_snap = std::count_if(
+        snapshot_node(doc->root()).descendant()->begin(),
+        snapshot_node(doc->root()).descendant()->end(),
+        [](const snapshot_node& n) { return n->IsElement(); }
+      );
+    });
+
+    EXPECT_EQ(n_live, n_snap);
+    LOG_INFO(log, n_live << " elements: calls per node " 
+      << t_live << " us, one SerializeSubtree() " << t_snap
+      << " us");
+  });
+}
+
+TEST(XpathBench, RepositoryShards)
+{
+  test_dom([](CefRefPtr<CefDOMNode> r)
+  {
+    using namespace renderer;
+
+    const auto doc = ::xpath::snapshot::document::capture(r);
+    const auto nodes = ::xpath::runtime::select(
+      "//node()", 
+      dom_visitor::snapshot_node(doc->root())
+    );
+    const int n_browsers = 8;
+    size_t n_seq = 0;
+    std::atomic<size_t> n_par(0);
+
+    // every browser gets new objects, ids are not reused
+    const double t_seq = bench(1, [&]()
+    {
+      for (int b = 0; b < n_browsers; b++) {
+        dom_visitor::node_list list(nodes);
+        n_seq += node_repository::instance()
+          .create_several_objects(300 + b, list).size();
+      }
+    });
+    const double t_par = bench(1, [&]()
+    {
+      std::vector<std::thread> threads;
+      for (int b = 0; b < n_browsers; b++)
+        threads.emplace_back([&nodes, &n_par, b]()
+        {
+          dom_visitor::node_list list(nodes);
+          n_par += node_repository::instance()
+            .create_several_objects(400 + b, list).size();
+        });
+      for (auto& th : threads)
+        th.join();
+    });
+
+    EXPECT_EQ(n_seq, n_par);
+    LOG_INFO(log, n_browsers << " browsers x " 
+      << n_seq / n_browsers << " nodes: sequential " 
+      << t_seq << " us, concurrent " << t_par << " us");
   });
 }
 
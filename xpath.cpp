@@ -9,13 +9,216 @@
 #include <iterator>
 #include <assert.h>
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cstring>
+#include <mutex>
+#include <unordered_map>
 #include "include/cef_dom.h"
 #include "string_utils.h"
 #include "xpath.h"
 
 namespace xpath {
 
+namespace {
+
+//! The tag names table. Readers do not lock: names are
+//! in fixed blocks which are never moved, an atom is
+//! published by `size' after its name is written.
+//! Lookups go through a per-thread cache.
+struct atom_table
+{
+  static constexpr unsigned block_bits = 10;
+  static constexpr atom_t block_size = 1 << block_bits;
+  static constexpr size_t max_blocks = 1024;
+
+  atom_table()
+  {
+    for (auto& b : blocks)
+      b = nullptr;
+    add(std::string()); // empty_atom
+  }
+
+  //! mx must be locked
+  atom_t add(const std::string& name)
+  {
+    const atom_t atom = size.load(std::memory_order_relaxed);
+    const size_t b = atom >> block_bits;
+    SCHECK(b < max_blocks);
+    if (!blocks[b])
+      blocks[b].store(
+        new std::string[block_size], 
+        std::memory_order_release
+      );
+    blocks[b].load(std::memory_order_relaxed)
+      [atom & (block_size - 1)] = name;
+    atoms.emplace(name, atom);
+    size.store(atom + 1, std::memory_order_release);
+    return atom;
+  }
+
+  const std::string& name(atom_t atom) const
+  {
+    SCHECK(atom < size.load(std::memory_order_acquire));
+    return blocks[atom >> block_bits]
+      .load(std::memory_order_acquire)
+      [atom & (block_size - 1)];
+  }
+
+  std::mutex mx;
+  //! it is guarded by mx
+  std::unordered_map<std::string, atom_t> atoms;
+  std::atomic<std::string*> blocks[max_blocks];
+  std::atomic<atom_t> size = { 0 };
+};
+
+atom_table& atoms()
+{
+  static atom_table table;
+  return table;
+}
+
+//! Atoms found by the thread. An unknown name is cached
+//! with the table size, it is valid while no names are
+//! added.
+struct atom_cache
+{
+  static constexpr size_t max_size = 4096;
+
+  struct entry
+  {
+    atom_t atom;
+    atom_t table_size;
+  };
+
+  std::unordered_map<std::string, entry> entries;
+};
+
+atom_cache& thread_atoms()
+{
+  static thread_local atom_cache cache;
+  return cache;
+}
+
+//! Returns the cached atom of the name, unknown_atom
+//! if the name is cached as unknown and the table is
+//! not changed since or no_entry
+constexpr atom_t no_entry = unknown_atom - 1;
+
+atom_t cached(
+  atom_cache& c, 
+  const std::string& name,
+  atom_t table_size
+)
+{
+  const auto p = c.entries.find(name);
+  if (p == c.entries.end())
+    return no_entry;
+  if (p->second.atom != unknown_atom
+      || p->second.table_size == table_size)
+    return p->second.atom;
+  return no_entry;
+}
+
+void cache(
+  atom_cache& c, 
+  const std::string& name, 
+  atom_t atom,
+  atom_t table_size
+)
+{
+  // custom element names are unbounded
+  if (c.entries.size() >= atom_cache::max_size)
+    c.entries.clear();
+  c.entries[name] = { atom, table_size };
+}
+
+}
+
+atom_t intern_tag(const std::string& name)
+{
+  atom_table& t = atoms();
+  atom_cache& c = thread_atoms();
+  const atom_t size = t.size.load(std::memory_order_acquire);
+  const atom_t known = cached(c, name, size);
+  if (known != no_entry && known != unknown_atom)
+    return known;
+
+  atom_t atom;
+  {
+    std::lock_guard<std::mutex> lk(t.mx);
+    const auto p = t.atoms.find(name);
+    atom = p != t.atoms.end() ? p->second : t.add(name);
+  }
+  cache(c, name, atom, size);
+  return atom;
+}
+
+atom_t find_tag(const std::string& name)
+{
+  atom_table& t = atoms();
+  atom_cache& c = thread_atoms();
+  const atom_t size = t.size.load(std::memory_order_acquire);
+  const atom_t known = cached(c, name, size);
+  if (known != no_entry)
+    return known;
+
+  atom_t atom = unknown_atom;
+  {
+    std::lock_guard<std::mutex> lk(t.mx);
+    const auto p = t.atoms.find(name);
+    if (p != t.atoms.end())
+      atom = p->second;
+  }
+  cache(c, name, atom, size);
+  return atom;
+}
+
+const std::string& atom_name(atom_t atom)
+{
+  return atoms().name(atom);
+}
+
+bool string_match(
+  string_fn fn, 
+  const char* s, 
+  size_t n, 
+  const std::string& arg
+)
+{
+  const size_t m = arg.size();
+  switch (fn) {
+    case string_fn::equals:
+      return n == m && ::memcmp(s, arg.data(), m) == 0;
+    case string_fn::starts_with:
+      return n >= m && ::memcmp(s, arg.data(), m) == 0;
+    case string_fn::ends_with:
+      return n >= m 
+        && ::memcmp(s + n - m, arg.data(), m) == 0;
+    case string_fn::contains:
+    {
+      if (m == 0)
+        return true;
+      if (n < m)
+        return false;
+
+      // the last possible start + 1
+      const char* const last = s + n - m + 1;
+      for (const char* p = s; p < last; ++p) {
+        p = static_cast<const char*>(
+          ::memchr(p, arg[0], last - p)
+        );
+        if (!p)
+          return false;
+        if (::memcmp(p + 1, arg.data() + 1, m - 1) == 0)
+          return true;
+      }
+      return false;
+    }
+  }
+  THROW_PROGRAM_ERROR;
+}
+
 std::ostream&
 operator<< (std::ostream& out, const child_path_t& path)
 {
@@ -15,9 +15,14 @@
 #include <limits>
 #include <algorithm>
 #include <cctype>
+#include <functional>
 #include <assert.h>
 #include <list>
+#include <memory>
+#include <vector>
 #include <utility>
+#include <cstdint>
+#include <initializer_list>
 #include "include/cef_dom.h"
 #include "SCheck.h"
 #include "SCommon.h"
@@ -66,6 +71,51 @@ enum class node_type {
   unknown_type
 };
 
+//! A process-wide table of interned tag names. A name
+//! is stored once and is identified by a small integer
+//! (an atom), so name tests are integer compares.
+using atom_t = uint32_t;
+
+//! The atom of the empty name (non-element nodes)
+constexpr atom_t empty_atom = 0;
+
+//! The atom of a name which is not in the table, it is
+//! not equal to any interned atom
+constexpr atom_t unknown_atom = 
+  std::numeric_limits<atom_t>::max() - 1;
+
+//! Returns the atom of the name, adds the name to the
+//! table if it is new. Names are case sensitive.
+atom_t intern_tag(const std::string& name);
+
+//! Returns the atom of the name or unknown_atom, it
+//! never adds names. It does not lock when the name
+//! was already looked up by the thread.
+atom_t find_tag(const std::string& name);
+
+//! Returns the name of the atom. It does not lock.
+const std::string& atom_name(atom_t atom);
+
+//! XPath string functions over an attribute value (see
+//! test::attr_string)
+enum class string_fn {
+  equals,      //!< @name = 's'
+  starts_with, //!< starts-with(@name, 's')
+  ends_with,   //!< ends-with(@name, 's') (XPath 2.0)
+  contains     //!< contains(@name, 's')
+};
+
+//! Applies fn to the bytes [s, s + n) and arg. It does
+//! not allocate. The substring search scans for the
+//! first byte with memchr (it is vectorized in libc)
+//! and compares the rest with memcmp.
+bool string_match(
+  string_fn fn, 
+  const char* s, 
+  size_t n, 
+  const std::string& arg
+);
+
 //! [7] NodeTest
 namespace test {
 
@@ -88,6 +138,13 @@ public:
     return result;
   }
 
+  //! The test over a node (for forward scans)
+  template<class Node>
+  bool match(const Node&) const
+  {
+    return result;
+  }
+
 protected:
   bool result;
 };
@@ -113,6 +170,12 @@ public:
     return it->get_type() == the_type;
   }
 
+  template<class Node>
+  bool match(const Node& n) const
+  {
+    return n.get_type() == the_type;
+  }
+
 protected:
   type the_type;
 
@@ -128,29 +191,55 @@ public:
   template<class I>
   using the_template = name<I>;
 
-  name() : inited(false) {}
+  name() : inited(false), the_atom(empty_atom) {}
 
   name(const std::string& nm) 
     : inited(true),
-      the_name(nm) 
+      the_name(nm),
+      the_atom(intern_tag(the_name))
   {}
 
   name(std::string&& nm) 
     : inited(true),
-      the_name(std::move(nm)) 
+      the_name(std::move(nm)),
+      the_atom(intern_tag(the_name))
   {}
 
+  //! Compares the tag name of an element or the name of
+  //! an attribute node
   bool operator()(It it) const
   {
+    if (it->is_attribute())
+      return it->attr_name() == the_name;
+
     LOG_TRACE(log, "xpath::test::name: "
       << it->tag_name() << " vs " << the_name
     );
-    return it->tag_name() == the_name;
+    return it->has_tag(the_atom, the_name);
+  }
+
+  template<class Node>
+  bool match(const Node& n) const
+  {
+    if (n.is_attribute())
+      return n.attr_name() == the_name;
+
+    return n.has_tag(the_atom, the_name);
+  }
+
+  //! Moves `it' forward to the next matched node if the
+  //! iterator can seek by a tag atom (e.g., a descendant
+  //! iterator over a snapshot with the tag index).
+  template<class I>
+  auto seek(I& it) const -> decltype(it.seek_tag(atom_t()))
+  {
+    return it.seek_tag(the_atom);
   }
 
 protected:
   bool inited;
   std::string the_name;
+  atom_t the_atom;
 
 private:
   using log = curr::Logger<name>;
@@ -186,6 +275,244 @@ protected:
   function_t function;
 };
 
+//! The attribute equality test: @name = 'value'.
+//! The argument is a (name, value) pair.
+template<class It>
+class attr_equals
+{
+public:
+  template<class I>
+  using the_template = attr_equals<I>;
+
+  using arg_type = std::pair<std::string, std::string>;
+
+  attr_equals() {}
+
+  attr_equals(const arg_type& nv)
+    : the_name(nv.first),
+      the_value(nv.second)
+  {}
+
+  //! For an attribute node compares the node itself,
+  //! otherwise the element attribute
+  bool operator()(It it) const
+  {
+    if (it->is_attribute())
+      return it->attr_name() == the_name
+        && it->attr_value() == the_value;
+
+    return (*it)[the_name] == the_value;
+  }
+
+  template<class Node>
+  bool match(const Node& n) const
+  {
+    if (n.is_attribute())
+      return n.attr_name() == the_name
+        && n.attr_value() == the_value;
+
+    return n[the_name] == the_value;
+  }
+
+  //! Moves `it' forward to the next matched node if the
+  //! iterator can seek by an attribute (e.g., a
+  //! descendant iterator over a snapshot captured with
+  //! the attribute index).
+  template<class I>
+  auto seek(I& it) const 
+    -> decltype(
+         it.seek_attr(std::string(), std::string())
+       )
+  {
+    return it.seek_attr(the_name, the_value);
+  }
+
+protected:
+  std::string the_name;
+  std::string the_value;
+};
+
+//! The argument of attr_string
+struct string_arg
+{
+  std::string name;
+  string_fn fn;
+  std::string value;
+};
+
+//! contains(@name, 'value')
+inline string_arg contains(
+  const std::string& name, 
+  const std::string& value
+)
+{
+  return string_arg{name, string_fn::contains, value};
+}
+
+//! starts-with(@name, 'value')
+inline string_arg starts_with(
+  const std::string& name, 
+  const std::string& value
+)
+{
+  return string_arg{name, string_fn::starts_with, value};
+}
+
+//! ends-with(@name, 'value')
+inline string_arg ends_with(
+  const std::string& name, 
+  const std::string& value
+)
+{
+  return string_arg{name, string_fn::ends_with, value};
+}
+
+//! A string function test over an attribute value. A
+//! missing attribute is an empty string (as in XPath).
+//! Over a snapshot it runs on the attribute bytes in
+//! place, no strings are created.
+template<class It>
+class attr_string
+{
+public:
+  template<class I>
+  using the_template = attr_string<I>;
+
+  using arg_type = string_arg;
+
+  attr_string() : arg{std::string(), string_fn::equals} {}
+
+  attr_string(const arg_type& a) : arg(a) {}
+
+  //! For an attribute node checks the node itself,
+  //! otherwise the element attribute
+  bool operator()(It it) const
+  {
+    return match(*it);
+  }
+
+  template<class Node>
+  bool match(const Node& n) const
+  {
+    if (n.is_attribute()) {
+      if (n.attr_name() != arg.name)
+        return false;
+      const std::string v = n.attr_value();
+      return string_match(
+        arg.fn, 
+        v.data(), 
+        v.size(), 
+        arg.value
+      );
+    }
+
+    return n.match_attribute(arg.name, arg.fn, arg.value);
+  }
+
+protected:
+  arg_type arg;
+};
+
+//! The argument of the position predicate
+struct position_arg
+{
+  enum class kind { 
+    nth,       //!< [n]
+    last,      //!< [last()]
+    less_than  //!< [position() < n]
+  };
+
+  kind what;
+  size_t n;
+};
+
+//! [n] (1-based)
+inline position_arg nth(size_t n)
+{
+  return position_arg{position_arg::kind::nth, n};
+}
+
+//! [last()]
+inline position_arg last()
+{
+  return position_arg{position_arg::kind::last, 0};
+}
+
+//! [position() < n]
+inline position_arg position_less(size_t n)
+{
+  return position_arg{position_arg::kind::less_than, n};
+}
+
+//! A positional predicate. It is not a node test: a
+//! query with this predicate selects a range of the
+//! nested query result and stops its iterator at the
+//! position (see step::query).
+template<class It>
+class position
+{
+public:
+  template<class I>
+  using the_template = position<I>;
+
+  using arg_type = position_arg;
+  using kind = position_arg::kind;
+
+  position() : arg(nth(1)) {}
+
+  position(const arg_type& a) : arg(a) {}
+
+  kind what() const
+  {
+    return arg.what;
+  }
+
+  size_t n() const
+  {
+    return arg.n;
+  }
+
+protected:
+  arg_type arg;
+};
+
+//! Matches nodes matched by any of two tests over the
+//! same iterator. It is the union of two steps over one
+//! axis (see step::make_union).
+template<class Test1, class Test2>
+class either
+{
+public:
+  template<class I>
+  using the_template = either<Test1, Test2>;
+
+  either() {}
+
+  either(const Test1& t1, const Test2& t2) 
+    : first(t1), second(t2)
+  {}
+
+  template<class It>
+  bool operator()(It it) const
+  {
+    return first(it) || second(it);
+  }
+
+  //! Defined if both tests can match a node
+  template<class Node>
+  auto match(const Node& n) const -> decltype(
+    std::declval<const Test1&>().match(n)
+      || std::declval<const Test2&>().match(n)
+  )
+  {
+    return first.match(n) || second.match(n);
+  }
+
+protected:
+  Test1 first;
+  Test2 second;
+};
+
 } // test
 
 //! The special error value to mark uninitialized data.
@@ -195,15 +522,112 @@ constexpr static Int uninitialized(Int)
   return std::numeric_limits<Int>::min();
 }
 
+//! Mixes the hash of v into the seed h (as
+//! boost::hash_combine)
+template<class T>
+void hash_combine(size_t& h, const T& v)
+{
+  h ^= std::hash<T>()(v) 
+    + 0x9e3779b9 + (h << 6) + (h >> 2);
+}
+
 template<class NodePtr>
 class node;
 
+//! NodePtr has key(): an integer node identity (e.g.,
+//! snapshot::node_ptr::key())
+template<class NodePtr>
+struct has_node_key
+{
+  template<class P>
+  static auto check(int) -> decltype(
+    std::declval<const P&>().key(),
+    std::true_type()
+  );
+
+  template<class P>
+  static std::false_type check(long);
+
+  static constexpr bool value = 
+    decltype(check<NodePtr>(0))::value;
+};
+
+//! NodePtr has (pre, post, depth) labels and checks
+//! ancestry by them (e.g., snapshot::node_ptr)
+template<class NodePtr>
+struct has_node_labels
+{
+  template<class P>
+  static auto check(int) -> decltype(
+    std::declval<const P&>()->is_ancestor_of(
+      std::declval<const P&>()
+    ),
+    std::declval<const P&>()->post(),
+    std::declval<const P&>()->depth(),
+    std::true_type()
+  );
+
+  template<class P>
+  static std::false_type check(long);
+
+  static constexpr bool value = 
+    decltype(check<NodePtr>(0))::value;
+};
+
+template<class NodePtr>
+bool same_node(
+  const NodePtr& a, 
+  const NodePtr& b, 
+  std::true_type
+)
+{
+  return a.key() == b.key();
+}
+
+template<class NodePtr>
+bool same_node(
+  const NodePtr& a, 
+  const NodePtr& b, 
+  std::false_type
+)
+{
+  return a->IsSame(b);
+}
+
+//! The node identity check. It compares keys if NodePtr
+//! has them, otherwise it is CefDOMNode::IsSame (a
+//! virtual call across the CEF C API).
+template<class NodePtr>
+bool same_node(const NodePtr& a, const NodePtr& b)
+{
+  return same_node(
+    a, 
+    b, 
+    std::integral_constant<
+      bool, 
+      has_node_key<NodePtr>::value
+    >()
+  );
+}
+
 using node_difference_type = ptrdiff_t;
 
-class child_path_t : public std::list<node_difference_type>
+//! Child indexes from the context down to a node. The
+//! first element is the (unknown) context index. It is a
+//! small vector of 32-bit indexes, paths up to
+//! inline_capacity levels do not allocate. Iterators
+//! update it in place when go down and up.
+class child_path_t
 {
 public:
-  using std::list<node_difference_type>::list;
+  using value_type = int32_t;
+  using size_type = uint32_t;
+  using reference = value_type&;
+  using const_reference = const value_type&;
+  using iterator = value_type*;
+  using const_iterator = const value_type*;
+
+  static constexpr size_type inline_capacity = 12;
 
   child_path_t() {}
 
@@ -212,15 +636,180 @@ public:
     push_back(idx);
   }
 
+  child_path_t(std::initializer_list<value_type> il)
+  {
+    assign(il.begin(), il.end());
+  }
+
+  child_path_t(const child_path_t& o)
+  {
+    assign(o.begin(), o.end());
+  }
+
+  child_path_t(child_path_t&& o) noexcept
+  {
+    steal(o);
+  }
+
+  ~child_path_t()
+  {
+    if (data != buf)
+      delete[] data;
+  }
+
+  child_path_t& operator=(const child_path_t& o)
+  {
+    if (this != &o)
+      assign(o.begin(), o.end());
+    return *this;
+  }
+
+  child_path_t& operator=(child_path_t&& o) noexcept
+  {
+    if (this != &o) {
+      if (data != buf)
+        delete[] data;
+      steal(o);
+    }
+    return *this;
+  }
+
+  template<class It>
+  void assign(It from, It to)
+  {
+    const size_type n = std::distance(from, to);
+    sz = 0;
+    reserve(n);
+    std::copy(from, to, data);
+    sz = n;
+  }
+
+  iterator begin() { return data; }
+  iterator end() { return data + sz; }
+  const_iterator begin() const { return data; }
+  const_iterator end() const { return data + sz; }
+
+  size_type size() const { return sz; }
+  bool empty() const { return sz == 0; }
+
+  reference operator[](size_type k) { return data[k]; }
+
+  const_reference operator[](size_type k) const
+  {
+    return data[k];
+  }
+
+  reference front() 
+  { 
+    assert(sz > 0); 
+    return data[0]; 
+  }
+
+  const_reference front() const 
+  { 
+    assert(sz > 0); 
+    return data[0]; 
+  }
+
+  reference back() 
+  { 
+    assert(sz > 0); 
+    return data[sz - 1]; 
+  }
+
+  const_reference back() const 
+  { 
+    assert(sz > 0); 
+    return data[sz - 1]; 
+  }
+
+  void push_back(node_difference_type idx)
+  {
+    if (sz == cap)
+      reserve(2 * cap);
+    data[sz++] = (value_type) idx;
+  }
+
+  void pop_back()
+  {
+    assert(sz > 0);
+    --sz;
+  }
+
+  void clear() { sz = 0; }
+
+  //! New elements are zero
+  void resize(size_type n)
+  {
+    reserve(n);
+    if (n > sz)
+      std::fill(data + sz, data + n, 0);
+    sz = n;
+  }
+
+  void reserve(size_type n)
+  {
+    if (n <= cap)
+      return;
+
+    value_type* d = new value_type[n];
+    std::copy(data, data + sz, d);
+    if (data != buf)
+      delete[] data;
+    data = d;
+    cap = n;
+  }
+
   constexpr static value_type uninitialized()
   {
     return xpath::uninitialized<value_type>(0);
   }
 
+  bool operator==(const child_path_t& o) const
+  {
+    return sz == o.sz 
+      && std::equal(begin(), end(), o.begin());
+  }
+
+  bool operator!=(const child_path_t& o) const
+  {
+    return !operator==(o);
+  }
+
+  bool operator<(const child_path_t& o) const
+  {
+    return std::lexicographical_compare(
+      begin(), end(), o.begin(), o.end()
+    );
+  }
+
   operator std::string() const
   {
     return curr::sformat(*this);
   }
+
+protected:
+  void steal(child_path_t& o) noexcept
+  {
+    sz = o.sz;
+    if (o.data == o.buf) {
+      data = buf;
+      cap = inline_capacity;
+      std::copy(o.buf, o.buf + sz, buf);
+    }
+    else {
+      data = o.data;
+      cap = o.cap;
+      o.data = o.buf;
+      o.cap = inline_capacity;
+    }
+    o.sz = 0;
+  }
+
+  value_type* data = buf;
+  size_type sz = 0;
+  size_type cap = inline_capacity;
+  value_type buf[inline_capacity];
 };
 
 std::ostream&
@@ -232,6 +821,13 @@ namespace node_iterators {
 //! The end iterator marker for constructor
 struct end_t {};
 
+//! The result of iterator seek_xxx methods
+enum class seek_result { 
+  no_seek,   //!< the iterator can't seek, not moved
+  found,     //!< moved to the found node
+  not_found  //!< no such nodes, the ovf is increased
+};
+
 template<class NodePtr>
 class iterator_base;
 
@@ -286,6 +882,12 @@ public:
   XPATH_INTERNAL_ITERATOR_ALIAS(attribute);
   XPATH_INTERNAL_ITERATOR_ALIAS(following_sibling);
   XPATH_INTERNAL_ITERATOR_ALIAS(preceding_sibling);
+  XPATH_INTERNAL_ITERATOR_ALIAS(parent);
+  XPATH_INTERNAL_ITERATOR_ALIAS(ancestor);
+  XPATH_INTERNAL_ITERATOR_ALIAS(ancestor_or_self);
+  XPATH_INTERNAL_ITERATOR_ALIAS(descendant_or_self);
+  XPATH_INTERNAL_ITERATOR_ALIAS(following);
+  XPATH_INTERNAL_ITERATOR_ALIAS(preceding);
 
   node() {}
 
@@ -344,6 +946,12 @@ public:
   XPATH_INTERNAL_AXIS_DEF(attribute);
   XPATH_INTERNAL_AXIS_DEF(following_sibling);
   XPATH_INTERNAL_AXIS_DEF(preceding_sibling);
+  XPATH_INTERNAL_AXIS_DEF(parent);
+  XPATH_INTERNAL_AXIS_DEF(ancestor);
+  XPATH_INTERNAL_AXIS_DEF(ancestor_or_self);
+  XPATH_INTERNAL_AXIS_DEF(descendant_or_self);
+  XPATH_INTERNAL_AXIS_DEF(following);
+  XPATH_INTERNAL_AXIS_DEF(preceding);
 
   type get_type() const
   {
@@ -380,6 +988,27 @@ public:
     return res;
   }
 
+  //! The atom of tag_name(). It is cached in the node.
+  //! It is unknown_atom for a live DOM tag name which is
+  //! not interned (no test can match it).
+  atom_t tag_atom() const
+  {
+    SCHECK(the_type != itype::attribute);
+
+    if (tag_atom_ == no_atom)
+      tag_atom_ = load_tag_atom(dom, 0);
+    return tag_atom_;
+  }
+
+  //! Whether the tag name is `name' (`atom' is its
+  //! atom). A live node compares strings: its atom is a
+  //! hash probe over the same tag_name() conversion.
+  bool has_tag(atom_t atom, const std::string& name) const
+  {
+    SCHECK(the_type != itype::attribute);
+    return has_tag(dom, atom, name, 0);
+  }
+
   int n_attrs() const
   {
     if (!dom->IsElement())
@@ -410,12 +1039,36 @@ public:
     );
   }
 
-#if 0
-  std::string name() const
+  bool is_attribute() const
   {
-    SCHECK(the_type == itype::attribute);
+    return the_type == itype::attribute;
+  }
 
-    CefString name, value;
+  //! The sequence number of an attribute node
+  int attr_index() const
+  {
+    SCHECK(the_type == itype::attribute);
+    return attr_idx;
+  }
+
+  //! The attribute index is in range. An iterator over
+  //! an empty attribute axis (an element without
+  //! attributes or a non-element) points to a node
+  //! without the attribute.
+  bool has_attr_node() const
+  {
+    SCHECK(the_type == itype::attribute);
+    return attr_idx >= 0 && attr_idx < n_attrs();
+  }
+
+  //! The name of an attribute node or an empty string if
+  //! !has_attr_node()
+  std::string attr_name() const
+  {
+    if (!has_attr_node())
+      return std::string();
+
+    CefString name, value;
     dom->GetElementAttributeByIdx(
       attr_idx, 
       name,
@@ -423,7 +1076,22 @@ public:
     );
     return name.ToString();
   }
-#endif
+
+  //! The value of an attribute node or an empty string
+  //! if !has_attr_node()
+  std::string attr_value() const
+  {
+    if (!has_attr_node())
+      return std::string();
+
+    CefString name, value;
+    dom->GetElementAttributeByIdx(
+      attr_idx, 
+      name,
+      value
+    );
+    return value.ToString();
+  }
 
 #if 0
   bool operator==(CefRefPtr<CefDOMNode> o) const
@@ -462,13 +1130,58 @@ public:
     return dom;
   }
 
-  //! Access the attribute value by name
+  //! Access the attribute value by name. It looks up
+  //! the only attribute and does not load the others.
   //! @return the attribute value or empty string
   std::string operator[](const std::string& name) const
+  {
+    if (!attr_map.empty()) {
+      const auto p = attr_map.find(name);
+      return p != attr_map.end() 
+        ? p->second : std::string();
+    }
+    return find_attribute(dom, name, 0);
+  }
+
+  //! The element has the attribute `name' (possibly
+  //! with an empty value)
+  bool has_attribute(const std::string& name) const
+  {
+    if (!attr_map.empty())
+      return attr_map.count(name) > 0;
+    return check_attribute(dom, name, 0);
+  }
+
+  //! fn(@name, arg), a missing attribute is an empty
+  //! string. Over a snapshot it compares the attribute
+  //! bytes in place.
+  bool match_attribute(
+    const std::string& name,
+    string_fn fn,
+    const std::string& arg
+  ) const
+  {
+    if (!attr_map.empty()) {
+      const auto p = attr_map.find(name);
+      if (p == attr_map.end())
+        return string_match(fn, "", 0, arg);
+      return string_match(
+        fn, 
+        p->second.data(), 
+        p->second.size(), 
+        arg
+      );
+    }
+    return compare_attribute(dom, name, fn, arg, 0);
+  }
+
+  //! All name-value pairs of attributes. They are loaded
+  //! on the first call.
+  const std::map<std::string, std::string>& 
+  attributes() const
   {
     check_load_attributes();
-    const auto p = attr_map.find(name);
-    return p != attr_map.end() ? p->second : std::string();
+    return attr_map;
   }
 
   //! reloads itself with the first child if any or
@@ -477,6 +1190,8 @@ public:
   {
     if (const NodePtr first = dom->GetFirstChild()) {
       dom = first;
+      tag_atom_ = no_atom;
+      attr_map.clear();
       return true;
     }
     else return false;
@@ -488,6 +1203,8 @@ public:
   {
     if (const NodePtr last = dom->GetLastChild()) {
       dom = last;
+      tag_atom_ = no_atom;
+      attr_map.clear();
       return true;
     }
     else return false;
@@ -499,6 +1216,8 @@ public:
   {
     if (const NodePtr next = dom->GetNextSibling()) {
       dom = next;
+      tag_atom_ = no_atom;
+      attr_map.clear();
       return true;
     }
     else return false;
@@ -510,6 +1229,8 @@ public:
   {
     if (const NodePtr prev = dom->GetPreviousSibling()) {
       dom = prev;
+      tag_atom_ = no_atom;
+      attr_map.clear();
       return true;
     }
     else return false;
@@ -521,6 +1242,8 @@ public:
   {
     if (const NodePtr parent = dom->GetParent()) {
       dom = parent;
+      tag_atom_ = no_atom;
+      attr_map.clear();
       return true;
     }
     else return false;
@@ -532,7 +1255,163 @@ public:
       && dom.get() != nullptr;
   }
 
+  //! The same DOM node (attribute indexes are not
+  //! compared, see operator==)
+  bool is_same(const node& o) const
+  {
+    return same_node(dom, o.dom);
+  }
+
+  //! The same node or attribute. It is O(1) if NodePtr
+  //! has key().
+  bool operator==(const node& o) const
+  {
+    if (!is_valid() || !o.is_valid())
+      return is_valid() == o.is_valid();
+
+    return the_type == o.the_type
+      && attr_idx == o.attr_idx
+      && is_same(o);
+  }
+
+  bool operator!=(const node& o) const
+  {
+    return !operator==(o);
+  }
+
+  //! The DOM node identity. It is defined only if
+  //! NodePtr has key().
+  uint64_t key() const
+  {
+    return dom.key();
+  }
+
+  //! The hash of the node or attribute (see std::hash
+  //! below). It is defined only if NodePtr has key().
+  size_t hash() const
+  {
+    size_t h = std::hash<uint64_t>()(key());
+    if (is_attribute())
+      hash_combine(h, attr_idx);
+    return h;
+  }
+
 protected:
+  //! The tag_atom_ value when it is not loaded yet
+  constexpr static atom_t no_atom = 
+    std::numeric_limits<atom_t>::max();
+
+  //! A NodePtr with GetElementTagAtom() (like
+  //! snapshot::node_ptr) returns the atom itself
+  template<class Ptr>
+  static auto load_tag_atom(const Ptr& p, int)
+    -> decltype(p->GetElementTagAtom())
+  {
+    return p->GetElementTagAtom();
+  }
+
+  //! A live node tag which is not in the table does not
+  //! match any test name, so it is not added
+  template<class Ptr>
+  atom_t load_tag_atom(const Ptr&, long) const
+  {
+    return find_tag(tag_name());
+  }
+
+  template<class Ptr>
+  auto has_tag(
+    const Ptr& p, 
+    atom_t atom, 
+    const std::string&, 
+    int
+  ) const -> decltype(p->GetElementTagAtom(), bool())
+  {
+    return tag_atom() == atom;
+  }
+
+  //! The atom is used only if it is already loaded
+  template<class Ptr>
+  bool has_tag(
+    const Ptr&, 
+    atom_t atom, 
+    const std::string& name, 
+    long
+  ) const
+  {
+    return tag_atom_ != no_atom 
+      ? tag_atom_ == atom : tag_name() == name;
+  }
+
+  //! A NodePtr with get_attribute() (like
+  //! snapshot::node_ptr) looks up the attribute itself
+  template<class Ptr>
+  static auto find_attribute(
+    const Ptr& p, 
+    const std::string& name, 
+    int
+  ) -> decltype(p->get_attribute(name))
+  {
+    return p->get_attribute(name);
+  }
+
+  template<class Ptr>
+  static std::string find_attribute(
+    const Ptr& p, 
+    const std::string& name, 
+    long
+  )
+  {
+    if (!p->IsElement())
+      return std::string();
+
+    return p->GetElementAttribute(name).ToString();
+  }
+
+  template<class Ptr>
+  static auto check_attribute(
+    const Ptr& p, 
+    const std::string& name, 
+    int
+  ) -> decltype(p->has_attribute(name))
+  {
+    return p->has_attribute(name);
+  }
+
+  template<class Ptr>
+  static bool check_attribute(
+    const Ptr& p, 
+    const std::string& name, 
+    long
+  )
+  {
+    return p->IsElement() && p->HasElementAttribute(name);
+  }
+
+  template<class Ptr>
+  static auto compare_attribute(
+    const Ptr& p, 
+    const std::string& name, 
+    string_fn fn,
+    const std::string& arg,
+    int
+  ) -> decltype(p->match_attribute(name, fn, arg))
+  {
+    return p->match_attribute(name, fn, arg);
+  }
+
+  template<class Ptr>
+  static bool compare_attribute(
+    const Ptr& p, 
+    const std::string& name, 
+    string_fn fn,
+    const std::string& arg,
+    long
+  )
+  {
+    const std::string v = find_attribute(p, name, 0);
+    return string_match(fn, v.data(), v.size(), arg);
+  }
+
   //! Loads all attributes into attr_map if it was empty
   //! only
   void check_load_attributes() const
@@ -566,6 +1445,9 @@ protected:
   //! name-values pairs for all attributes
   mutable std::map<std::string, std::string> attr_map;
 
+  //! the cached tag_atom()
+  mutable atom_t tag_atom_ = no_atom;
+
 private:
   using log = curr::Logger<node<NodePtr>>;
 };
@@ -606,7 +1488,7 @@ public:
     return (empty && o.empty)
       || (ovf == o.ovf 
           && current.attr_idx == o.current.attr_idx
-          && current->IsSame(o.current));
+          && current.is_same(o.current));
   }
 
   bool operator!=(const iterator_base& o) const noexcept
@@ -643,7 +1525,7 @@ public:
     return &current;
   }
 
-  child_path_t path() const
+  const child_path_t& path() const
   {
     return child_path;
   }
@@ -659,7 +1541,7 @@ public:
 
   bool is_same_context(const iterator_base& o) const
   {
-    return context->IsSame(o.context);
+    return context.is_same(o.context);
   }
 
   difference_type& get_ovf()
@@ -678,9 +1560,9 @@ public:
   {
     assert(!empty);
     assert(!o.empty);
-    assert(context->IsSame(o.context));
+    assert(context.is_same(o.context));
     return current.attr_idx == o.current.attr_idx
-      && current->IsSame(o.current);
+      && current.is_same(o.current);
   }
 
 protected:
@@ -773,6 +1655,176 @@ protected:
     }
   }
 
+  //! Moves to the next node in the document order after
+  //! the n subtree and updates its depth d. Returns false
+  //! (n is the root) if there are no such nodes.
+  static bool preorder_skip(node<NodePtr>& n, int& d) 
+    noexcept
+  {
+    for (;;) {
+      if (n.go_next_sibling())
+        return true;
+      if (!n.go_parent())
+        return false;
+      --d;
+    }
+  }
+
+  //! Moves to the next node in the document order
+  static bool preorder_next(node<NodePtr>& n, int& d) 
+    noexcept
+  {
+    if (n.go_first_child()) {
+      ++d;
+      return true;
+    }
+    return preorder_skip(n, d);
+  }
+
+  //! Moves to the previous node in the document order
+  static bool preorder_prev(node<NodePtr>& n, int& d) 
+    noexcept
+  {
+    if (n.go_prev_sibling()) {
+      while (n.go_last_child())
+        ++d;
+      return true;
+    }
+    if (!n.go_parent())
+      return false;
+    --d;
+    return true;
+  }
+
+  //! The context ancestors-or-self. A live DOM node has
+  //! no labels, so axes testing the context ancestry
+  //! load it once per iterator instead of walking to the
+  //! root on each test.
+  struct context_chain
+  {
+    //! from the root, the context is the last
+    std::vector<node<NodePtr>> nodes;
+
+    //! the context is on the last child path of
+    //! nodes[k] for k >= last_from
+    int last_from = 0;
+
+    int context_depth() const
+    {
+      return nodes.size() - 1;
+    }
+  };
+
+  void load_chain()
+  {
+    auto c = std::make_shared<context_chain>();
+    node<NodePtr> n = context;
+    do c->nodes.push_back(n);
+    while (n.go_parent());
+    std::reverse(c->nodes.begin(), c->nodes.end());
+
+    c->last_from = c->context_depth();
+    while (c->last_from > 0) {
+      node<NodePtr> s = c->nodes[c->last_from];
+      if (s.go_next_sibling())
+        break;
+      --c->last_from;
+    }
+    chain = std::move(c);
+  }
+
+  //! Loads the chain if NodePtr has no labels
+  void load_live_chain()
+  {
+    if (!has_node_labels<NodePtr>::value)
+      load_chain();
+  }
+
+  //! The context depth for depths maintained with the
+  //! chain (0 if it is not loaded)
+  int context_depth() const
+  {
+    return chain ? chain->context_depth() : 0;
+  }
+
+  //! n at the depth d is a proper ancestor of the context
+  bool is_context_ancestor(const node<NodePtr>& n, int d) 
+    const
+  {
+    return is_context_ancestor(
+      n, 
+      d, 
+      std::integral_constant<
+        bool, 
+        has_node_labels<NodePtr>::value
+      >()
+    );
+  }
+
+  //! The last node of the s subtree (s is at the depth
+  //! d) is in the context subtree, i.e., the context is
+  //! on the last child path from s
+  bool ends_in_context(const node<NodePtr>& s, int d) 
+    const
+  {
+    return ends_in_context(
+      s, 
+      d, 
+      std::integral_constant<
+        bool, 
+        has_node_labels<NodePtr>::value
+      >()
+    );
+  }
+
+  bool is_context_ancestor(
+    const node<NodePtr>& n, 
+    int, 
+    std::true_type
+  ) const
+  {
+    const NodePtr a = n;
+    const NodePtr ctx = context;
+    return a->is_ancestor_of(ctx);
+  }
+
+  bool is_context_ancestor(
+    const node<NodePtr>& n, 
+    int d, 
+    std::false_type
+  ) const
+  {
+    assert(chain);
+    return d >= 0 && d < chain->context_depth()
+      && chain->nodes[d].is_same(n);
+  }
+
+  //! post(parent) = post(last child) + 1
+  bool ends_in_context(
+    const node<NodePtr>& s, 
+    int, 
+    std::true_type
+  ) const
+  {
+    const NodePtr a = s;
+    const NodePtr ctx = context;
+    return (a->IsSame(ctx) || a->is_ancestor_of(ctx))
+      && a->post() - ctx->post() 
+         == ctx->depth() - a->depth();
+  }
+
+  bool ends_in_context(
+    const node<NodePtr>& s, 
+    int d, 
+    std::false_type
+  ) const
+  {
+    assert(chain);
+    return d >= chain->last_from 
+      && d <= chain->context_depth()
+      && chain->nodes[d].is_same(s);
+  }
+
   bool go_context_first_child()
   {
     current = context;
@@ -819,6 +1871,12 @@ protected:
   //! true if context and current are not initialized
   bool empty = true;
 
+  //! see load_chain(), iterator copies share it
+  std::shared_ptr<const context_chain> chain;
+
+  //! the current depth for axes which maintain it
+  int depth = 0;
+
 private:
   using log = curr::Logger<iterator_base>;
 };
@@ -898,7 +1956,7 @@ public:
 
   iterator& operator++() noexcept
   {
-    if (this->current->IsSame(this->context)) 
+    if (this->current.is_same(this->context)) 
       // empty child axis
       ++(this->ovf);
     else {
@@ -924,7 +1982,7 @@ public:
 
   iterator& operator--() noexcept
   {
-    if (this->current->IsSame(this->context)) 
+    if (this->current.is_same(this->context)) 
       // empty child axis
       --(this->ovf);
     else {
@@ -1008,7 +2066,7 @@ public:
   {
     // it must be always after the context node
     SCHECK(this->go_prev_sibling());
-    if (this->current->IsSame(this->context)) {
+    if (this->current.is_same(this->context)) {
       // go to the last sibling
       while(this->go_next_sibling()) {
         LOG_TRACE(log, 
@@ -1087,7 +2145,7 @@ public:
   {
     // it must be always before the context node
     SCHECK(this->go_next_sibling());
-    if (this->current->IsSame(this->context)) {
+    if (this->current.is_same(this->context)) {
       // go to the first sibling
       while(this->go_prev_sibling()) 
         ;
@@ -1143,41 +2201,7 @@ public:
 
   iterator& operator++() noexcept
   {
-    if (this->current->IsSame(this->context)) {
-      ++(this->ovf);
-      LOG_TRACE(log, "O" << this->ovf);
-    }
-
-    // go to the child first
-    if (this->go_first_child())
-      ;
-    // now try the next sibling
-    else if (this->go_next_sibling())
-      ;
-    else {
-      // now try the parents' next sibling
-      while (!this->current->IsSame(this->context))
-      {
-        LOG_TRACE(log, 
-          "[context = " << this->context.tag_name() 
-          << ", this->current = " 
-          << this->current.tag_name()
-          << ']');
-        if (this->go_parent())
-        {
-          if (this->current->IsSame(this->context))
-            break; // go to end()
-
-          if (this->go_next_sibling())
-            break;
-        } 
-        else break;
-      }
-      if (this->current->IsSame(this->context)) {
-        this->go_first_child(); //cycled
-        ++(this->ovf);
-      }
-    }
+    increment(0);
     return *this;
   }
 
@@ -1190,7 +2214,8 @@ public:
 
   iterator& operator--()
   {
-    THROW_NOT_IMPLEMENTED;
+    decrement(0);
+    return *this;
   }
 
   iterator operator--(int)
@@ -1200,6 +2225,56 @@ public:
     return copy;
   }
 
+  //! Moves to the next node with the tag atom by the
+  //! NodePtr tag index (it is defined only for NodePtr
+  //! with next_tagged(), like snapshot::node_ptr). It is
+  //! the same as ++ until the node is found but does not
+  //! visit other nodes.
+  template<class Ptr = NodePtr>
+  auto seek_tag(atom_t atom) -> decltype(
+    std::declval<const Ptr&>()->next_tagged(
+      atom, 
+      std::declval<const Ptr&>()
+    ).get(),
+    seek_result()
+  )
+  {
+    return seek_next<Ptr>(
+      [atom](const Ptr& from, const Ptr& ctx)
+      {
+        return from->next_tagged(atom, ctx);
+      }
+    );
+  }
+
+  //! Moves to the next node with the attribute value by
+  //! the NodePtr attribute index if it has one.
+  template<class Ptr = NodePtr>
+  auto seek_attr(
+    const std::string& name, 
+    const std::string& value
+  ) 
+    -> decltype(
+      std::declval<const Ptr&>()->next_with_attr(
+        name,
+        value,
+        std::declval<const Ptr&>()
+      ).get(),
+      seek_result()
+    )
+  {
+    const Ptr ctx = this->context;
+    if (!ctx->has_attr_index())
+      return seek_result::no_seek;
+
+    return seek_next<Ptr>(
+      [&name, &value](const Ptr& from, const Ptr& ctx)
+      {
+        return from->next_with_attr(name, value, ctx);
+      }
+    );
+  }
+
   explicit iterator(const node<NodePtr>& context_node) 
     noexcept
     : iterator_base<NodePtr>(
@@ -1229,65 +2304,736 @@ public:
       )
   {}
 
-private:
-  typedef curr::Logger<iterator<NodePtr, axis::descendant>>
-    log;
-};
-
-// an xpath attribute axis
-template<class NodePtr>
-class iterator<NodePtr, axis::attribute> 
-  : public iterator_base<NodePtr>
-{
-public:
-  iterator() noexcept {}
-
-  iterator& operator++() noexcept
+protected:
+  //! The pre-order step by the NodePtr labels (it is
+  //! defined only for NodePtr with next_preorder(), like
+  //! snapshot::node_ptr). It does not climb parents.
+  template<class Ptr = NodePtr>
+  auto increment(int) noexcept -> decltype(
+    std::declval<const Ptr&>()->next_preorder(
+      std::declval<const Ptr&>()
+    ).get(),
+    void()
+  )
   {
-    const int n = this->current.n_attrs();
-    int& idx = this->current.attr_idx;
-    if (++idx >= n)
-    {
-      idx = 0;
+    const Ptr ctx = this->context;
+    const Ptr cur = this->current;
+    if (same_node(cur, ctx)) {
+      increment(0L); // an empty axis
+      return;
+    }
+
+    Ptr next = cur->next_preorder(ctx);
+    if (!next.get()) {
+      next = ctx->next_preorder(ctx); //cycled
       ++(this->ovf);
+      LOG_TRACE(log, "O" << this->ovf);
     }
-    return *this;
-  }
 
-  iterator operator++(int) noexcept
-  {
-    iterator copy(*this);
-    ++(*this);
-    return copy;
+    // the path length is 1 + the depth under context,
+    // a pre-order step goes down by 1 level at most
+    this->child_path.resize(
+      1 + next->depth() - ctx->depth()
+    );
+    this->child_path.back() = next->child_index();
+    this->current = node<NodePtr>(next);
   }
 
-  iterator& operator--() noexcept
+  void increment(long) noexcept
   {
-    const int n = this->current.n_attrs();
-    const int m = (n == 0) ? 0 : n - 1;
-    int& idx = this->current.attr_idx;
-    if (--idx < 0)
-    {
-      idx = m;
-      --(this->ovf);
+    if (this->current.is_same(this->context)) {
+      ++(this->ovf);
+      LOG_TRACE(log, "O" << this->ovf);
     }
-    return *this;
-  }
-
-  iterator operator--(int) noexcept
-  {
-    iterator copy(*this);
-    --(*this);
-    return copy;
-  }
 
-protected:
-  explicit iterator(const node<NodePtr>& context_node) 
-    noexcept
-    : iterator_base<NodePtr>(
-        context_node, 
-        0, 
-        0,
+    // go to the child first
+    if (this->go_first_child())
+      ;
+    // now try the next sibling
+    else if (this->go_next_sibling())
+      ;
+    else {
+      // now try the parents' next sibling
+      while (!this->current.is_same(this->context))
+      {
+        LOG_TRACE(log, 
+          "[context = " << this->context.tag_name() 
+          << ", this->current = " 
+          << this->current.tag_name()
+          << ']');
+        if (this->go_parent())
+        {
+          if (this->current.is_same(this->context))
+            break; // go to end()
+
+          if (this->go_next_sibling())
+            break;
+        } 
+        else break;
+      }
+      if (this->current.is_same(this->context)) {
+        this->go_first_child(); //cycled
+        ++(this->ovf);
+      }
+    }
+  }
+
+  //! The reverse pre-order step by the NodePtr labels
+  template<class Ptr = NodePtr>
+  auto decrement(int) -> decltype(
+    std::declval<const Ptr&>()->prev_preorder(
+      std::declval<const Ptr&>()
+    ).get(),
+    void()
+  )
+  {
+    const Ptr ctx = this->context;
+    const Ptr cur = this->current;
+    if (same_node(cur, ctx)) {
+      --(this->ovf); // an empty axis
+      return;
+    }
+
+    Ptr prev = cur->prev_preorder(ctx);
+    if (!prev.get()) {
+      prev = ctx->last_descendant(); // cycled
+      --(this->ovf);
+      LOG_TRACE(log, "O" << this->ovf);
+    }
+    set_current<Ptr>(prev);
+  }
+
+  //! The reverse pre-order step
+  void decrement(long) noexcept
+  {
+    if (this->current.is_same(this->context)) {
+      --(this->ovf); // an empty axis
+      return;
+    }
+
+    if (this->go_prev_sibling()) {
+      while (this->go_last_child())
+        ;
+      return;
+    }
+
+    this->go_parent();
+    if (this->current.is_same(this->context)) {
+      // cycle to the last descendant
+      while (this->go_last_child())
+        ;
+      --(this->ovf);
+      LOG_TRACE(log, "O" << this->ovf);
+    }
+  }
+
+  //! Moves to the node and rebuilds the child path
+  template<class Ptr>
+  void set_current(const Ptr& nd)
+  {
+    const Ptr ctx = this->context;
+    child_path_t& path = this->child_path;
+    path.clear();
+    for (Ptr p = nd; !p->IsSame(ctx); p = p->GetParent())
+      path.push_back(p->child_index());
+    path.push_back(child_path_t::uninitialized());
+    std::reverse(path.begin(), path.end());
+
+    this->current = node<NodePtr>(nd);
+  }
+
+protected:
+  //! Moves to next(current, context) or, if it is empty,
+  //! cycles to next(context, context).
+  template<class Ptr, class Next>
+  seek_result seek_next(Next next_fn)
+  {
+    const Ptr ctx = this->context;
+    const Ptr cur = this->current;
+
+    Ptr next;
+    if (!same_node(cur, ctx)) // not an empty axis
+      next = next_fn(cur, ctx);
+    if (!next.get()) {
+      ++(this->ovf);
+      LOG_TRACE(log, "O" << this->ovf);
+      if (!same_node(cur, ctx))
+        next = next_fn(ctx, ctx); // the cycle
+      if (!next.get())
+        return seek_result::not_found;
+    }
+
+    set_current<Ptr>(next);
+    return seek_result::found;
+  }
+
+private:
+  typedef curr::Logger<iterator<NodePtr, axis::descendant>>
+    log;
+};
+
+// an xpath descendant_or_self axis
+template<class NodePtr>
+class iterator<NodePtr, axis::descendant_or_self> 
+  : public iterator_base<NodePtr>
+{
+public:
+  iterator() noexcept {}
+
+  iterator& operator++() noexcept
+  {
+    // go to the child first
+    if (this->go_first_child())
+      return *this;
+
+    // now try the next sibling of the node or of its
+    // nearest ancestor
+    while (!this->current.is_same(this->context)) {
+      if (this->go_next_sibling())
+        return *this;
+      this->go_parent();
+    }
+
+    ++(this->ovf); // cycled to the context node
+    return *this;
+  }
+
+  iterator operator++(int) noexcept
+  {
+    iterator copy(*this);
+    ++(*this);
+    return copy;
+  }
+
+  iterator& operator--() noexcept
+  {
+    if (this->current.is_same(this->context)) {
+      // cycle to the last descendant
+      while (this->go_last_child())
+        ;
+      --(this->ovf);
+    }
+    else if (this->go_prev_sibling()) {
+      while (this->go_last_child())
+        ;
+    }
+    else this->go_parent();
+    return *this;
+  }
+
+  iterator operator--(int) noexcept
+  {
+    iterator copy(*this);
+    --(*this);
+    return copy;
+  }
+
+  explicit iterator(const node<NodePtr>& context_node) 
+    noexcept
+    : iterator_base<NodePtr>(
+        context_node, 
+        context_node, 
+        0,
+        child_path_t::uninitialized()
+      )
+  {}
+
+  iterator(const node<NodePtr>& context_node, end_t) 
+    noexcept
+    : iterator_base<NodePtr>(
+        context_node, 
+        context_node, 
+        +1,
+        child_path_t::uninitialized()
+      )
+  {}
+};
+
+// an xpath parent axis
+template<class NodePtr>
+class iterator<NodePtr, axis::parent> 
+  : public iterator_base<NodePtr>
+{
+public:
+  iterator() noexcept {}
+
+  iterator& operator++() noexcept
+  {
+    ++(this->ovf);
+    return *this;
+  }
+
+  iterator operator++(int) noexcept
+  {
+    iterator copy(*this);
+    ++(*this);
+    return copy;
+  }
+
+  iterator& operator--() noexcept
+  {
+    --(this->ovf);
+    return *this;
+  }
+
+  iterator operator--(int) noexcept
+  {
+    iterator copy(*this);
+    --(*this);
+    return copy;
+  }
+
+  explicit iterator(const node<NodePtr>& context_node) 
+    noexcept
+    : iterator_base<NodePtr>(
+        context_node, 
+        context_node->GetParent().get() 
+          ? node<NodePtr>(context_node->GetParent())
+          : context_node,
+        0,
+        child_path_t::uninitialized()
+      )
+  {}
+
+  iterator(const node<NodePtr>& context_node, end_t) 
+    noexcept
+    : iterator_base<NodePtr>(
+        context_node, 
+        context_node->GetParent().get() 
+          ? node<NodePtr>(context_node->GetParent())
+          : context_node,
+        // begin == end for an empty axis
+        context_node->GetParent().get() ? +1 : 0,
+        child_path_t::uninitialized()
+      )
+  {}
+};
+
+// an xpath ancestor axis. NB It is reversed axis (from
+// the parent to the root).
+template<class NodePtr>
+class iterator<NodePtr, axis::ancestor> 
+  : public iterator_base<NodePtr>
+{
+public:
+  iterator() noexcept {}
+
+  iterator& operator++() noexcept
+  {
+    if (this->context_depth() == 0) 
+      // empty ancestor axis
+      ++(this->ovf);
+    else if (this->depth == 0) {
+      // cycle to the parent
+      this->depth = this->context_depth() - 1;
+      ++(this->ovf);
+    }
+    else --(this->depth);
+    this->current = this->chain->nodes[this->depth];
+    return *this;
+  }
+
+  iterator operator++(int) noexcept
+  {
+    iterator copy(*this);
+    ++(*this);
+    return copy;
+  }
+
+  iterator& operator--() noexcept
+  {
+    if (this->context_depth() == 0) 
+      // empty ancestor axis
+      --(this->ovf);
+    else if (this->depth + 1 == this->context_depth()) {
+      // cycle to the root
+      this->depth = 0;
+      --(this->ovf);
+    }
+    else ++(this->depth);
+    this->current = this->chain->nodes[this->depth];
+    return *this;
+  }
+
+  iterator operator--(int) noexcept
+  {
+    iterator copy(*this);
+    --(*this);
+    return copy;
+  }
+
+  //! The chain size is the axis size, so it is loaded
+  //! for any NodePtr
+  explicit iterator(const node<NodePtr>& context_node) 
+    noexcept
+    : iterator_base<NodePtr>(
+        context_node, 
+        context_node,
+        0,
+        child_path_t::uninitialized()
+      )
+  {
+    this->load_chain();
+    this->depth = std::max(this->context_depth() - 1, 0);
+    this->current = this->chain->nodes[this->depth];
+  }
+
+  iterator(const node<NodePtr>& context_node, end_t) 
+    noexcept
+    : iterator(context_node)
+  {
+    // begin == end for an empty axis
+    if (this->context_depth() > 0)
+      this->ovf = +1;
+  }
+};
+
+// an xpath ancestor_or_self axis. NB It is reversed axis
+// (from the context node to the root).
+template<class NodePtr>
+class iterator<NodePtr, axis::ancestor_or_self> 
+  : public iterator_base<NodePtr>
+{
+public:
+  iterator() noexcept {}
+
+  iterator& operator++() noexcept
+  {
+    if (this->depth == 0) {
+      // cycle to the context
+      this->depth = this->context_depth();
+      ++(this->ovf);
+    }
+    else --(this->depth);
+    this->current = this->chain->nodes[this->depth];
+    return *this;
+  }
+
+  iterator operator++(int) noexcept
+  {
+    iterator copy(*this);
+    ++(*this);
+    return copy;
+  }
+
+  iterator& operator--() noexcept
+  {
+    if (this->depth == this->context_depth()) {
+      // cycle to the root
+      this->depth = 0;
+      --(this->ovf);
+    }
+    else ++(this->depth);
+    this->current = this->chain->nodes[this->depth];
+    return *this;
+  }
+
+  iterator operator--(int) noexcept
+  {
+    iterator copy(*this);
+    --(*this);
+    return copy;
+  }
+
+  explicit iterator(const node<NodePtr>& context_node) 
+    noexcept
+    : iterator_base<NodePtr>(
+        context_node, 
+        context_node, 
+        0,
+        child_path_t::uninitialized()
+      )
+  {
+    this->load_chain();
+    this->depth = this->context_depth();
+  }
+
+  iterator(const node<NodePtr>& context_node, end_t) 
+    noexcept
+    : iterator(context_node)
+  {
+    this->ovf = +1;
+  }
+};
+
+// an xpath following axis (all nodes after the context
+// node subtree in the document order)
+template<class NodePtr>
+class iterator<NodePtr, axis::following> 
+  : public iterator_base<NodePtr>
+{
+public:
+  iterator() noexcept {}
+
+  iterator& operator++() noexcept
+  {
+    if (this->current.is_same(this->context)) 
+      // empty following axis
+      ++(this->ovf);
+    else if (!this->preorder_next(
+               this->current, 
+               this->depth
+             )) 
+    {
+      // cycle to the first node
+      go_first();
+      ++(this->ovf);
+    }
+    return *this;
+  }
+
+  iterator operator++(int) noexcept
+  {
+    iterator copy(*this);
+    ++(*this);
+    return copy;
+  }
+
+  iterator& operator--() noexcept
+  {
+    if (this->current.is_same(this->context)) {
+      // empty following axis
+      --(this->ovf);
+      return *this;
+    }
+
+    // The previous node is in the context subtree only
+    // if it is the last node of the previous sibling
+    // subtree (the parent of a following node is not in
+    // the context subtree).
+    node<NodePtr> sibling = this->current;
+    if (sibling.go_prev_sibling() 
+        && this->ends_in_context(sibling, this->depth)) 
+    {
+      // cycle to the last node of the document
+      while (this->current.go_parent())
+        ;
+      this->depth = 0;
+      while (this->current.go_last_child())
+        ++(this->depth);
+      --(this->ovf);
+    }
+    else this->preorder_prev(this->current, this->depth);
+    return *this;
+  }
+
+  iterator operator--(int) noexcept
+  {
+    iterator copy(*this);
+    --(*this);
+    return copy;
+  }
+
+  explicit iterator(const node<NodePtr>& context_node) 
+    noexcept
+    : iterator_base<NodePtr>(
+        context_node, 
+        context_node,
+        0,
+        child_path_t::uninitialized()
+      )
+  {
+    this->load_live_chain();
+    go_first();
+  }
+
+  iterator(const node<NodePtr>& context_node, end_t) 
+    noexcept
+    : iterator(context_node)
+  {
+    // begin == end for an empty axis
+    if (!this->current.is_same(this->context))
+      this->ovf = +1;
+  }
+
+protected:
+  //! Moves to the first following node or the context
+  //! node for an empty axis
+  void go_first() noexcept
+  {
+    this->current = this->context;
+    this->depth = this->context_depth();
+    if (!this->preorder_skip(this->current, this->depth))
+    {
+      this->current = this->context;
+      this->depth = this->context_depth();
+    }
+  }
+};
+
+// an xpath preceding axis (all nodes before the context
+// node in the document order except its ancestors). NB
+// It is reversed axis.
+template<class NodePtr>
+class iterator<NodePtr, axis::preceding> 
+  : public iterator_base<NodePtr>
+{
+public:
+  iterator() noexcept {}
+
+  iterator& operator++() noexcept
+  {
+    if (this->current.is_same(this->context)) 
+      // empty preceding axis
+      ++(this->ovf);
+    else if (!step_back(this->current, this->depth)) {
+      // cycle to the context - 1
+      this->current = this->context;
+      this->depth = this->context_depth();
+      step_back(this->current, this->depth);
+      ++(this->ovf);
+    }
+    return *this;
+  }
+
+  iterator operator++(int) noexcept
+  {
+    iterator copy(*this);
+    ++(*this);
+    return copy;
+  }
+
+  iterator& operator--() noexcept
+  {
+    if (this->current.is_same(this->context)) {
+      // empty preceding axis
+      --(this->ovf);
+      return *this;
+    }
+
+    node<NodePtr> next = this->current;
+    int d = this->depth;
+    do {
+      if (!this->preorder_next(next, d) 
+          || next.is_same(this->context)) 
+      {
+        // cycle to the first node of the document
+        while (this->current.go_parent())
+          ;
+        this->depth = 0;
+        do 
+          this->preorder_next(this->current, this->depth);
+        while (this->is_context_ancestor(
+                 this->current, 
+                 this->depth
+               ));
+        --(this->ovf);
+        return *this;
+      }
+    } while (this->is_context_ancestor(next, d));
+
+    this->current = next;
+    this->depth = d;
+    return *this;
+  }
+
+  iterator operator--(int) noexcept
+  {
+    iterator copy(*this);
+    --(*this);
+    return copy;
+  }
+
+  explicit iterator(const node<NodePtr>& context_node) 
+    noexcept
+    : iterator_base<NodePtr>(
+        context_node, 
+        context_node,
+        0,
+        child_path_t::uninitialized()
+      )
+  {
+    this->load_live_chain();
+    this->depth = this->context_depth();
+    if (!step_back(this->current, this->depth)) {
+      this->current = this->context; // empty
+      this->depth = this->context_depth();
+    }
+  }
+
+  iterator(const node<NodePtr>& context_node, end_t) 
+    noexcept
+    : iterator(context_node)
+  {
+    // begin == end for an empty axis
+    if (!this->current.is_same(this->context))
+      this->ovf = +1;
+  }
+
+protected:
+  //! Moves to the previous node in the document order
+  //! which is not the context ancestor and updates its
+  //! depth d. Returns false if there are no such nodes.
+  bool step_back(node<NodePtr>& n, int& d) const noexcept
+  {
+    for (;;) {
+      if (n.go_prev_sibling()) {
+        while (n.go_last_child())
+          ++d;
+        return true;
+      }
+      if (!n.go_parent())
+        return false;
+      --d;
+      if (!this->is_context_ancestor(n, d))
+        return true;
+    }
+  }
+};
+
+// an xpath attribute axis
+template<class NodePtr>
+class iterator<NodePtr, axis::attribute> 
+  : public iterator_base<NodePtr>
+{
+public:
+  iterator() noexcept {}
+
+  iterator& operator++() noexcept
+  {
+    const int n = this->current.n_attrs();
+    int& idx = this->current.attr_idx;
+    if (++idx >= n)
+    {
+      idx = 0;
+      ++(this->ovf);
+    }
+    return *this;
+  }
+
+  iterator operator++(int) noexcept
+  {
+    iterator copy(*this);
+    ++(*this);
+    return copy;
+  }
+
+  iterator& operator--() noexcept
+  {
+    const int n = this->current.n_attrs();
+    const int m = (n == 0) ? 0 : n - 1;
+    int& idx = this->current.attr_idx;
+    if (--idx < 0)
+    {
+      idx = m;
+      --(this->ovf);
+    }
+    return *this;
+  }
+
+  iterator operator--(int) noexcept
+  {
+    iterator copy(*this);
+    --(*this);
+    return copy;
+  }
+
+  explicit iterator(const node<NodePtr>& context_node) 
+    noexcept
+    : iterator_base<NodePtr>(
+        context_node, 
+        0, 
+        0,
         child_path_t::uninitialized()
         )
   {}
@@ -1364,102 +3110,357 @@ public:
     return *this;
   }
 
-  random_access_adapter operator++(int)
+  random_access_adapter operator++(int)
+  {
+    random_access_adapter copy(*this);
+    ++(*this);
+    return copy;
+  }
+
+  random_access_adapter& operator--()
+  {
+    Iterator::operator--();
+    return *this;
+  }
+
+  random_access_adapter operator--(int)
+  {
+    random_access_adapter copy(*this);
+    --(*this);
+    return copy;
+  }
+
+  random_access_adapter& operator+=(difference_type n)
+  {
+    std::advance((Iterator&)*this, n);
+    return *this;
+  }
+
+  random_access_adapter& operator-=(difference_type n)
+  {
+    return operator+=(-n);
+  }
+
+  random_access_adapter operator+(difference_type n) const
+  {
+    random_access_adapter copy(*this);
+    return copy += n;
+  }
+
+  random_access_adapter operator-(difference_type n) const
+  {
+    random_access_adapter copy(*this);
+    return copy -= n;
+  }
+};
+
+template<class It>
+typename random_access_adapter<It>::value_type
+operator+(
+  typename random_access_adapter<It>::difference_type n,
+  typename random_access_adapter<It>::value_type it
+)
+{
+  return it + n;
+}
+
+template<class It>
+typename random_access_adapter<It>::difference_type
+operator-(
+  const random_access_adapter<It>& a,
+  const random_access_adapter<It>& b
+)
+{
+//  SCHECK(!a.is_empty());
+//  SCHECK(!b.is_empty());
+  SCHECK(a.is_same_context(b));
+
+  typename It::difference_type cnt = 0;
+  random_access_adapter<It> x = a;
+  const auto old_ovf = x.get_ovf();
+  while (!x.ovf_equal(b)) {
+    if (x.get_ovf() - old_ovf > 1) {
+      // if context and iterator type is the same they
+      // must be ovf_equal after finite number of steps
+      THROW_PROGRAM_ERROR;
+    }
+    assert(x.get_ovf() >= old_ovf);
+    ++x;
+    ++cnt;
+  }
+  //LOG_TRACE(log, "cnt = " << cnt);
+  const auto ovf = x.get_ovf() - old_ovf;
+  //LOG_TRACE(log, "ovf = " << ovf);
+  if (x.get_ovf() == b.get_ovf()) 
+    return - cnt;
+  else {
+    // calculate a full cycle
+    typename It::difference_type cnt2 = 0;
+
+    do {
+      ++x;
+      ++cnt2;
+    } while (!x.ovf_equal(a));
+
+    const auto cycle = cnt + cnt2;
+    return - (cnt + cycle * (b.get_ovf() - a.get_ovf() - ovf));
+  }
+}
+
+//! Counts increments from a to b in a single forward
+//! pass. Unlike operator- it never walks an extra cycle
+//! to measure the cycle length, thus b must be reachable
+//! from a (like end() from begin()).
+template<class It>
+typename It::difference_type forward_distance(
+  It a, 
+  const It& b
+)
+{
+  const auto max_ovf = b.get_ovf();
+  typename It::difference_type cnt = 0;
+  for (; a != b; ++a) {
+    if (a.get_ovf() > max_ovf)
+      // b is behind a
+      THROW_PROGRAM_ERROR;
+    ++cnt;
+  }
+  return cnt;
+}
+
+//! The forward-only axis iterator for single-pass scans
+//! (see step::query results for_each()). It is not
+//! cycled: there is no ovf, it never wraps around and
+//! it does not compare nodes with the context (the
+//! depth under the context is counted instead). After
+//! the last node it is equal to the default constructed
+//! (end) iterator. Paths are the same as the cycled
+//! iterator of the axis has.
+template<class NodePtr, class axis>
+class forward_iterator;
+
+//! forward_iterator<NodePtr, axis> is defined
+template<class axis>
+struct has_forward_iterator : std::false_type {};
+
+template<class NodePtr>
+class forward_iterator_base
+{
+public:
+  using node_ptr_type = NodePtr;
+
+  using difference_type = xpath::node_difference_type;
+  using size_type = size_t;
+  using value_type = xpath::node<NodePtr>;
+  using pointer = const xpath::node<NodePtr>*;
+  using reference = const xpath::node<NodePtr>&;
+  using iterator_category = std::forward_iterator_tag;
+
+  //! A comparison with the end iterator does not
+  //! touch nodes
+  bool operator==(const forward_iterator_base& o) const
+  {
+    if (at_end || o.at_end)
+      return at_end == o.at_end;
+    return current.is_same(o.current);
+  }
+
+  bool operator!=(const forward_iterator_base& o) const
+  {
+    return !operator==(o);
+  }
+
+  reference operator*() const
+  {
+    assert(!at_end);
+    return current;
+  }
+
+  pointer operator->() const
+  {
+    assert(!at_end);
+    return &current;
+  }
+
+  const child_path_t& path() const
+  {
+    return child_path;
+  }
+
+protected:
+  forward_iterator_base() {}
+
+  forward_iterator_base(
+    const node<NodePtr>& start,
+    const child_path_t& path
+  )
+    : current(start), 
+      child_path(path),
+      at_end(false)
+  {}
+
+  //! The pre-order step inside the context subtree
+  void preorder_next()
+  {
+    if (current.go_first_child()) {
+      child_path.push_back(0);
+      ++depth;
+      return;
+    }
+    while (depth > 0) {
+      if (current.go_next_sibling()) {
+        ++(child_path.back());
+        return;
+      }
+      current.go_parent();
+      child_path.pop_back();
+      --depth;
+    }
+    at_end = true;
+  }
+
+  node<NodePtr> current;
+  child_path_t child_path;
+
+  //! The current depth under the context
+  size_t depth = 0;
+
+  bool at_end = true;
+};
+
+template<class NodePtr>
+class forward_iterator<NodePtr, axis::self>
+  : public forward_iterator_base<NodePtr>
+{
+public:
+  forward_iterator() {}
+
+  explicit forward_iterator(const node<NodePtr>& context)
+    : forward_iterator_base<NodePtr>(
+        context, 
+        child_path_t::uninitialized()
+      )
+  {}
+
+  forward_iterator& operator++()
+  {
+    this->at_end = true;
+    return *this;
+  }
+};
+
+template<>
+struct has_forward_iterator<axis::self> 
+  : std::true_type {};
+
+template<class NodePtr>
+class forward_iterator<NodePtr, axis::child>
+  : public forward_iterator_base<NodePtr>
+{
+public:
+  forward_iterator() {}
+
+  explicit forward_iterator(const node<NodePtr>& context)
+    : forward_iterator_base<NodePtr>(
+        context, 
+        node_difference_type(0)
+      )
   {
-    random_access_adapter copy(*this);
-    ++(*this);
-    return copy;
+    this->at_end = !this->current.go_first_child();
   }
 
-  random_access_adapter& operator--()
+  forward_iterator& operator++()
   {
-    Iterator::operator--();
+    if (this->current.go_next_sibling())
+      ++(this->child_path.back());
+    else 
+      this->at_end = true;
     return *this;
   }
+};
 
-  random_access_adapter operator--(int)
+template<>
+struct has_forward_iterator<axis::child> 
+  : std::true_type {};
+
+template<class NodePtr>
+class forward_iterator<NodePtr, axis::following_sibling>
+  : public forward_iterator_base<NodePtr>
+{
+public:
+  forward_iterator() {}
+
+  explicit forward_iterator(const node<NodePtr>& context)
+    : forward_iterator_base<NodePtr>(
+        context, 
+        child_path_t::uninitialized()
+      )
   {
-    random_access_adapter copy(*this);
-    --(*this);
-    return copy;
+    this->at_end = !this->current.go_next_sibling();
   }
 
-  random_access_adapter& operator+=(difference_type n)
+  forward_iterator& operator++()
   {
-    std::advance((Iterator&)*this, n);
+    this->at_end = !this->current.go_next_sibling();
     return *this;
   }
+};
 
-  random_access_adapter& operator-=(difference_type n)
-  {
-    return operator+=(-n);
-  }
+template<>
+struct has_forward_iterator<axis::following_sibling> 
+  : std::true_type {};
 
-  random_access_adapter operator+(difference_type n) const
+template<class NodePtr>
+class forward_iterator<NodePtr, axis::descendant>
+  : public forward_iterator_base<NodePtr>
+{
+public:
+  forward_iterator() {}
+
+  explicit forward_iterator(const node<NodePtr>& context)
+    : forward_iterator_base<NodePtr>(
+        context, 
+        child_path_t::uninitialized()
+      )
   {
-    random_access_adapter copy(*this);
-    return copy += n;
+    this->preorder_next();
   }
 
-  random_access_adapter operator-(difference_type n) const
+  forward_iterator& operator++()
   {
-    random_access_adapter copy(*this);
-    return copy -= n;
+    this->preorder_next();
+    return *this;
   }
 };
 
-template<class It>
-typename random_access_adapter<It>::value_type
-operator+(
-  typename random_access_adapter<It>::difference_type n,
-  typename random_access_adapter<It>::value_type it
-)
-{
-  return it + n;
-}
+template<>
+struct has_forward_iterator<axis::descendant> 
+  : std::true_type {};
 
-template<class It>
-typename random_access_adapter<It>::difference_type
-operator-(
-  const random_access_adapter<It>& a,
-  const random_access_adapter<It>& b
-)
+template<class NodePtr>
+class forward_iterator<NodePtr, axis::descendant_or_self>
+  : public forward_iterator_base<NodePtr>
 {
-//  SCHECK(!a.is_empty());
-//  SCHECK(!b.is_empty());
-  SCHECK(a.is_same_context(b));
-
-  typename It::difference_type cnt = 0;
-  random_access_adapter<It> x = a;
-  const auto old_ovf = x.get_ovf();
-  while (!x.ovf_equal(b)) {
-    if (x.get_ovf() - old_ovf > 1) {
-      // if context and iterator type is the same they
-      // must be ovf_equal after finite number of steps
-      THROW_PROGRAM_ERROR;
-    }
-    assert(x.get_ovf() >= old_ovf);
-    ++x;
-    ++cnt;
-  }
-  //LOG_TRACE(log, "cnt = " << cnt);
-  const auto ovf = x.get_ovf() - old_ovf;
-  //LOG_TRACE(log, "ovf = " << ovf);
-  if (x.get_ovf() == b.get_ovf()) 
-    return - cnt;
-  else {
-    // calculate a full cycle
-    typename It::difference_type cnt2 = 0;
+public:
+  forward_iterator() {}
 
-    do {
-      ++x;
-      ++cnt2;
-    } while (!x.ovf_equal(a));
+  explicit forward_iterator(const node<NodePtr>& context)
+    : forward_iterator_base<NodePtr>(
+        context, 
+        child_path_t::uninitialized()
+      )
+  {}
 
-    const auto cycle = cnt + cnt2;
-    return - (cnt + cycle * (b.get_ovf() - a.get_ovf() - ovf));
+  forward_iterator& operator++()
+  {
+    this->preorder_next();
+    return *this;
   }
-}
+};
+
+template<>
+struct has_forward_iterator<axis::descendant_or_self> 
+  : std::true_type {};
 
 }
 
@@ -1543,7 +3544,7 @@ public:
       --current.get_ovf();
   }
 
-  child_path_t path() const
+  const child_path_t& path() const
   {
     return current.path();
   }
@@ -1555,6 +3556,34 @@ public:
 
   // forward calls to current
 
+  //! Seeks the next node with the tag atom matched with
+  //! the test (if It can seek_tag)
+  template<class I = It>
+  auto seek_tag(atom_t atom) 
+    -> decltype(std::declval<I&>().seek_tag(atom))
+  {
+    return seek_matched(
+      [atom](I& it) { return it.seek_tag(atom); }
+    );
+  }
+
+  //! Seeks the next node with the attribute value
+  //! matched with the test (if It can seek_attr)
+  template<class I = It>
+  auto seek_attr(
+    const std::string& name, 
+    const std::string& value
+  ) 
+    -> decltype(std::declval<I&>().seek_attr(name, value))
+  {
+    return seek_matched(
+      [&name, &value](I& it) 
+      { 
+        return it.seek_attr(name, value); 
+      }
+    );
+  }
+
   bool is_empty() const {
     return empty_interval; // NB
   }
@@ -1696,6 +3725,18 @@ protected:
     if (current.is_empty())
       return false;
 
+    if (test(current))
+      return true;
+
+    switch (try_seek(test, 0)) {
+      case node_iterators::seek_result::found:
+        return true;
+      case node_iterators::seek_result::not_found:
+        return false;
+      case node_iterators::seek_result::no_seek:
+        break;
+    }
+
     const auto max_ovf = current.get_ovf() + 1;
     while(!test(current)) {
       ++current;
@@ -1708,6 +3749,41 @@ protected:
     return true;
   }
 
+  //! Calls test.seek(current) if the test can seek
+  template<class T>
+  auto try_seek(const T& t, int) 
+    -> decltype(t.seek(std::declval<It&>()))
+  {
+    return t.seek(current);
+  }
+
+  template<class T>
+  node_iterators::seek_result try_seek(const T&, long)
+  {
+    return node_iterators::seek_result::no_seek;
+  }
+
+  //! Seeks the base iterator by seek_fn while the node
+  //! is not matched with the test
+  template<class Seek>
+  node_iterators::seek_result seek_matched(Seek seek_fn)
+  {
+    using node_iterators::seek_result;
+
+    const auto max_ovf = current.get_ovf() + 1;
+    do {
+      const seek_result r = seek_fn(current);
+      if (r != seek_result::found)
+        return r;
+
+      if (current.get_ovf() > max_ovf) {
+        --(current.get_ovf());
+        return seek_result::not_found;
+      }
+    } while (!test(current));
+    return seek_result::found;
+  }
+
   //! if current is not matched with test backward to the
   //! last matched.
   void skip_unmatched_backward()
@@ -1724,34 +3800,244 @@ protected:
     }
   }
 
-  //! Unconditionally forwards to the
-  //! next iterator position matched with test. 
-  //! NB do not check current.ovf, the
-  //! result needs to be comparend with axis_t::xend().
-  void next_matched()
+  //! Unconditionally forwards to the
+  //! next iterator position matched with test. 
+  //! NB do not check current.ovf, the
+  //! result needs to be comparend with axis_t::xend().
+  void next_matched()
+  {
+    //assert(!empty_interval);
+    ++current;
+    skip_unmatched();
+  }
+
+  //! Unconditionally backwards to the
+  //! previous iterator position matched with test. 
+  //! NB do not check current.ovf, the
+  //! result needs to be comparend with axis_t::xend().
+  void prev_matched()
+  {
+    assert(!empty_interval);
+    --current;
+    skip_unmatched_backward();
+  }
+
+  It current;
+
+  test_t test;
+
+  //! begin = end, the current value is inaccessible
+  bool empty_interval;
+};
+
+//! A materialized node-set. It is a query result
+//! stored in a contiguous vector in the document order.
+//! Unlike query iterators it has O(1) indexing, size()
+//! and reverse iteration.
+template<class NodePtr>
+class node_set
+{
+public:
+  //! A matched node with its child path
+  struct entry
+  {
+    xpath::node<NodePtr> node;
+    child_path_t path;
+  };
+
+  using entries_t = std::vector<entry>;
+
+  class iterator
+  {
+  public:
+    using difference_type = xpath::node_difference_type;
+    using size_type = size_t;
+    using value_type = xpath::node<NodePtr>;
+    using pointer = const xpath::node<NodePtr>*;
+    using const_pointer = const xpath::node<NodePtr>*;
+    using reference = const xpath::node<NodePtr>&;
+    using const_reference = const xpath::node<NodePtr>&;
+    using iterator_category = 
+      std::random_access_iterator_tag;
+
+    iterator() {}
+
+    explicit iterator(
+      typename entries_t::const_iterator it
+    ) 
+      : current(it) 
+    {}
+
+    reference operator*() const
+    {
+      return current->node;
+    }
+
+    pointer operator->() const
+    {
+      return &current->node;
+    }
+
+    reference operator[](difference_type n) const
+    {
+      return current[n].node;
+    }
+
+    const child_path_t& path() const
+    {
+      return current->path;
+    }
+
+    iterator& operator++()
+    {
+      ++current;
+      return *this;
+    }
+
+    iterator operator++(int)
+    {
+      return iterator(current++);
+    }
+
+    iterator& operator--()
+    {
+      --current;
+      return *this;
+    }
+
+    iterator operator--(int)
+    {
+      return iterator(current--);
+    }
+
+    iterator& operator+=(difference_type n)
+    {
+      current += n;
+      return *this;
+    }
+
+    iterator& operator-=(difference_type n)
+    {
+      current -= n;
+      return *this;
+    }
+
+    iterator operator+(difference_type n) const
+    {
+      return iterator(current + n);
+    }
+
+    iterator operator-(difference_type n) const
+    {
+      return iterator(current - n);
+    }
+
+    difference_type operator-(const iterator& o) const
+    {
+      return current - o.current;
+    }
+
+    bool operator==(const iterator& o) const
+    {
+      return current == o.current;
+    }
+
+    bool operator!=(const iterator& o) const
+    {
+      return current != o.current;
+    }
+
+    bool operator<(const iterator& o) const
+    {
+      return current < o.current;
+    }
+
+    bool operator>(const iterator& o) const
+    {
+      return current > o.current;
+    }
+
+    bool operator<=(const iterator& o) const
+    {
+      return current <= o.current;
+    }
+
+    bool operator>=(const iterator& o) const
+    {
+      return current >= o.current;
+    }
+
+  protected:
+    typename entries_t::const_iterator current;
+  };
+
+  using const_iterator = iterator;
+  using reverse_iterator = std::reverse_iterator<iterator>;
+  using size_type = size_t;
+
+  node_set() {}
+
+  //! Collects [from, to) of a query result
+  template<class It>
+  node_set(It from, const It& to)
+  {
+    if (from.is_empty())
+      return;
+
+    for (; from != to; ++from)
+      entries.push_back(entry{*from, from.path()});
+  }
+
+  void push_back(
+    const xpath::node<NodePtr>& nd, 
+    const child_path_t& path
+  )
+  {
+    entries.push_back(entry{nd, path});
+  }
+
+  size_type size() const
+  {
+    return entries.size();
+  }
+
+  bool empty() const
+  {
+    return entries.empty();
+  }
+
+  iterator begin() const
+  {
+    return iterator(entries.begin());
+  }
+
+  iterator end() const
+  {
+    return iterator(entries.end());
+  }
+
+  reverse_iterator rbegin() const
   {
-    //assert(!empty_interval);
-    ++current;
-    skip_unmatched();
+    return reverse_iterator(end());
   }
 
-  //! Unconditionally backwards to the
-  //! previous iterator position matched with test. 
-  //! NB do not check current.ovf, the
-  //! result needs to be comparend with axis_t::xend().
-  void prev_matched()
+  reverse_iterator rend() const
   {
-    assert(!empty_interval);
-    --current;
-    skip_unmatched_backward();
+    return reverse_iterator(begin());
   }
 
-  It current;
+  const xpath::node<NodePtr>& operator[](size_type k) const
+  {
+    return entries[k].node;
+  }
 
-  test_t test;
+  const entry& at(size_type k) const
+  {
+    return entries.at(k);
+  }
 
-  //! begin = end, the current value is inaccessible
-  bool empty_interval;
+protected:
+  entries_t entries;
 };
 
 //! [4] Step
@@ -1775,6 +4061,76 @@ using step1_iterator_t = pred_iterator_t<
   Test
 >;
 
+//! Test can be checked over a node, not an iterator
+//! (see test::name::match)
+template<class Test, class NodePtr>
+struct can_match
+{
+  template<class T>
+  static auto check(int) -> decltype(
+    std::declval<const T&>().match(
+      std::declval<const node<NodePtr>&>()
+    ),
+    std::true_type()
+  );
+
+  template<class T>
+  static std::false_type check(long);
+
+  static constexpr bool value = 
+    decltype(check<Test>(0))::value;
+};
+
+//! Test can seek the iterator It by an index (see
+//! test::name::seek)
+template<class Test, class It>
+struct can_seek
+{
+  template<class T>
+  static auto check(int) -> decltype(
+    std::declval<const T&>().seek(std::declval<It&>()),
+    std::true_type()
+  );
+
+  template<class T>
+  static std::false_type check(long);
+
+  static constexpr bool value = 
+    decltype(check<Test>(0))::value;
+};
+
+//! A single-pass scan of the query with Test over It
+//! can skip xpath::iterator: the test matches nodes and
+//! does not seek (seeking by an index is faster than a
+//! scan)
+template<class Test, class It>
+struct forward_scan : std::integral_constant<
+  bool,
+  can_match<Test, typename It::node_ptr_type>::value
+    && !can_seek<Test, It>::value
+> 
+{};
+
+//! Calls fun(node, child_path) over [begin(), end()) of
+//! a query result while fun returns true. Returns the
+//! number of calls.
+template<class Result, class Fun>
+size_t cycled_for_each(Result& r, Fun& fun)
+{
+  auto it = r.begin();
+  const auto nd = r.end();
+  if (it.is_empty())
+    return 0;
+
+  size_t n = 0;
+  for (; it != nd; ++it) {
+    ++n;
+    if (!fun(*it, it.path()))
+      break;
+  }
+  return n;
+}
+
 template<
   class NodePtr, 
   class axis, 
@@ -1873,7 +4229,8 @@ struct iterator
   {}
 };
 
-//! Returns the number of nodes
+//! Returns the number of nodes. It is one traversal
+//! of the query result.
 //! If pointer args are not null returns begin() and end()
 //! values also.
 template<class Query>
@@ -1887,14 +4244,12 @@ typename Query::iterator::size_type size(
     const auto nd = qr.end();
 
     if (bg_) *bg_ = bg;
-    if (nd_) *nd_ = bg;
+    if (nd_) *nd_ = nd;
 
     if (bg.is_empty())
       return 0;
 
-    const auto dist = nd - bg;
-    SCHECK(dist >= 0);
-    return dist;
+    return node_iterators::forward_distance(bg, nd);
 }
 
 //! An xpath query. 
@@ -1912,6 +4267,8 @@ template<class NodePtr, class Expr, class axis>
 class query<NodePtr, Expr, axis, true>
 {
 public:
+  using node_ptr_type = NodePtr;
+  using axis_type = axis;
   using iterator = step::iterator<NodePtr, axis, Expr>;
 
   struct result
@@ -1942,16 +4299,89 @@ public:
       );
     }
 
+    //! The number of nodes. Without bg and nd it is a
+    //! for_each() pass.
     typename iterator::size_type size(
       iterator* bg = nullptr,
       iterator* nd = nullptr
     )
     {
-      return step::size<query_type>(*this, bg, nd);
+      if (bg || nd)
+        return step::size<query_type>(*this, bg, nd);
+
+      return for_each(
+        [](const node<NodePtr>&, const child_path_t&)
+        {
+          return true;
+        }
+      );
+    }
+
+    //! Stores all matched nodes (one traversal)
+    node_set<NodePtr> materialize()
+    {
+      node_set<NodePtr> res;
+      for_each(
+        [&res](
+          const node<NodePtr>& nd, 
+          const child_path_t& path
+        )
+        {
+          res.push_back(nd, path);
+          return true;
+        }
+      );
+      return res;
+    }
+
+    //! Calls fun(node, child_path) for each match in the
+    //! axis order while it returns true. Returns the
+    //! number of calls. It runs over
+    //! node_iterators::forward_iterator when the axis has
+    //! one and the test allows (see forward_scan).
+    template<class Fun>
+    size_t for_each(Fun&& fun)
+    {
+      return for_each(
+        fun, 
+        std::integral_constant<
+          bool,
+          node_iterators::has_forward_iterator<axis>::value
+          && forward_scan<
+               Expr, 
+               prim_iterator_t<NodePtr, axis>
+             >::value
+        >()
+      );
     }
 
     node<NodePtr> context;
     Expr test;
+
+  protected:
+    template<class Fun>
+    size_t for_each(Fun& fun, std::false_type)
+    {
+      return cycled_for_each(*this, fun);
+    }
+
+    template<class Fun>
+    size_t for_each(Fun& fun, std::true_type)
+    {
+      SCHECK(context.is_valid());
+      using forward_iterator = 
+        node_iterators::forward_iterator<NodePtr, axis>;
+
+      size_t n = 0;
+      const forward_iterator end;
+      for (forward_iterator it(context); it != end; ++it)
+        if (test.match(*it)) {
+          ++n;
+          if (!fun(*it, it.path()))
+            break;
+        }
+      return n;
+    }
   };
 
   query(Expr&& tst) 
@@ -1963,6 +4393,11 @@ public:
     return result(ctx, test);
   }
 
+  const Expr& expr() const
+  {
+    return test;
+  }
+
 protected:
   const Expr test;
 };
@@ -2022,11 +4457,81 @@ public:
       iterator* nd = nullptr
     )
     {
-      return step::size<query_type>(*this, bg, nd);
+      if (bg || nd)
+        return step::size<query_type>(*this, bg, nd);
+
+      return for_each(
+        [](const node<NodePtr>&, const child_path_t&)
+        {
+          return true;
+        }
+      );
+    }
+
+    //! Stores all matched nodes (one traversal)
+    node_set<NodePtr> materialize()
+    {
+      node_set<NodePtr> res;
+      for_each(
+        [&res](
+          const node<NodePtr>& nd, 
+          const child_path_t& path
+        )
+        {
+          res.push_back(nd, path);
+          return true;
+        }
+      );
+      return res;
+    }
+
+    //! Calls fun(node, child_path) for each match while
+    //! it returns true. Returns the number of calls. It
+    //! filters the nested for_each() when the test
+    //! allows (see forward_scan).
+    template<class Fun>
+    size_t for_each(Fun&& fun)
+    {
+      return for_each(
+        fun, 
+        std::integral_constant<
+          bool,
+          forward_scan<
+            Expr, 
+            typename NestedQuery::iterator
+          >::value
+        >()
+      );
     }
 
 //    node<NodePtr> context;
     Expr test;
+
+  protected:
+    template<class Fun>
+    size_t for_each(Fun& fun, std::false_type)
+    {
+      return cycled_for_each(*this, fun);
+    }
+
+    template<class Fun>
+    size_t for_each(Fun& fun, std::true_type)
+    {
+      size_t n = 0;
+      nested_result::for_each(
+        [this, &n, &fun](
+          const node<NodePtr>& nd, 
+          const child_path_t& path
+        )
+        {
+          if (!test.match(nd))
+            return true;
+          ++n;
+          return (bool) fun(nd, path);
+        }
+      );
+      return n;
+    }
   };
 
   query(Expr&& e, NestedQuery&& nq) 
@@ -2043,6 +4548,365 @@ protected:
   const Expr test;
 };
 
+//! A query with a positional predicate. Its result is a
+//! range of the nested query result. The range is found
+//! once: [n] and position() < n stop the nested
+//! iterator after n matches, [last()] steps back from
+//! the nested end() (node objects are not created).
+template<class NodePtr, class It, class NestedQuery>
+class query<
+  NodePtr, 
+  xpath::test::position<It>, 
+  NestedQuery, 
+  false
+> : public NestedQuery
+{
+public:
+  using expr_type = xpath::test::position<It>;
+  using iterator = typename NestedQuery::iterator;
+  using nested_query = NestedQuery;
+  using nested_result = typename NestedQuery::result;
+
+  struct result : nested_result
+  {
+    using query_type = 
+      query<NodePtr, expr_type, NestedQuery, false>;
+
+    result() {}
+
+    result(
+      const expr_type& tst,
+      nested_result&& nested
+    ) 
+      : nested_result(std::move(nested)),
+        test(tst)
+    {}
+
+    iterator begin()
+    {
+      find_range();
+      return bg;
+    }
+
+    iterator end()
+    {
+      find_range();
+      return nd;
+    }
+
+    typename iterator::size_type size(
+      iterator* bg_ = nullptr,
+      iterator* nd_ = nullptr
+    )
+    {
+      return step::size<query_type>(*this, bg_, nd_);
+    }
+
+    //! A pass over the range
+    template<class Fun>
+    size_t for_each(Fun&& fun)
+    {
+      return cycled_for_each(*this, fun);
+    }
+
+    //! Stores all matched nodes (one traversal)
+    node_set<NodePtr> materialize()
+    {
+      return node_set<NodePtr>(begin(), end());
+    }
+
+    expr_type test;
+
+  protected:
+    //! Sets [bg, nd). An empty range is bg == nd.
+    void find_range()
+    {
+      using kind = typename expr_type::kind;
+
+      if (range_found)
+        return;
+      range_found = true;
+
+      bg = nested_result::begin();
+      nd = nested_result::end();
+      if (bg.is_empty())
+        return;
+
+      switch (test.what()) {
+        case kind::nth:
+          if (test.n() == 0) {
+            bg = nd;
+            return;
+          }
+          for (size_t k = 1; k < test.n(); k++) 
+            if (++bg == nd)
+              return;
+          nd = bg;
+          ++nd;
+          return;
+        case kind::last:
+          bg = nd;
+          --bg;
+          return;
+        case kind::less_than:
+        {
+          iterator to = bg;
+          for (size_t k = 1; 
+               k < test.n() && to != nd; 
+               k++
+               )
+            ++to;
+          nd = (test.n() > 0) ? to : bg;
+          return;
+        }
+      }
+    }
+
+    iterator bg, nd;
+    bool range_found = false;
+  };
+
+  query(expr_type&& e, NestedQuery&& nq) 
+    : NestedQuery(std::forward<NestedQuery>(nq)),
+      test(std::move(e))
+  {}
+
+  result execute(const node<NodePtr>& ctx) const
+  {
+    return result(test, NestedQuery::execute(ctx));
+  }
+
+protected:
+  const expr_type test;
+};
+
+//! How child paths of an axis iterator are ordered:
+//! 1 - from the context (the uninitialized index first)
+//! in the document order, 2 - by the child index only,
+//! 0 - not ordered (see union_query)
+template<class axis>
+struct path_order : std::integral_constant<int, 0> {};
+
+template<>
+struct path_order<axis::self> 
+  : std::integral_constant<int, 1> {};
+
+template<>
+struct path_order<axis::descendant> 
+  : std::integral_constant<int, 1> {};
+
+template<>
+struct path_order<axis::descendant_or_self> 
+  : std::integral_constant<int, 1> {};
+
+template<>
+struct path_order<axis::child> 
+  : std::integral_constant<int, 2> {};
+
+//! [18] (xpath) UnionExpr. Lazily merges results of
+//! two queries over the same context in the document
+//! order by their child paths, a node selected by both
+//! is returned once. Both queries run their own
+//! traversal, see make_union() for the single traversal
+//! case.
+template<class Query1, class Query2>
+class union_query
+{
+public:
+  using node_ptr_type = typename Query1::node_ptr_type;
+  //! paths of both queries have the same path_order
+  using axis_type = typename Query1::axis_type;
+  using first_iterator = typename Query1::iterator;
+  using second_iterator = typename Query2::iterator;
+
+  static_assert(
+    std::is_same<
+      node_ptr_type, 
+      typename Query2::node_ptr_type
+    >::value,
+    "union_query: different node types"
+  );
+
+  static_assert(
+    path_order<typename Query1::axis_type>::value != 0
+    && path_order<typename Query1::axis_type>::value
+       == path_order<typename Query2::axis_type>::value,
+    "union_query: child paths of the queries "
+    "can't be compared in the document order"
+  );
+
+  //! The merge iterator. The default one is end().
+  class iterator
+  {
+  public:
+    using node_ptr_type = typename Query1::node_ptr_type;
+    using value_type = xpath::node<node_ptr_type>;
+    using difference_type = node_difference_type;
+    using size_type = size_t;
+    using pointer = typename first_iterator::pointer;
+    using reference = typename first_iterator::reference;
+    using iterator_category = std::forward_iterator_tag;
+
+    iterator() {}
+
+    iterator(
+      first_iterator bg1, 
+      first_iterator end1,
+      second_iterator bg2, 
+      second_iterator end2
+    )
+      : it1(bg1), nd1(end1), it2(bg2), nd2(end2),
+        done1(bg1.is_empty() || bg1 == end1),
+        done2(bg2.is_empty() || bg2 == end2)
+    {
+      pick();
+    }
+
+    //! No more nodes
+    bool is_empty() const
+    {
+      return done1 && done2;
+    }
+
+    bool operator==(const iterator& o) const
+    {
+      return done1 == o.done1 && done2 == o.done2
+        && (done1 || it1 == o.it1)
+        && (done2 || it2 == o.it2);
+    }
+
+    bool operator!=(const iterator& o) const
+    {
+      return !operator==(o);
+    }
+
+    reference operator*()
+    {
+      SCHECK(!is_empty());
+      return on_first ? *it1 : *it2;
+    }
+
+    pointer operator->()
+    {
+      SCHECK(!is_empty());
+      return on_first 
+        ? it1.operator->() : it2.operator->();
+    }
+
+    const child_path_t& path() const
+    {
+      SCHECK(!is_empty());
+      return on_first ? it1.path() : it2.path();
+    }
+
+    iterator& operator++()
+    {
+      SCHECK(!is_empty());
+      if (on_first)
+        done1 = (++it1 == nd1);
+      if (on_second)
+        done2 = (++it2 == nd2);
+      pick();
+      return *this;
+    }
+
+  protected:
+    //! Selects the side(s) with the least path
+    void pick()
+    {
+      on_first = !done1;
+      on_second = !done2;
+      if (done1 || done2)
+        return;
+
+      const child_path_t& p1 = it1.path();
+      const child_path_t& p2 = it2.path();
+      if (p1 < p2)
+        on_second = false;
+      else if (p2 < p1)
+        on_first = false;
+      // equal paths - the same node on both sides
+    }
+
+    first_iterator it1, nd1;
+    second_iterator it2, nd2;
+    bool done1 = true, done2 = true;
+    bool on_first = false, on_second = false;
+  };
+
+  struct result
+  {
+    using query_type = union_query<Query1, Query2>;
+
+    result() {}
+
+    result(
+      typename Query1::result&& r1,
+      typename Query2::result&& r2
+    )
+      : first(std::move(r1)), second(std::move(r2))
+    {}
+
+    iterator begin()
+    {
+      return iterator(
+        first.begin(), first.end(),
+        second.begin(), second.end()
+      );
+    }
+
+    iterator end()
+    {
+      return iterator();
+    }
+
+    //! The number of nodes (one merge pass)
+    size_t size()
+    {
+      return for_each(
+        [](
+          const node<node_ptr_type>&, 
+          const child_path_t&
+        )
+        {
+          return true;
+        }
+      );
+    }
+
+    //! Stores all matched nodes (one merge pass)
+    node_set<node_ptr_type> materialize()
+    {
+      return node_set<node_ptr_type>(begin(), end());
+    }
+
+    template<class Fun>
+    size_t for_each(Fun&& fun)
+    {
+      return cycled_for_each(*this, fun);
+    }
+
+    typename Query1::result first;
+    typename Query2::result second;
+  };
+
+  union_query(const Query1& q1, const Query2& q2)
+    : first(q1), second(q2)
+  {}
+
+  result execute(const node<node_ptr_type>& ctx) const
+  {
+    return result(
+      first.execute(ctx), 
+      second.execute(ctx)
+    );
+  }
+
+protected:
+  Query1 first;
+  Query2 second;
+};
+
 template<
   class NodePtr,
   class axis,
@@ -2104,6 +4968,46 @@ build_query(
   );
 }
 
+//! q1 | q2 (see union_query)
+template<class Query1, class Query2>
+union_query<Query1, Query2> 
+make_union(const Query1& q1, const Query2& q2)
+{
+  return union_query<Query1, Query2>(q1, q2);
+}
+
+//! q1 | q2 for two steps over the same axis. It is one
+//! step with both tests, so one traversal.
+template<
+  class NodePtr, 
+  class Expr1, 
+  class Expr2, 
+  class axis
+>
+query<
+  NodePtr, 
+  xpath::test::either<Expr1, Expr2>, 
+  axis, 
+  true
+>
+make_union(
+  const query<NodePtr, Expr1, axis, true>& q1,
+  const query<NodePtr, Expr2, axis, true>& q2
+)
+{
+  return query<
+    NodePtr, 
+    xpath::test::either<Expr1, Expr2>, 
+    axis, 
+    true
+  >(
+    xpath::test::either<Expr1, Expr2>(
+      q1.expr(), 
+      q2.expr()
+    )
+  );
+}
+
 } // step
 
 // TODO refactor with step::query
@@ -2163,9 +5067,8 @@ public:
   //! the number of nodes in the axis
   typename iterator::size_type size() //const
   {
-    const auto dist = end() - begin();
-    SCHECK(dist >= 0);
-    return dist;
+    return node_iterators::forward_distance
+      (begin(), end());
   }
 
   //! Returns the number of only test matched nodes
@@ -2180,14 +5083,12 @@ public:
     const auto xnd = xend();
 
     if (xbg_) *xbg_ = xbg;
-    if (xnd_) *xnd_ = xbg;
+    if (xnd_) *xnd_ = xnd;
 
     if (xbg.is_empty())
       return 0;
 
-    const auto dist = xnd - xbg;
-    SCHECK(dist >= 0);
-    return dist;
+    return node_iterators::forward_distance(xbg, xnd);
   }
 
 protected:
@@ -2201,6 +5102,12 @@ XPATH_INTERNAL_AXIS_DECL(descendant);
 XPATH_INTERNAL_AXIS_DECL(attribute);
 XPATH_INTERNAL_AXIS_DECL(following_sibling);
 XPATH_INTERNAL_AXIS_DECL(preceding_sibling);
+XPATH_INTERNAL_AXIS_DECL(parent);
+XPATH_INTERNAL_AXIS_DECL(ancestor);
+XPATH_INTERNAL_AXIS_DECL(ancestor_or_self);
+XPATH_INTERNAL_AXIS_DECL(descendant_or_self);
+XPATH_INTERNAL_AXIS_DECL(following);
+XPATH_INTERNAL_AXIS_DECL(preceding);
 
 // Must be in the namespace for Koeing lookup
 template<class NodePtr>
@@ -2250,4 +5157,18 @@ operator<< (std::ostream& out, const node<NodePtr>& nd)
 
 }
 
+namespace std {
+
+//! Nodes with NodePtr::key() can be in hash containers
+template<class NodePtr>
+struct hash<xpath::node<NodePtr>>
+{
+  size_t operator()(const xpath::node<NodePtr>& n) const
+  {
+    return n.hash();
+  }
+};
+
+}
+
 #endif
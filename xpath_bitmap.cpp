@@ -0,0 +1,286 @@
+// -*-coding: mule-utf-8-unix; fill-column: 58; -*-
+/**
+ * @file
+ * Node-sets over a DOM snapshot as bitmaps.
+ *
+ * @author Sergei Lodyagin
+ */
+
+#include <algorithm>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "xpath_bitmap.h"
+
+namespace xpath {
+namespace snapshot {
+
+namespace {
+
+using word_t = node_bitmap::word_t;
+
+// The word loops take two words per SSE2 instruction
+// (SSE2 is in every x86-64 CPU). The build is -O0, so
+// the compiler does not vectorize them itself.
+
+#ifdef __SSE2__
+inline __m128i load2(const word_t* p)
+{
+  return _mm_loadu_si128(
+    reinterpret_cast<const __m128i*>(p)
+  );
+}
+
+inline void store2(word_t* p, __m128i v)
+{
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(p), v);
+}
+#endif
+
+void and_words(
+  word_t* __restrict dst,
+  const word_t* __restrict a,
+  const word_t* __restrict b,
+  size_t n
+)
+{
+  size_t k = 0;
+#ifdef __SSE2__
+  for (; k + 2 <= n; k += 2)
+    store2(
+      dst + k, 
+      _mm_and_si128(load2(a + k), load2(b + k))
+    );
+#endif
+  for (; k < n; k++)
+    dst[k] = a[k] & b[k];
+}
+
+void or_words(
+  word_t* __restrict dst,
+  const word_t* __restrict a,
+  size_t n
+)
+{
+  size_t k = 0;
+#ifdef __SSE2__
+  for (; k + 2 <= n; k += 2)
+    store2(
+      dst + k, 
+      _mm_or_si128(load2(dst + k), load2(a + k))
+    );
+#endif
+  for (; k < n; k++)
+    dst[k] |= a[k];
+}
+
+void and_not_words(
+  word_t* __restrict dst,
+  const word_t* __restrict a,
+  size_t n
+)
+{
+  size_t k = 0;
+#ifdef __SSE2__
+  // andnot(x, y) is ~x & y
+  for (; k + 2 <= n; k += 2)
+    store2(
+      dst + k, 
+      _mm_andnot_si128(load2(a + k), load2(dst + k))
+    );
+#endif
+  for (; k < n; k++)
+    dst[k] &= ~a[k];
+}
+
+}
+
+node_bitmap node_bitmap::select(
+  const document* doc,
+  const node_set<node_ptr>& ns
+)
+{
+  node_bitmap res(doc);
+  for (auto it = ns.begin(); it != ns.end(); ++it)
+    res.add(*it);
+  return res;
+}
+
+void node_bitmap::set(index_t i)
+{
+  SCHECK(doc && i < doc->size());
+
+  const index_t w = i / word_bits;
+  if (words.empty()) {
+    first = w;
+    words.push_back(0);
+  }
+  else if (w < first) {
+    words.insert(words.begin(), first - w, 0);
+    first = w;
+  }
+  else if (w - first >= words.size())
+    words.resize(w - first + 1, 0);
+
+  words[w - first] |= word_t(1) << (i % word_bits);
+}
+
+size_t node_bitmap::count() const
+{
+  size_t n = 0;
+  for (const word_t w : words)
+    n += __builtin_popcountll(w);
+  return n;
+}
+
+std::vector<index_t> node_bitmap::indexes() const
+{
+  std::vector<index_t> res;
+  res.reserve(count());
+  for_each([&res](index_t i) { res.push_back(i); });
+  return res;
+}
+
+node_set<node_ptr> node_bitmap::materialize() const
+{
+  node_set<node_ptr> res;
+  if (empty())
+    return res;
+
+  // the root..last node chain and its child path, nodes
+  // come in the document order so only the tail of the
+  // chain changes
+  std::vector<index_t> chain(1, 0);
+  child_path_t path = child_path_t::uninitialized();
+
+  for_each([this, &res, &chain, &path](index_t i)
+  {
+    while (chain.size() > 1
+           && doc->subtree_end(chain.back()) <= i)
+    {
+      chain.pop_back();
+      path.pop_back();
+    }
+
+    const size_t top = chain.size();
+    for (index_t p = i; p != chain[top - 1];
+         p = doc->parent(p))
+      chain.push_back(p);
+    std::reverse(chain.begin() + top, chain.end());
+    for (size_t k = top; k < chain.size(); k++)
+      path.push_back(doc->child_index(chain[k]));
+
+    res.push_back(
+      xpath::node<node_ptr>(node_ptr(doc, i)),
+      path
+    );
+  });
+  return res;
+}
+
+node_bitmap& node_bitmap::operator&=(const node_bitmap& o)
+{
+  SCHECK(doc == o.doc || !doc || !o.doc);
+
+  const index_t lo = std::max(first, o.first);
+  const index_t hi = std::min<index_t>(
+    first + words.size(),
+    o.first + o.words.size()
+  );
+  if (lo >= hi) {
+    words.clear();
+    first = 0;
+    return *this;
+  }
+
+  std::vector<word_t> res(hi - lo);
+  and_words(
+    res.data(),
+    words.data() + (lo - first),
+    o.words.data() + (lo - o.first),
+    res.size()
+  );
+  words.swap(res);
+  first = lo;
+  trim();
+  return *this;
+}
+
+node_bitmap& node_bitmap::operator|=(const node_bitmap& o)
+{
+  SCHECK(doc == o.doc || !doc || !o.doc);
+
+  if (o.empty())
+    return *this;
+  if (!doc)
+    doc = o.doc;
+  if (empty()) {
+    first = o.first;
+    words = o.words;
+    return *this;
+  }
+
+  const index_t lo = std::min(first, o.first);
+  const index_t hi = std::max<index_t>(
+    first + words.size(),
+    o.first + o.words.size()
+  );
+  if (lo != first || hi != first + words.size()) {
+    std::vector<word_t> res(hi - lo, 0);
+    std::copy(
+      words.begin(),
+      words.end(),
+      res.begin() + (first - lo)
+    );
+    words.swap(res);
+    first = lo;
+  }
+
+  or_words(
+    words.data() + (o.first - first),
+    o.words.data(),
+    o.words.size()
+  );
+  return *this;
+}
+
+node_bitmap& node_bitmap::operator-=(const node_bitmap& o)
+{
+  SCHECK(doc == o.doc || !doc || !o.doc);
+
+  const index_t lo = std::max(first, o.first);
+  const index_t hi = std::min<index_t>(
+    first + words.size(),
+    o.first + o.words.size()
+  );
+  if (lo >= hi)
+    return *this;
+
+  and_not_words(
+    words.data() + (lo - first),
+    o.words.data() + (lo - o.first),
+    hi - lo
+  );
+  trim();
+  return *this;
+}
+
+void node_bitmap::trim()
+{
+  auto last = words.end();
+  while (last != words.begin() && *(last - 1) == 0)
+    --last;
+  words.erase(last, words.end());
+
+  auto nz = words.begin();
+  while (nz != words.end() && *nz == 0)
+    ++nz;
+  first += nz - words.begin();
+  words.erase(words.begin(), nz);
+
+  if (words.empty())
+    first = 0;
+}
+
+} // snapshot
+} // xpath
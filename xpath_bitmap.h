@@ -0,0 +1,186 @@
+// -*-coding: mule-utf-8-unix; fill-column: 58; -*-
+/**
+ * @file
+ * Node-sets over a DOM snapshot as bitmaps indexed by
+ * the pre-order node number. Set operations are word
+ * operations.
+ *
+ * @author Sergei Lodyagin
+ */
+
+#ifndef OFFSCREEN_XPATH_BITMAP_H
+#define OFFSCREEN_XPATH_BITMAP_H
+
+#include <cstdint>
+#include <vector>
+#include "SCheck.h"
+#include "xpath.h"
+#include "xpath_snapshot.h"
+
+namespace xpath {
+namespace snapshot {
+
+//! A set of nodes of one snapshot document. Bit i is
+//! the node with index() == i. Only the words between
+//! the first and the last non-zero ones are stored, so
+//! a set of close nodes (e.g., a subtree) is small
+//! wherever it is in the document. The range is dense:
+//! a set takes at most doc->size() / 8 bytes, a small
+//! part of the snapshot itself.
+class node_bitmap
+{
+public:
+  using word_t = uint64_t;
+  static constexpr index_t word_bits = 64;
+
+  node_bitmap() {}
+
+  explicit node_bitmap(const document* doc_)
+    : doc(doc_)
+  {
+    SCHECK(doc);
+  }
+
+  //! Selects nodes of a query result over the
+  //! document. Attribute nodes are skipped.
+  template<class QueryResult>
+  static node_bitmap select(
+    const document* doc,
+    QueryResult&& qr
+  )
+  {
+    node_bitmap res(doc);
+    qr.for_each(
+      [&res](
+        const xpath::node<node_ptr>& n,
+        const child_path_t&
+      )
+      {
+        res.add(n);
+        return true;
+      }
+    );
+    return res;
+  }
+
+  //! Selects nodes of the node-set. Attribute nodes are
+  //! skipped.
+  static node_bitmap select(
+    const document* doc,
+    const node_set<node_ptr>& ns
+  );
+
+  const document* get_document() const
+  {
+    return doc;
+  }
+
+  //! Adds a node (not an attribute) of the document
+  void add(const xpath::node<node_ptr>& n)
+  {
+    if (n.is_attribute())
+      return;
+
+    const node_ptr p = (const node_ptr) n;
+    SCHECK(p.get_document() == doc);
+    set(p.index());
+  }
+
+  void set(index_t i);
+
+  bool test(index_t i) const
+  {
+    const index_t w = i / word_bits;
+    return w >= first && w - first < words.size()
+      && (words[w - first] >> (i % word_bits)) & 1;
+  }
+
+  bool empty() const
+  {
+    return words.empty();
+  }
+
+  //! The number of nodes
+  size_t count() const;
+
+  //! Calls fun(index) for nodes in the document order
+  template<class Fun>
+  void for_each(Fun&& fun) const
+  {
+    for (size_t k = 0; k < words.size(); k++) {
+      word_t w = words[k];
+      const index_t base = (first + k) * word_bits;
+      while (w) {
+        fun(base + __builtin_ctzll(w));
+        w &= w - 1; // clear the lowest bit
+      }
+    }
+  }
+
+  //! Nodes with child paths from the document root (the
+  //! same as node_id_t paths)
+  node_set<node_ptr> materialize() const;
+
+  std::vector<index_t> indexes() const;
+
+  //! The intersection
+  node_bitmap& operator&=(const node_bitmap& o);
+
+  //! The union
+  node_bitmap& operator|=(const node_bitmap& o);
+
+  //! The difference
+  node_bitmap& operator-=(const node_bitmap& o);
+
+  bool operator==(const node_bitmap& o) const
+  {
+    // an empty set is the same with or without the
+    // document
+    return (doc == o.doc || empty())
+      && first == o.first && words == o.words;
+  }
+
+  bool operator!=(const node_bitmap& o) const
+  {
+    return !operator==(o);
+  }
+
+protected:
+  //! Removes zero words from both ends
+  void trim();
+
+  const document* doc = nullptr;
+
+  //! The index of words[0] in the full bitmap
+  index_t first = 0;
+  std::vector<word_t> words;
+};
+
+inline node_bitmap operator&(
+  node_bitmap a,
+  const node_bitmap& b
+)
+{
+  return a &= b;
+}
+
+inline node_bitmap operator|(
+  node_bitmap a,
+  const node_bitmap& b
+)
+{
+  return a |= b;
+}
+
+inline node_bitmap operator-(
+  node_bitmap a,
+  const node_bitmap& b
+)
+{
+  return a -= b;
+}
+
+} // snapshot
+} // xpath
+
+#endif
@@ -0,0 +1,578 @@
+// -*-coding: mule-utf-8-unix; fill-column: 58; -*-
+/**
+ * @file
+ * The runtime XPath compiler.
+ *
+ * @author Sergei Lodyagin
+ */
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <unordered_map>
+#include "xpath_plan.h"
+
+namespace xpath {
+namespace runtime {
+
+namespace {
+
+std::string error_message(
+  const std::string& text,
+  size_t pos,
+  const std::string& what
+)
+{
+  std::ostringstream out;
+  out << "xpath: " << what << " at position " << pos
+      << " in \"" << text << '"';
+  return out.str();
+}
+
+//! The recursive descent parser of the supported XPath
+//! subset
+class parser
+{
+public:
+  explicit parser(const std::string& text) : s(text) {}
+
+  //! [18] (xpath) UnionExpr
+  std::vector<location_path> parse()
+  {
+    std::vector<location_path> paths;
+    paths.push_back(parse_path());
+    while (accept("|"))
+      paths.push_back(parse_path());
+
+    if (!at_end())
+      error("unexpected character");
+    return paths;
+  }
+
+protected:
+  [[noreturn]] void error(const std::string& what) const
+  {
+    throw syntax_error(s, pos, what);
+  }
+
+  void skip_ws()
+  {
+    while (pos < s.size() && ::isspace(s[pos]))
+      ++pos;
+  }
+
+  bool at_end()
+  {
+    skip_ws();
+    return pos == s.size();
+  }
+
+  //! Skips the token if it is next
+  bool accept(const char* token)
+  {
+    skip_ws();
+    const size_t len = ::strlen(token);
+    if (s.compare(pos, len, token) != 0)
+      return false;
+    pos += len;
+    return true;
+  }
+
+  void expect(const char* token)
+  {
+    if (!accept(token))
+      error(std::string("'") + token + "' expected");
+  }
+
+  static bool is_name_start(char c)
+  {
+    return ::isalpha(c) || c == '_';
+  }
+
+  static bool is_name_char(char c)
+  {
+    return ::isalnum(c) 
+      || c == '_' || c == '-' || c == '.';
+  }
+
+  bool next_is_name()
+  {
+    skip_ws();
+    return pos < s.size() && is_name_start(s[pos]);
+  }
+
+  //! QName (a prefix is kept as a part of the name)
+  std::string name()
+  {
+    if (!next_is_name())
+      error("a name expected");
+
+    const size_t start = pos;
+    for (;;) {
+      while (pos < s.size() && is_name_char(s[pos]))
+        ++pos;
+      // prefix:local but not axis::
+      if (pos + 1 < s.size() && s[pos] == ':'
+          && is_name_start(s[pos + 1]))
+        ++pos;
+      else break;
+    }
+    return s.substr(start, pos - start);
+  }
+
+  //! A tag or attribute name. HTML names are case
+  //! insensitive, the DOM returns them in lower case.
+  std::string lower_name()
+  {
+    std::string n = name();
+    std::transform(
+      n.begin(), n.end(), n.begin(), ::tolower
+    );
+    return n;
+  }
+
+  //! [29] (xpath) Literal
+  std::string literal()
+  {
+    skip_ws();
+    if (pos == s.size() 
+        || (s[pos] != '\'' && s[pos] != '"'))
+      error("a literal expected");
+
+    const char quote = s[pos];
+    const size_t end = s.find(quote, pos + 1);
+    if (end == std::string::npos)
+      error("unterminated literal");
+
+    std::string res = s.substr(pos + 1, end - pos - 1);
+    pos = end + 1;
+    return res;
+  }
+
+  size_t number()
+  {
+    skip_ws();
+    size_t res = 0;
+    const size_t start = pos;
+    while (pos < s.size() && ::isdigit(s[pos]))
+      res = res * 10 + (s[pos++] - '0');
+    if (pos == start)
+      error("a number expected");
+    return res;
+  }
+
+  //! There is a step before the end or the next union
+  //! member
+  bool next_is_step()
+  {
+    return !at_end() && s[pos] != '|';
+  }
+
+  location_path parse_path()
+  {
+    location_path path;
+    if (accept("//")) {
+      path.absolute = true;
+      add_descendant(path, parse_step());
+    }
+    else if (accept("/")) {
+      path.absolute = true;
+      if (!next_is_step())
+        return path; // the root only
+      path.steps.push_back(parse_step());
+    }
+    else path.steps.push_back(parse_step());
+
+    for (;;) {
+      if (accept("//"))
+        add_descendant(path, parse_step());
+      else if (accept("/"))
+        path.steps.push_back(parse_step());
+      else break;
+    }
+    return path;
+  }
+
+  //! Appends //st. It is
+  //! /descendant-or-self::node()/st but it is the
+  //! single descendant::x step if st is child::x
+  //! without positional predicates.
+  static void add_descendant(location_path& path, step st)
+  {
+    const bool positional = std::any_of(
+      st.predicates.begin(),
+      st.predicates.end(),
+      [](const predicate& pr) 
+      { 
+        return pr.is_positional(); 
+      }
+    );
+    if (st.axis == axis_id::child && !positional) {
+      st.axis = axis_id::descendant;
+      path.steps.push_back(std::move(st));
+      return;
+    }
+
+    step any;
+    any.axis = axis_id::descendant_or_self;
+    any.test = node_test::node;
+    path.steps.push_back(std::move(any));
+    path.steps.push_back(std::move(st));
+  }
+
+  axis_id parse_axis_name(const std::string& n) const
+  {
+    static const std::pair<const char*, axis_id> 
+    axes[] = {
+      { "ancestor", axis_id::ancestor },
+      { "ancestor-or-self", axis_id::ancestor_or_self },
+      { "attribute", axis_id::attribute },
+      { "child", axis_id::child },
+      { "descendant", axis_id::descendant },
+      { "descendant-or-self", 
+        axis_id::descendant_or_self },
+      { "following", axis_id::following },
+      { "following-sibling", axis_id::following_sibling },
+      { "parent", axis_id::parent },
+      { "preceding", axis_id::preceding },
+      { "preceding-sibling", axis_id::preceding_sibling },
+      { "self", axis_id::self }
+    };
+    for (const auto& ax : axes)
+      if (n == ax.first)
+        return ax.second;
+    error("unsupported axis " + n);
+  }
+
+  //! [4] (xpath) Step
+  step parse_step()
+  {
+    step st;
+
+    if (accept("..")) {
+      st.axis = axis_id::parent;
+      return st;
+    }
+    if (accept(".")) {
+      st.axis = axis_id::self;
+      return st;
+    }
+
+    if (accept("@"))
+      st.axis = axis_id::attribute;
+    else if (next_is_name()) {
+      const size_t save = pos;
+      const std::string n = name();
+      if (accept("::"))
+        st.axis = parse_axis_name(n);
+      else pos = save;
+    }
+
+    parse_node_test(st);
+
+    while (accept("["))
+      st.predicates.push_back(parse_predicate());
+
+    if (!st.predicates.empty()) {
+      const predicate& pr = st.predicates[0];
+      if (pr.what == predicate::kind::position)
+        st.limit = pr.position;
+      else if (pr.what == predicate::kind::position_less)
+        st.limit = pr.position - 1;
+    }
+    return st;
+  }
+
+  //! [7] (xpath) NodeTest
+  void parse_node_test(step& st)
+  {
+    if (accept("*")) {
+      st.test = node_test::any;
+      return;
+    }
+
+    const std::string n = name();
+    if (accept("(")) {
+      if (n == "node")
+        st.test = node_test::node;
+      else if (n == "text")
+        st.test = node_test::text;
+      else if (n == "comment")
+        st.test = node_test::comment;
+      else if (n == "processing-instruction")
+        st.test = node_test::processing_instruction;
+      else
+        error("unsupported node type " + n);
+      expect(")");
+      return;
+    }
+
+    st.test = node_test::name;
+    st.name = n;
+    // HTML tag and attribute names are case insensitive
+    std::transform(
+      st.name.begin(),
+      st.name.end(),
+      st.name.begin(),
+      ::tolower
+    );
+    if (st.axis != axis_id::attribute)
+      st.atom = intern_tag(st.name);
+  }
+
+  //! [8] (xpath) Predicate (after '[')
+  predicate parse_predicate()
+  {
+    predicate pr;
+
+    if (accept("@")) {
+      pr.name = lower_name();
+      if (accept("!=")) {
+        pr.what = predicate::kind::attr_not_equals;
+        pr.value = literal();
+      }
+      else if (accept("=")) {
+        pr.what = predicate::kind::attr_equals;
+        pr.value = literal();
+      }
+      else pr.what = predicate::kind::has_attr;
+    }
+    else if (accept("contains"))
+      parse_string_fn(pr, string_fn::contains);
+    else if (accept("starts-with"))
+      parse_string_fn(pr, string_fn::starts_with);
+    else if (accept("ends-with"))
+      parse_string_fn(pr, string_fn::ends_with);
+    else if (accept("last")) {
+      expect("(");
+      expect(")");
+      pr.what = predicate::kind::last;
+    }
+    else if (accept("position")) {
+      expect("(");
+      expect(")");
+      pr.what = predicate::kind::position_less;
+      if (accept("<=")) 
+        pr.position = number() + 1;
+      else {
+        expect("<");
+        pr.position = number();
+      }
+      if (pr.position == 0)
+        error("positions start from 1");
+    }
+    else if (!at_end() && ::isdigit(s[pos])) {
+      pr.what = predicate::kind::position;
+      pr.position = number();
+      if (pr.position == 0)
+        error("positions start from 1");
+    }
+    else error("unsupported predicate");
+
+    expect("]");
+    return pr;
+  }
+
+  //! [27] (xpath) FunctionCall with (@name, 'literal')
+  //! arguments (after the function name)
+  void parse_string_fn(predicate& pr, string_fn fn)
+  {
+    expect("(");
+    expect("@");
+    pr.name = lower_name();
+    expect(",");
+    pr.value = literal();
+    expect(")");
+    pr.what = predicate::kind::attr_string;
+    pr.fn = fn;
+  }
+
+  const std::string& s;
+  size_t pos = 0;
+};
+
+//! Plans by the XPath text. The least recently used
+//! plans are dropped above the capacity.
+struct plan_cache
+{
+  //! texts, the most recently used first
+  using lru_list = std::list<std::string>;
+
+  struct entry
+  {
+    std::shared_ptr<const plan> pl;
+    lru_list::iterator use;
+  };
+
+  //! Adds the plan if the text is new, mx must be locked
+  std::shared_ptr<const plan> add(
+    const std::string& text,
+    const std::shared_ptr<const plan>& pl
+  )
+  {
+    const auto p = plans.find(text);
+    if (p != plans.end()) {
+      lru.splice(lru.begin(), lru, p->second.use);
+      return p->second.pl;
+    }
+
+    lru.push_front(text);
+    plans.emplace(text, entry{pl, lru.begin()});
+    shrink();
+    return pl;
+  }
+
+  void shrink()
+  {
+    while (plans.size() > capacity) {
+      plans.erase(lru.back());
+      lru.pop_back();
+    }
+  }
+
+  std::mutex mx;
+  size_t capacity = default_cache_capacity;
+  lru_list lru;
+  std::unordered_map<std::string, entry> plans;
+};
+
+plan_cache& cache()
+{
+  static plan_cache the_cache;
+  return the_cache;
+}
+
+}
+
+syntax_error::syntax_error(
+  const std::string& text_,
+  size_t pos_,
+  const std::string& what
+)
+  : std::runtime_error(error_message(text_, pos_, what)),
+    text(text_),
+    pos(pos_)
+{}
+
+bool is_reverse(axis_id ax)
+{
+  switch (ax) {
+    case axis_id::ancestor:
+    case axis_id::ancestor_or_self:
+    case axis_id::parent:
+    case axis_id::preceding:
+    case axis_id::preceding_sibling:
+      return true;
+    default:
+      return false;
+  }
+}
+
+plan::plan(const std::string& text)
+  : the_text(text),
+    the_paths(parser(text).parse())
+{}
+
+batch::batch(
+  const std::vector<std::shared_ptr<const plan>>& plans_
+)
+  : plans(plans_)
+{
+  for (size_t k = 0; k < plans.size(); k++)
+    add(k);
+}
+
+batch::batch(const std::vector<std::string>& texts)
+{
+  plans.reserve(texts.size());
+  for (const std::string& text : texts)
+    plans.push_back(compile(text));
+  for (size_t k = 0; k < plans.size(); k++)
+    add(k);
+}
+
+void batch::add(size_t plan_idx)
+{
+  SCHECK(plans[plan_idx]);
+
+  const plan& pl = *plans[plan_idx];
+  for (const location_path& path : pl.paths()) {
+    const bool shared = path.absolute 
+      && !path.steps.empty()
+      && (path.steps[0].axis == axis_id::descendant
+          || path.steps[0].axis 
+             == axis_id::descendant_or_self);
+
+    if (!shared) {
+      separate.push_back({plan_idx, &path});
+      continue;
+    }
+
+    const size_t l = listeners.size();
+    listeners.push_back({plan_idx, &path});
+
+    const step& first = path.steps[0];
+    if (first.test == node_test::name)
+      by_atom[first.atom].push_back(l);
+    else
+      by_test.push_back(l);
+  }
+}
+
+std::shared_ptr<const plan> 
+compile(const std::string& text)
+{
+  plan_cache& c = cache();
+  {
+    std::lock_guard<std::mutex> lk(c.mx);
+    const auto p = c.plans.find(text);
+    if (p != c.plans.end()) {
+      c.lru.splice(c.lru.begin(), c.lru, p->second.use);
+      return p->second.pl;
+    }
+  }
+
+  // parse outside the lock, a concurrent compilation of
+  // the same text is harmless
+  std::shared_ptr<const plan> res =
+    std::make_shared<plan>(text);
+
+  std::lock_guard<std::mutex> lk(c.mx);
+  return c.add(text, res);
+}
+
+size_t cache_size()
+{
+  plan_cache& c = cache();
+  std::lock_guard<std::mutex> lk(c.mx);
+  return c.plans.size();
+}
+
+void clear_cache()
+{
+  plan_cache& c = cache();
+  std::lock_guard<std::mutex> lk(c.mx);
+  c.plans.clear();
+  c.lru.clear();
+}
+
+void set_cache_capacity(size_t n)
+{
+  plan_cache& c = cache();
+  std::lock_guard<std::mutex> lk(c.mx);
+  c.capacity = n;
+  c.shrink();
+}
+
+size_t get_cache_capacity()
+{
+  plan_cache& c = cache();
+  std::lock_guard<std::mutex> lk(c.mx);
+  return c.capacity;
+}
+
+}
+}
@@ -0,0 +1,856 @@
+// -*-coding: mule-utf-8-unix; fill-column: 58; -*-
+/**
+ * @file
+ * The runtime XPath compiler. The template queries (see
+ * xpath::step) are fixed at compile time; a plan is
+ * parsed from an XPath 1.0 string and executed over any
+ * xpath::node.
+ *
+ * The supported subset: location paths (absolute,
+ * relative and with //), all axes but namespace, name
+ * tests, *, node(), text(), comment(),
+ * processing-instruction(), the . and .. abbreviations,
+ * predicates [n], [last()], [position() < n],
+ * [position() <= n], [@a], [@a='v'], [@a!='v'] and
+ * unions (|). A batch evaluates several plans in one
+ * document traversal.
+ *
+ * @author Sergei Lodyagin
+ */
+
+#ifndef OFFSCREEN_XPATH_PLAN_H
+#define OFFSCREEN_XPATH_PLAN_H
+
+#include <algorithm>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include "xpath.h"
+
+namespace xpath {
+namespace runtime {
+
+//! A bad XPath string
+class syntax_error : public std::runtime_error
+{
+public:
+  syntax_error(
+    const std::string& text,
+    size_t pos,
+    const std::string& what
+  );
+
+  //! The whole XPath string
+  const std::string text;
+
+  //! The error position in the text
+  const size_t pos;
+};
+
+enum class axis_id {
+  ancestor,
+  ancestor_or_self,
+  attribute,
+  child,
+  descendant,
+  descendant_or_self,
+  following,
+  following_sibling,
+  parent,
+  preceding,
+  preceding_sibling,
+  self
+};
+
+//! Reverse axes enumerate nodes in the reverse document
+//! order (it is the order of [n] predicates)
+bool is_reverse(axis_id ax);
+
+//! [7] (xpath) NodeTest
+enum class node_test {
+  name,                   //!< QName
+  any,                    //!< *
+  node,                   //!< node()
+  text,                   //!< text()
+  comment,                //!< comment()
+  processing_instruction  //!< processing-instruction()
+};
+
+struct predicate
+{
+  enum class kind {
+    position,        //!< [n]
+    last,            //!< [last()]
+    position_less,   //!< [position() < n]
+    has_attr,        //!< [@name]
+    attr_equals,     //!< [@name='value']
+    attr_not_equals, //!< [@name!='value']
+    attr_string      //!< [contains(@name, 'value')] etc.
+  };
+
+  kind what = kind::position;
+
+  //! 1-based, for kind::position and
+  //! kind::position_less
+  size_t position = 0;
+
+  std::string name;
+  std::string value;
+
+  //! for kind::attr_string
+  string_fn fn = string_fn::equals;
+
+  bool is_positional() const
+  {
+    return what == kind::position 
+      || what == kind::last
+      || what == kind::position_less;
+  }
+};
+
+//! [4] (xpath) Step
+struct step
+{
+  axis_id axis = axis_id::child;
+  node_test test = node_test::node;
+
+  //! The name for node_test::name. Element names are in
+  //! lower case (as node::tag_name() returns).
+  std::string name;
+
+  //! The atom of an element name
+  atom_t atom = empty_atom;
+
+  std::vector<predicate> predicates;
+
+  //! The number of axis nodes (passed the node test)
+  //! the predicates can select from. An axis traversal
+  //! stops there. It is set by a leading [n] or
+  //! [position() < n].
+  size_t limit = std::numeric_limits<size_t>::max();
+};
+
+//! [1] (xpath) LocationPath
+struct location_path
+{
+  bool absolute = false;
+  std::vector<step> steps;
+};
+
+class batch;
+
+//! A compiled XPath. It is immutable and can be shared
+//! between threads.
+class plan
+{
+  friend class batch;
+
+public:
+  //! Parses the text. Throws syntax_error.
+  explicit plan(const std::string& text);
+
+  plan(const plan&) = delete;
+  plan& operator=(const plan&) = delete;
+
+  const std::string& text() const
+  {
+    return the_text;
+  }
+
+  //! Union members
+  const std::vector<location_path>& paths() const
+  {
+    return the_paths;
+  }
+
+  //! Selects nodes starting from the context. The result
+  //! is in the document order without duplicates.
+  template<class NodePtr>
+  std::vector<node<NodePtr>>
+  execute(const node<NodePtr>& context) const;
+
+protected:
+  //! The document order key: sibling numbers from the
+  //! root (or the snapshot pre-order number) followed by
+  //! -2 for a node or -1, attr_idx for an attribute
+  using order_key = std::vector<long>;
+
+  //! The snapshot node number is the document order
+  template<class Ptr>
+  static auto position_key(
+    const Ptr& p, 
+    order_key& key, 
+    int
+  )
+    -> decltype(p->index(), void())
+  {
+    key.push_back(p->index());
+  }
+
+  template<class Ptr>
+  static void position_key(
+    const Ptr& p, 
+    order_key& key, 
+    long
+  )
+  {
+    const size_t first = key.size();
+    for (Ptr n = p; n; n = n->GetParent()) {
+      long k = 0;
+      for (Ptr s = n->GetPreviousSibling();
+           s;
+           s = s->GetPreviousSibling()
+           )
+        ++k;
+      key.push_back(k);
+    }
+    std::reverse(key.begin() + first, key.end());
+  }
+
+  template<class NodePtr>
+  static order_key document_order(const node<NodePtr>& n);
+
+  //! Sorts nodes in the document order and removes
+  //! duplicates
+  template<class NodePtr>
+  static void sort_unique(
+    std::vector<node<NodePtr>>& nodes
+  );
+
+  template<class NodePtr>
+  static bool matches(
+    const step& st, 
+    const node<NodePtr>& n
+  );
+
+  template<class NodePtr>
+  static bool attr_matches(
+    const predicate& pr,
+    const node<NodePtr>& n
+  );
+
+  //! Appends nodes of the axis passing the node test
+  template<class NodePtr, class Axis>
+  static void collect(
+    const step& st,
+    const std::shared_ptr<Axis>& ax,
+    std::vector<node<NodePtr>>& out
+  );
+
+  //! Applies the step predicates to the step candidates
+  //! (in the axis order)
+  template<class NodePtr>
+  static void filter(
+    const step& st,
+    std::vector<node<NodePtr>>& cand
+  );
+
+  //! Appends the step result for a single context node
+  //! in the document order
+  template<class NodePtr>
+  static void apply_step(
+    const step& st,
+    const node<NodePtr>& context,
+    std::vector<node<NodePtr>>& out
+  );
+
+  //! Runs steps [from, end) of the path. ctx is both
+  //! the input and the output node set.
+  template<class NodePtr>
+  static void run_steps(
+    const location_path& path,
+    size_t from,
+    std::vector<node<NodePtr>>& ctx
+  );
+
+  template<class NodePtr>
+  static node<NodePtr> root_of(const node<NodePtr>& n);
+
+  //! n is a proper descendant of a. A NodePtr with
+  //! labels checks it in O(1).
+  template<class NodePtr>
+  static bool is_inside(
+    const node<NodePtr>& n, 
+    const node<NodePtr>& a
+  )
+  {
+    return is_inside(
+      n, 
+      a, 
+      std::integral_constant<
+        bool, 
+        has_node_labels<NodePtr>::value
+      >()
+    );
+  }
+
+  template<class NodePtr>
+  static bool is_inside(
+    const node<NodePtr>& n, 
+    const node<NodePtr>& a,
+    std::true_type
+  )
+  {
+    const NodePtr pa = (const NodePtr) a;
+    return pa->is_ancestor_of((const NodePtr) n);
+  }
+
+  template<class NodePtr>
+  static bool is_inside(
+    const node<NodePtr>& n, 
+    const node<NodePtr>& a,
+    std::false_type
+  )
+  {
+    node<NodePtr> p((const NodePtr) n);
+    while (p.go_parent())
+      if (p.is_same(a))
+        return true;
+    return false;
+  }
+
+  std::string the_text;
+  std::vector<location_path> the_paths;
+};
+
+//! Returns the plan of the text. Plans are cached by the
+//! text (process-wide), the least recently used ones are
+//! dropped above the cache capacity. Throws
+//! syntax_error.
+std::shared_ptr<const plan> 
+compile(const std::string& text);
+
+//! The number of cached plans
+size_t cache_size();
+
+void clear_cache();
+
+constexpr size_t default_cache_capacity = 256;
+
+//! Sets the maximal number of cached plans
+void set_cache_capacity(size_t n);
+
+size_t get_cache_capacity();
+
+//! Several plans evaluated together. Absolute paths
+//! starting with a descendant step (like //x[@a='v']/y)
+//! share one document traversal: each node is
+//! dispatched by its tag atom to all first steps with
+//! this name test and only then the rest of each path
+//! runs. Other paths run as in plan::execute().
+class batch
+{
+public:
+  explicit batch(
+    const std::vector<std::shared_ptr<const plan>>& plans
+  );
+
+  //! compile()s each text. Throws syntax_error.
+  explicit batch(const std::vector<std::string>& texts);
+
+  size_t size() const
+  {
+    return plans.size();
+  }
+
+  const plan& operator[](size_t k) const
+  {
+    return *plans[k];
+  }
+
+  //! The number of paths served by the shared traversal
+  size_t n_shared() const
+  {
+    return listeners.size();
+  }
+
+  //! Returns plan::execute() results of all plans in
+  //! the order of plans
+  template<class NodePtr>
+  std::vector<std::vector<node<NodePtr>>>
+  execute(const node<NodePtr>& context) const;
+
+protected:
+  //! A path of the plan plan_idx
+  struct listener
+  {
+    size_t plan_idx;
+    const location_path* path;
+  };
+
+  void add(size_t plan_idx);
+
+  std::vector<std::shared_ptr<const plan>> plans;
+
+  //! Paths with the first step in the shared traversal
+  std::vector<listener> listeners;
+
+  //! listeners indices by the atom of the first step
+  //! name test
+  std::unordered_map<atom_t, std::vector<size_t>> 
+    by_atom;
+
+  //! listeners indices with other node tests, they are
+  //! checked for each node
+  std::vector<size_t> by_test;
+
+  //! Paths running separately
+  std::vector<listener> separate;
+};
+
+//! The child path of n from the document root. It is
+//! the same as the path() of an axis iterator started
+//! at the root (see shared::node_id_t).
+template<class NodePtr>
+child_path_t root_path(const node<NodePtr>& n);
+
+//! compile(text)->execute(context)
+template<class NodePtr>
+std::vector<node<NodePtr>> select(
+  const std::string& text,
+  const node<NodePtr>& context
+)
+{
+  return compile(text)->execute(context);
+}
+
+template<class NodePtr>
+plan::order_key 
+plan::document_order(const node<NodePtr>& n)
+{
+  order_key key;
+  position_key((const NodePtr) n, key, 0);
+  if (n.is_attribute()) {
+    key.push_back(-1);
+    key.push_back(n.attr_index());
+  }
+  else key.push_back(-2);
+  return key;
+}
+
+template<class NodePtr>
+void plan::sort_unique(
+  std::vector<node<NodePtr>>& nodes
+)
+{
+  if (nodes.size() < 2)
+    return;
+
+  std::vector<std::pair<order_key, size_t>> keys;
+  keys.reserve(nodes.size());
+  for (size_t i = 0; i < nodes.size(); i++)
+    keys.emplace_back(document_order(nodes[i]), i);
+
+  std::sort(keys.begin(), keys.end());
+
+  std::vector<node<NodePtr>> res;
+  res.reserve(nodes.size());
+  for (size_t i = 0; i < keys.size(); i++)
+    if (i == 0 || keys[i].first != keys[i-1].first)
+      res.push_back(nodes[keys[i].second]);
+  nodes.swap(res);
+}
+
+template<class NodePtr>
+bool plan::matches(
+  const step& st, 
+  const node<NodePtr>& n
+)
+{
+  if (n.is_attribute()) {
+    // attributes are the principal node type of the
+    // attribute axis only
+    switch (st.test) {
+      case node_test::node:
+        return true;
+      case node_test::any:
+        return st.axis == axis_id::attribute;
+      case node_test::name:
+        return st.axis == axis_id::attribute
+          && n.attr_name() == st.name;
+      default:
+        return false;
+    }
+  }
+
+  switch (st.test) {
+    case node_test::node:
+      return true;
+    case node_test::any:
+      return st.axis != axis_id::attribute
+        && n.get_type() == node_type::node;
+    case node_test::name:
+      return st.axis != axis_id::attribute
+        && n.has_tag(st.atom, st.name);
+    case node_test::text:
+      return n.get_type() == node_type::text;
+    case node_test::comment:
+      return n.get_type() == node_type::comment;
+    case node_test::processing_instruction:
+      return n.get_type()
+        == node_type::processing_instruction;
+  }
+  return false;
+}
+
+template<class NodePtr>
+bool plan::attr_matches(
+  const predicate& pr,
+  const node<NodePtr>& n
+)
+{
+  if (n.is_attribute() || n.get_type() != node_type::node)
+    return false;
+
+  switch (pr.what) {
+    case predicate::kind::has_attr:
+      return n.has_attribute(pr.name);
+    case predicate::kind::attr_equals:
+      // a missing attribute is not equal to ''
+      return n[pr.name] == pr.value
+        && (!pr.value.empty() 
+            || n.has_attribute(pr.name));
+    case predicate::kind::attr_not_equals:
+      return n.has_attribute(pr.name)
+        && n[pr.name] != pr.value;
+    case predicate::kind::attr_string:
+      return n.match_attribute(pr.name, pr.fn, pr.value);
+    default:
+      THROW_PROGRAM_ERROR;
+  }
+}
+
+template<class NodePtr, class Axis>
+void plan::collect(
+  const step& st,
+  const std::shared_ptr<Axis>& ax,
+  std::vector<node<NodePtr>>& out
+)
+{
+  const auto end = ax->end();
+  for (auto it = ax->begin(); 
+       it != end && out.size() < st.limit; 
+       ++it
+       ) 
+  {
+    const node<NodePtr> n = *it;
+    if (matches(st, n))
+      out.push_back(n);
+  }
+}
+
+template<class NodePtr>
+void plan::filter(
+  const step& st,
+  std::vector<node<NodePtr>>& cand
+)
+{
+  for (const predicate& pr : st.predicates) {
+    if (cand.empty())
+      break;
+
+    switch (pr.what) {
+      case predicate::kind::position:
+        if (pr.position <= cand.size()) {
+          const node<NodePtr> n = cand[pr.position - 1];
+          cand.assign(1, n);
+        }
+        else cand.clear();
+        break;
+      case predicate::kind::last:
+        cand.erase(cand.begin(), cand.end() - 1);
+        break;
+      case predicate::kind::position_less:
+        if (pr.position <= cand.size())
+          cand.erase(
+            cand.begin() + (pr.position - 1),
+            cand.end()
+          );
+        break;
+      default:
+        cand.erase(
+          std::remove_if(
+            cand.begin(),
+            cand.end(),
+            [&pr](const node<NodePtr>& n)
+            {
+              return !attr_matches(pr, n);
+            }
+          ),
+          cand.end()
+        );
+    }
+  }
+}
+
+template<class NodePtr>
+void plan::apply_step(
+  const step& st,
+  const node<NodePtr>& ctx,
+  std::vector<node<NodePtr>>& out
+)
+{
+  std::vector<node<NodePtr>> cand;
+
+  if (ctx.is_attribute()) {
+    // only the owner element and its ancestors are
+    // reachable from an attribute
+    const node<NodePtr> owner((const NodePtr) ctx);
+    switch (st.axis) {
+      case axis_id::self:
+        if (matches(st, ctx))
+          cand.push_back(ctx);
+        break;
+      case axis_id::parent:
+        if (matches(st, owner))
+          cand.push_back(owner);
+        break;
+      case axis_id::ancestor_or_self:
+        if (matches(st, ctx))
+          cand.push_back(ctx);
+        // fall through
+      case axis_id::ancestor:
+        collect(st, owner.ancestor_or_self(), cand);
+        break;
+      default:
+        break;
+    }
+  }
+  else switch (st.axis) {
+    case axis_id::ancestor:
+      collect(st, ctx.ancestor(), cand); break;
+    case axis_id::ancestor_or_self:
+      collect(st, ctx.ancestor_or_self(), cand); break;
+    case axis_id::attribute:
+      collect(st, ctx.attribute(), cand); break;
+    case axis_id::child:
+      collect(st, ctx.child(), cand); break;
+    case axis_id::descendant:
+      collect(st, ctx.descendant(), cand); break;
+    case axis_id::descendant_or_self:
+      collect(st, ctx.descendant_or_self(), cand); break;
+    case axis_id::following:
+      collect(st, ctx.following(), cand); break;
+    case axis_id::following_sibling:
+      collect(st, ctx.following_sibling(), cand); break;
+    case axis_id::parent:
+      collect(st, ctx.parent(), cand); break;
+    case axis_id::preceding:
+      collect(st, ctx.preceding(), cand); break;
+    case axis_id::preceding_sibling:
+      collect(st, ctx.preceding_sibling(), cand); break;
+    case axis_id::self:
+      collect(st, ctx.self(), cand); break;
+  }
+
+  filter(st, cand);
+
+  if (is_reverse(st.axis))
+    out.insert(out.end(), cand.rbegin(), cand.rend());
+  else
+    out.insert(out.end(), cand.begin(), cand.end());
+}
+
+template<class NodePtr>
+node<NodePtr> plan::root_of(const node<NodePtr>& n)
+{
+  node<NodePtr> root((const NodePtr) n);
+  while (root.go_parent())
+    ;
+  return root;
+}
+
+template<class NodePtr>
+void plan::run_steps(
+  const location_path& path,
+  size_t from,
+  std::vector<node<NodePtr>>& ctx
+)
+{
+  for (size_t k = from; k < path.steps.size(); k++) {
+    if (ctx.empty())
+      break;
+
+    const step& st = path.steps[k];
+
+    // A descendant step from a context inside an earlier
+    // context selects a subset of the earlier results,
+    // so only outermost contexts run. Their subtrees are
+    // disjoint and in the document order, the results
+    // need no sort (the live DOM has no cheap order
+    // keys). Positional predicates count per context.
+    const bool outermost = ctx.size() > 1
+      && (st.axis == axis_id::descendant
+          || st.axis == axis_id::descendant_or_self)
+      && std::none_of(
+           st.predicates.begin(),
+           st.predicates.end(),
+           [](const predicate& pr) 
+           { 
+             return pr.is_positional(); 
+           }
+         );
+
+    std::vector<node<NodePtr>> next;
+    const node<NodePtr>* outer = nullptr;
+    for (const node<NodePtr>& n : ctx) {
+      // an attribute has no descendants
+      if (outermost && !n.is_attribute()) {
+        if (outer && is_inside(n, *outer))
+          continue;
+        outer = &n;
+      }
+      apply_step(st, n, next);
+    }
+
+    // results of different context nodes can
+    // interleave or repeat
+    if (ctx.size() > 1 && !outermost)
+      sort_unique(next);
+
+    ctx.swap(next);
+  }
+}
+
+template<class NodePtr>
+std::vector<node<NodePtr>>
+plan::execute(const node<NodePtr>& context) const
+{
+  std::vector<node<NodePtr>> res;
+
+  for (const location_path& path : the_paths) {
+    std::vector<node<NodePtr>> ctx(
+      1, 
+      path.absolute ? root_of(context) : context
+    );
+    run_steps(path, 0, ctx);
+    res.insert(res.end(), ctx.begin(), ctx.end());
+  }
+
+  if (the_paths.size() > 1)
+    sort_unique(res);
+  return res;
+}
+
+template<class NodePtr>
+std::vector<std::vector<node<NodePtr>>>
+batch::execute(const node<NodePtr>& context) const
+{
+  std::vector<std::vector<node<NodePtr>>> res(
+    plans.size()
+  );
+  // the number of paths appended to each result
+  std::vector<size_t> n_paths(plans.size(), 0);
+
+  if (!listeners.empty()) {
+    std::vector<std::vector<node<NodePtr>>> cand(
+      listeners.size()
+    );
+    const auto add_cand = 
+      [this, &cand](
+        size_t l, 
+        const node<NodePtr>& n, 
+        bool is_root
+      )
+    {
+      const step& first = listeners[l].path->steps[0];
+      // the root is only in descendant-or-self::
+      if ((!is_root 
+           || first.axis == axis_id::descendant_or_self)
+          && cand[l].size() < first.limit)
+        cand[l].push_back(n);
+    };
+
+    const auto all = plan::root_of(context)
+      .descendant_or_self();
+    const auto end = all->end();
+    bool is_root = true;
+    for (auto it = all->begin(); it != end; ++it) {
+      const node<NodePtr> n = *it;
+
+      const auto p = by_atom.find(n.tag_atom());
+      if (p != by_atom.end())
+        for (size_t l : p->second)
+          add_cand(l, n, is_root);
+
+      for (size_t l : by_test)
+        if (plan::matches(listeners[l].path->steps[0], n))
+          add_cand(l, n, is_root);
+
+      is_root = false;
+    }
+
+    for (size_t l = 0; l < listeners.size(); l++) {
+      const location_path& path = *listeners[l].path;
+      plan::filter(path.steps[0], cand[l]);
+      plan::run_steps(path, 1, cand[l]);
+
+      auto& r = res[listeners[l].plan_idx];
+      r.insert(r.end(), cand[l].begin(), cand[l].end());
+      ++n_paths[listeners[l].plan_idx];
+    }
+  }
+
+  for (const listener& sep : separate) {
+    std::vector<node<NodePtr>> ctx(
+      1, 
+      sep.path->absolute 
+        ? plan::root_of(context) : context
+    );
+    plan::run_steps(*sep.path, 0, ctx);
+
+    auto& r = res[sep.plan_idx];
+    r.insert(r.end(), ctx.begin(), ctx.end());
+    ++n_paths[sep.plan_idx];
+  }
+
+  for (size_t k = 0; k < res.size(); k++)
+    if (n_paths[k] > 1)
+      plan::sort_unique(res[k]);
+  return res;
+}
+
+//! A NodePtr with child_index() (like
+//! snapshot::node_ptr) knows its sibling number
+template<class Ptr>
+auto sibling_number(const Ptr& p, int)
+  -> decltype(p->child_index(), node_difference_type())
+{
+  return p->child_index();
+}
+
+template<class Ptr>
+node_difference_type sibling_number(const Ptr& p, long)
+{
+  node_difference_type k = 0;
+  for (Ptr s = p->GetPreviousSibling();
+       s;
+       s = s->GetPreviousSibling()
+       )
+    ++k;
+  return k;
+}
+
+template<class NodePtr>
+child_path_t root_path(const node<NodePtr>& n)
+{
+  child_path_t path;
+  NodePtr p = (const NodePtr) n;
+  for (NodePtr par = p->GetParent();
+       par;
+       p = par, par = p->GetParent()
+       )
+    path.push_back(sibling_number(p, 0));
+  path.push_back(child_path_t::uninitialized());
+  std::reverse(path.begin(), path.end());
+  return path;
+}
+
+} // runtime
+} // xpath
+
+#endif
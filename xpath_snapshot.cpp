@@ -0,0 +1,336 @@
+// -*-coding: mule-utf-8-unix; fill-column: 58; -*-
+/**
+ * @file
+ * A flat snapshot of a DOM tree.
+ *
+ * @author Sergei Lodyagin
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstring>
+#include <unordered_map>
+#include "xpath_snapshot.h"
+
+namespace xpath {
+namespace snapshot {
+
+namespace {
+
+//! The CefDOMNode::SerializeSubtree() format version
+constexpr uint32_t subtree_format = 1;
+
+//! Reads a CefDOMNode::SerializeSubtree() buffer
+class subtree_reader
+{
+public:
+  subtree_reader(const char* data, size_t size)
+    : p(data), end(data + size)
+  {}
+
+  template<class T>
+  T read()
+  {
+    SCHECK(size_t(end - p) >= sizeof(T));
+    T v;
+    ::memcpy(&v, p, sizeof(T));
+    p += sizeof(T);
+    return v;
+  }
+
+  //! A string points into the buffer
+  document::bytes_ref str()
+  {
+    const uint32_t len = read<uint32_t>();
+    SCHECK(size_t(end - p) >= len);
+    const document::bytes_ref res = { p, len };
+    p += len;
+    return res;
+  }
+
+  bool at_end() const
+  {
+    return p == end;
+  }
+
+protected:
+  const char* p;
+  const char* end;
+};
+
+//! A bigger serialization buffer is released after the
+//! capture (see buffer_trim)
+constexpr size_t max_kept_buffer = 4 * 1024 * 1024;
+
+//! The serialization buffer of the thread. Usually the
+//! previous buffer is big enough and a subtree is
+//! serialized in one call.
+std::string& subtree_buffer()
+{
+  static thread_local std::string buf;
+  return buf;
+}
+
+//! Releases the buffer of a huge document at the end of
+//! the capture
+struct buffer_trim
+{
+  ~buffer_trim()
+  {
+    std::string& buf = subtree_buffer();
+    if (buf.size() > max_kept_buffer)
+      std::string().swap(buf);
+  }
+};
+
+//! Serializes the root subtree. The buffer is reused by
+//! the next call in the thread.
+subtree_reader serialize(
+  CefRefPtr<CefDOMNode> root,
+  bool with_rects
+)
+{
+  std::string& buf = subtree_buffer();
+
+  size_t size = root->SerializeSubtree(
+    with_rects,
+    buf.empty() ? nullptr : &buf[0],
+    buf.size()
+  );
+  if (size > buf.size()) {
+    buf.resize(size + size / 4);
+    size = root->SerializeSubtree(
+      with_rects,
+      &buf[0],
+      buf.size()
+    );
+  }
+  SCHECK(size > 0 && size <= buf.size());
+  return subtree_reader(buf.data(), size);
+}
+
+}
+
+document::span document::add_chars(bytes_ref s)
+{
+  const span res = {
+    static_cast<uint32_t>(chars.size()),
+    s.length
+  };
+  chars.append(s.data, s.length);
+  return res;
+}
+
+index_t document::add_node(index_t par, CefDOMNodeType t)
+{
+  const index_t i = parent_.size();
+  SCHECK(i != npos);
+
+  parent_.push_back(par);
+  first_child_.push_back(npos);
+  last_child_.push_back(npos);
+  next_sibling_.push_back(npos);
+  prev_sibling_.push_back(npos);
+  child_index_.push_back(0);
+  subtree_end_.push_back(i + 1);
+  depth_.push_back(par != npos ? depth_[par] + 1 : 0);
+
+  if (par != npos) {
+    const index_t prev = last_child_[par];
+    if (prev != npos) {
+      next_sibling_[prev] = i;
+      prev_sibling_[i] = prev;
+      child_index_[i] = child_index_[prev] + 1;
+    }
+    else first_child_[par] = i;
+    last_child_[par] = i;
+  }
+
+  type_.push_back(t);
+  tag_.push_back(0);
+  attr_first.push_back(attr_name_.size());
+  return i;
+}
+
+void document::set_tag(index_t i, bytes_ref name)
+{
+  std::string lower(name.data, name.length);
+  std::transform(
+    lower.begin(),
+    lower.end(),
+    lower.begin(),
+    ::tolower
+  );
+  const auto p = tag_ids.emplace(lower, tag_names.size());
+  const tag_id id = p.first->second;
+  if (p.second) {
+    const atom_t atom = find_tag(lower);
+    tag_names.push_back(std::move(lower));
+    tag_atoms.push_back(atom);
+    if (atom != unknown_atom)
+      atom_tags.emplace(atom, id);
+    tagged.emplace_back();
+  }
+  tag_[i] = id;
+  tagged[id].push_back(i); // nodes come in order
+}
+
+void document::add_attribute(
+  index_t i,
+  bytes_ref name,
+  bytes_ref value,
+  bool with_attr_index
+)
+{
+  SCHECK(i + 1 == attr_first.size());
+
+  attr_name_.push_back(add_chars(name));
+  attr_value_.push_back(add_chars(value));
+
+  if (with_attr_index)
+    attr_index
+      [std::string(name.data, name.length)]
+      [std::string(value.data, value.length)]
+      .push_back(i);
+}
+
+index_t document::next_in(
+  const std::vector<index_t>& nodes,
+  index_t from,
+  index_t to
+)
+{
+  const auto it = std::lower_bound(
+    nodes.begin(), 
+    nodes.end(), 
+    from
+  );
+  return (it != nodes.end() && *it < to) ? *it : npos;
+}
+
+index_t document::next_tagged(
+  atom_t atom, 
+  index_t from, 
+  index_t to
+) const
+{
+  if (atom == unknown_atom)
+    return npos;
+
+  const auto p = atom_tags.find(atom);
+  if (p != atom_tags.end())
+    return next_in(tagged[p->second], from, to);
+
+  // the name is interned after the capture
+  const auto q = tag_ids.find(atom_name(atom));
+  return q != tag_ids.end() 
+    ? next_in(tagged[q->second], from, to) : npos;
+}
+
+index_t document::next_with_attr(
+  const std::string& name,
+  const std::string& value,
+  index_t from, 
+  index_t to
+) const
+{
+  SCHECK(attr_indexed);
+
+  const auto p = attr_index.find(name);
+  if (p == attr_index.end())
+    return npos;
+
+  const auto q = p->second.find(value);
+  return q != p->second.end() 
+    ? next_in(q->second, from, to) : npos;
+}
+
+std::shared_ptr<const document> document::capture(
+  CefRefPtr<CefDOMNode> root,
+  bool with_rects,
+  bool with_attr_index
+)
+{
+  SCHECK(root.get());
+
+  std::shared_ptr<document> doc(new document);
+
+  static std::atomic<uint32_t> n_captured(0);
+  doc->serial_ = ++n_captured;
+
+  const buffer_trim trim;
+  subtree_reader rd = serialize(root, with_rects);
+  SCHECK(rd.read<uint32_t>() == subtree_format);
+  const uint32_t n = rd.read<uint32_t>();
+  SCHECK(n > 0);
+  SCHECK(bool(rd.read<uint32_t>() & 1) == with_rects);
+
+  // Nodes come in the pre-order with depths, the last
+  // node of each depth is the parent candidate.
+  std::vector<index_t> ancestors;
+  for (uint32_t k = 0; k < n; k++) {
+    const auto t = 
+      static_cast<CefDOMNodeType>(rd.read<uint8_t>());
+    const uint32_t depth = rd.read<uint32_t>();
+    SCHECK((depth == 0) == (k == 0));
+    SCHECK(depth <= ancestors.size());
+
+    ancestors.resize(depth);
+    const index_t i = doc->add_node(
+      depth > 0 ? ancestors.back() : npos, 
+      t
+    );
+    ancestors.push_back(i);
+
+    if (t != DOM_NODE_TYPE_ELEMENT) {
+      if (with_rects)
+        doc->rect_.push_back(CefRect());
+      continue;
+    }
+
+    doc->set_tag(i, rd.str());
+
+    const uint32_t n_attrs = rd.read<uint32_t>();
+    for (uint32_t a = 0; a < n_attrs; a++) {
+      const bytes_ref name = rd.str();
+      const bytes_ref value = rd.str();
+      doc->add_attribute(i, name, value, with_attr_index);
+    }
+
+    if (with_rects) {
+      const int32_t x = rd.read<int32_t>();
+      const int32_t y = rd.read<int32_t>();
+      const int32_t w = rd.read<int32_t>();
+      const int32_t h = rd.read<int32_t>();
+      doc->rect_.push_back(CefRect(x, y, w, h));
+    }
+  }
+  SCHECK(rd.at_end());
+
+  doc->attr_indexed = with_attr_index;
+
+  // the end marker for the last node attributes
+  doc->attr_first.push_back(doc->attr_name_.size());
+
+  // children have greater indexes than parents
+  for (index_t i = doc->size(); i-- > 0; ) {
+    const index_t last = doc->last_child_[i];
+    if (last != npos)
+      doc->subtree_end_[i] = doc->subtree_end_[last];
+  }
+
+  // post = pre + subtree size - 1 - depth
+  doc->post_.resize(doc->size());
+  for (index_t i = 0; i < doc->size(); i++)
+    doc->post_[i] = 
+      doc->subtree_end_[i] - 1 - doc->depth_[i];
+
+  LOG_DEBUG(log, "captured " << doc->size()
+    << " nodes, " << doc->chars.size()
+    << " attribute bytes");
+  return doc;
+}
+
+} // snapshot
+} // xpath
@@ -0,0 +1,718 @@
+// -*-coding: mule-utf-8-unix; fill-column: 58; -*-
+/**
+ * @file
+ * A flat snapshot of a DOM tree. It is an alternative
+ * NodePtr for xpath::node: xpath queries over a snapshot
+ * run on integer node indices instead of CefDOMNode
+ * calls.
+ *
+ * @author Sergei Lodyagin
+ */
+
+#ifndef OFFSCREEN_XPATH_SNAPSHOT_H
+#define OFFSCREEN_XPATH_SNAPSHOT_H
+
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "include/cef_dom.h"
+#include "SCheck.h"
+#include "Logging.h"
+#include "xpath.h"
+
+namespace xpath {
+namespace snapshot {
+
+//! The node number in a snapshot. Nodes are numbered in
+//! the document order (pre-order), the root is 0.
+using index_t = uint32_t;
+
+//! The "no node" index value
+constexpr index_t npos = std::numeric_limits<index_t>::max();
+
+class document;
+
+//! A CefDOMNode-like handle of a snapshot node. It has
+//! both CefRefPtr and CefDOMNode interfaces used by
+//! xpath::node and its iterators (the operator->
+//! returns the handle itself).
+class node_ptr
+{
+public:
+  node_ptr() noexcept {}
+
+  node_ptr(const document* doc_, index_t idx_) noexcept
+    : doc(doc_), idx(idx_)
+  {}
+
+  /* CefRefPtr-like interface */
+
+  const node_ptr* get() const noexcept
+  {
+    return (doc && idx != npos) ? this : nullptr;
+  }
+
+  const node_ptr* operator->() const noexcept
+  {
+    return this;
+  }
+
+  explicit operator bool() const noexcept
+  {
+    return get();
+  }
+
+  /* CefDOMNode-like interface */
+
+  CefDOMNodeType GetType() const;
+
+  bool IsElement() const
+  {
+    return GetType() == DOM_NODE_TYPE_ELEMENT;
+  }
+
+  bool IsSame(const node_ptr& o) const noexcept
+  {
+    return idx == o.idx && doc == o.doc;
+  }
+
+  node_ptr GetParent() const;
+  node_ptr GetFirstChild() const;
+  node_ptr GetLastChild() const;
+  node_ptr GetNextSibling() const;
+  node_ptr GetPreviousSibling() const;
+
+  //! Returns the tag name in lower case
+  CefString GetElementTagName() const;
+
+  //! Returns the atom of GetElementTagName()
+  atom_t GetElementTagAtom() const;
+
+  size_t GetNumberOfElementAttributes() const;
+
+  void GetElementAttributeByIdx(
+    size_t attr_idx,
+    CefString& name,
+    CefString& value
+  ) const;
+
+  //! Returns the rectangle captured with the snapshot
+  //! or an empty rectangle if the snapshot was taken
+  //! without rectangles.
+  CefRect GetBoundingClientRect() const;
+
+  /* snapshot specific */
+
+  const document* get_document() const noexcept
+  {
+    return doc;
+  }
+
+  index_t index() const noexcept
+  {
+    return idx;
+  }
+
+  //! The node identity: the document serial number and
+  //! the node index. Keys of different documents differ.
+  uint64_t key() const;
+
+  bool operator==(const node_ptr& o) const noexcept
+  {
+    return IsSame(o);
+  }
+
+  bool operator!=(const node_ptr& o) const noexcept
+  {
+    return !IsSame(o);
+  }
+
+  //! Returns the attribute value or an empty string.
+  //! It compares names in place without CefString
+  //! conversions.
+  std::string get_attribute(const std::string& name) 
+    const;
+
+  //! The node has the attribute `name'
+  bool has_attribute(const std::string& name) const;
+
+  //! fn(@name, arg) over the attribute bytes in place
+  bool match_attribute(
+    const std::string& name,
+    string_fn fn,
+    const std::string& arg
+  ) const;
+
+  //! The 0-based number in the parent's child list
+  index_t child_index() const;
+
+  //! The number of ancestors
+  index_t depth() const;
+
+  //! The post-order number (the pre-order number is
+  //! index())
+  index_t post() const;
+
+  //! Both ancestor and descendant checks are integer
+  //! compares of (pre, post) labels
+  bool is_ancestor_of(const node_ptr& o) const;
+
+  //! The next node in the document order inside the
+  //! context subtree or an empty node_ptr
+  node_ptr next_preorder(const node_ptr& context) const;
+
+  //! The previous node in the document order inside the
+  //! context subtree (not the context itself) or an
+  //! empty node_ptr
+  node_ptr prev_preorder(const node_ptr& context) const;
+
+  //! The last node of the subtree in the document order
+  //! or an empty node_ptr if there are no descendants
+  node_ptr last_descendant() const;
+
+  //! Returns the first node after this one (in the
+  //! document order) with the tag atom inside the
+  //! context subtree or an empty node_ptr. It reads the
+  //! document tag index only.
+  node_ptr next_tagged(
+    atom_t atom, 
+    const node_ptr& context
+  ) const;
+
+  //! The same as next_tagged() but for nodes with the
+  //! attribute `name' = `value'. It requires the
+  //! attribute index.
+  node_ptr next_with_attr(
+    const std::string& name,
+    const std::string& value,
+    const node_ptr& context
+  ) const;
+
+  //! The document was captured with the attribute index
+  bool has_attr_index() const;
+
+protected:
+  const document* doc = nullptr;
+  index_t idx = npos;
+};
+
+//! The flat (struct of arrays) copy of a DOM tree. It is
+//! captured once inside CefDOMVisitor::Visit and stays
+//! valid after the DOM is released.
+class document
+{
+  friend class node_ptr;
+
+public:
+  //! A string slice in the chars pool
+  struct span
+  {
+    uint32_t offset;
+    uint32_t length;
+  };
+
+  //! A string inside a serialized subtree
+  struct bytes_ref
+  {
+    const char* data;
+    uint32_t length;
+  };
+
+  document(const document&) = delete;
+  document& operator=(const document&) = delete;
+
+  //! Copies the root subtree. The subtree is read with
+  //! one CefDOMNode::SerializeSubtree() call (see the
+  //! buffer format in mycef.patch). If with_rects ==
+  //! false the bounding rects are not requested (it
+  //! saves a layout update per element). If
+  //! with_attr_index == true an index by attribute
+  //! values is built.
+  static std::shared_ptr<const document> capture(
+    CefRefPtr<CefDOMNode> root,
+    bool with_rects = true,
+    bool with_attr_index = false
+  );
+
+  node_ptr root() const
+  {
+    return node_ptr(this, 0);
+  }
+
+  //! The capture number. It is unique in the process.
+  uint32_t serial() const
+  {
+    return serial_;
+  }
+
+  //! The number of nodes
+  index_t size() const
+  {
+    return parent_.size();
+  }
+
+  bool has_rects() const
+  {
+    return !rect_.empty();
+  }
+
+  bool has_attr_index() const
+  {
+    return attr_indexed;
+  }
+
+  index_t parent(index_t i) const
+  {
+    return parent_[i];
+  }
+
+  index_t first_child(index_t i) const
+  {
+    return first_child_[i];
+  }
+
+  index_t last_child(index_t i) const
+  {
+    return last_child_[i];
+  }
+
+  index_t next_sibling(index_t i) const
+  {
+    return next_sibling_[i];
+  }
+
+  index_t prev_sibling(index_t i) const
+  {
+    return prev_sibling_[i];
+  }
+
+  index_t child_index(index_t i) const
+  {
+    return child_index_[i];
+  }
+
+  index_t depth(index_t i) const
+  {
+    return depth_[i];
+  }
+
+  index_t post(index_t i) const
+  {
+    return post_[i];
+  }
+
+  //! The node i subtree is [i, subtree_end(i)) 
+  index_t subtree_end(index_t i) const
+  {
+    return subtree_end_[i];
+  }
+
+  //! Returns the first node in [from, to) with the tag
+  //! atom or npos
+  index_t next_tagged(
+    atom_t atom, 
+    index_t from, 
+    index_t to
+  ) const;
+
+  //! Returns the first node in [from, to) with the
+  //! attribute name = value or npos. It requires
+  //! has_attr_index().
+  index_t next_with_attr(
+    const std::string& name,
+    const std::string& value,
+    index_t from, 
+    index_t to
+  ) const;
+
+  CefDOMNodeType type(index_t i) const
+  {
+    return static_cast<CefDOMNodeType>(type_[i]);
+  }
+
+  //! The lower case tag name, empty for non-elements
+  const std::string& tag_name(index_t i) const
+  {
+    return tag_names[tag_[i]];
+  }
+
+  //! The tag atom or unknown_atom if the name is not
+  //! interned (no test uses it)
+  atom_t tag_atom(index_t i) const
+  {
+    const atom_t atom = tag_atoms[tag_[i]];
+    // the name can be interned after the capture
+    return atom != unknown_atom 
+      ? atom : find_tag(tag_names[tag_[i]]);
+  }
+
+  index_t n_attrs(index_t i) const
+  {
+    return attr_first[i + 1] - attr_first[i];
+  }
+
+  std::string attr_name(index_t i, index_t k) const
+  {
+    return str(attr_name_[attr_first[i] + k]);
+  }
+
+  std::string attr_value(index_t i, index_t k) const
+  {
+    return str(attr_value_[attr_first[i] + k]);
+  }
+
+  //! Returns the value of the attribute `name' of the
+  //! node i or an empty string
+  std::string attr_value(
+    index_t i, 
+    const std::string& name
+  ) const
+  {
+    const index_t k = attr_pos(i, name);
+    return k != npos ? str(attr_value_[k]) : std::string();
+  }
+
+  //! The node i has the attribute `name'
+  bool has_attr(index_t i, const std::string& name) const
+  {
+    return attr_pos(i, name) != npos;
+  }
+
+  //! fn(@name, arg) for the node i, a missing attribute
+  //! is an empty string. It reads the chars pool in
+  //! place.
+  bool attr_match(
+    index_t i, 
+    const std::string& name,
+    string_fn fn,
+    const std::string& arg
+  ) const
+  {
+    const index_t k = attr_pos(i, name);
+    const span v = 
+      (k != npos) ? attr_value_[k] : span{0, 0};
+    return string_match(
+      fn, 
+      chars.data() + v.offset, 
+      v.length, 
+      arg
+    );
+  }
+
+protected:
+  document() {}
+
+  std::string str(span s) const
+  {
+    return std::string(chars.data() + s.offset, s.length);
+  }
+
+  span add_chars(bytes_ref s);
+
+  //! The position of the attribute `name' of the node i
+  //! in attr_name_/attr_value_ or npos
+  index_t attr_pos(index_t i, const std::string& name) const
+  {
+    const index_t last = attr_first[i + 1];
+    for (index_t k = attr_first[i]; k < last; k++) {
+      const span n = attr_name_[k];
+      if (n.length == name.size()
+          && chars.compare(n.offset, n.length, name) == 0)
+        return k;
+    }
+    return npos;
+  }
+
+  //! Returns the first element of a sorted nodes list
+  //! in [from, to) or npos
+  static index_t next_in(
+    const std::vector<index_t>& nodes,
+    index_t from,
+    index_t to
+  );
+
+  //! Appends a node as the last child of par. The node
+  //! has no tag and attributes.
+  index_t add_node(index_t par, CefDOMNodeType t);
+
+  //! Sets the tag name of the element i
+  void set_tag(index_t i, bytes_ref name);
+
+  //! Appends an attribute to the last added node i
+  void add_attribute(
+    index_t i,
+    bytes_ref name,
+    bytes_ref value,
+    bool with_attr_index
+  );
+
+  // the tree structure
+  std::vector<index_t> parent_;
+  std::vector<index_t> first_child_;
+  std::vector<index_t> last_child_;
+  std::vector<index_t> next_sibling_;
+  std::vector<index_t> prev_sibling_;
+  std::vector<index_t> child_index_;
+
+  // (pre, post, depth) labels, pre is the node index
+  std::vector<index_t> subtree_end_;
+  std::vector<index_t> post_;
+  std::vector<index_t> depth_;
+
+  //! cef_dom_node_type_t values
+  std::vector<uint8_t> type_;
+
+  //! Tag names local to the document. The capture does
+  //! not intern tags: custom element names are
+  //! unbounded, the atom table keeps test names only.
+  using tag_id = uint32_t;
+
+  //! tag ids, 0 (the empty name) for non-elements
+  std::vector<tag_id> tag_;
+
+  //! the names and atoms (or unknown_atom) of tag ids
+  std::vector<std::string> tag_names = { std::string() };
+  std::vector<atom_t> tag_atoms = { empty_atom };
+
+  std::unordered_map<std::string, tag_id> tag_ids;
+
+  //! the tag ids of interned names
+  std::unordered_map<atom_t, tag_id> atom_tags;
+
+  //! the tag index: element nodes with the tag id in
+  //! the document order
+  std::vector<std::vector<index_t>> tagged = { {} };
+
+  //! attributes of the node i are in
+  //! [attr_first[i], attr_first[i + 1])
+  std::vector<index_t> attr_first;
+  std::vector<span> attr_name_;
+  std::vector<span> attr_value_;
+
+  //! the attribute index: element nodes with the
+  //! attribute name and value in the document order.
+  //! Attribute names are not interned (the atom table is
+  //! for tag names).
+  std::unordered_map<
+    std::string,
+    std::unordered_map<std::string, std::vector<index_t>>
+  > attr_index;
+
+  bool attr_indexed = false;
+
+  //! the pool for all attribute strings
+  std::string chars;
+
+  //! bounding rects (empty if captured without rects)
+  std::vector<CefRect> rect_;
+
+  uint32_t serial_ = 0;
+
+private:
+  using log = curr::Logger<document>;
+};
+
+inline CefDOMNodeType node_ptr::GetType() const
+{
+  return doc->type(idx);
+}
+
+inline uint64_t node_ptr::key() const
+{
+  assert(doc);
+  return (uint64_t(doc->serial_) << 32) | idx;
+}
+
+inline node_ptr node_ptr::GetParent() const
+{
+  return node_ptr(doc, doc->parent_[idx]);
+}
+
+inline node_ptr node_ptr::GetFirstChild() const
+{
+  return node_ptr(doc, doc->first_child_[idx]);
+}
+
+inline node_ptr node_ptr::GetLastChild() const
+{
+  return node_ptr(doc, doc->last_child_[idx]);
+}
+
+inline node_ptr node_ptr::GetNextSibling() const
+{
+  return node_ptr(doc, doc->next_sibling_[idx]);
+}
+
+inline node_ptr node_ptr::GetPreviousSibling() const
+{
+  return node_ptr(doc, doc->prev_sibling_[idx]);
+}
+
+inline CefString node_ptr::GetElementTagName() const
+{
+  return doc->tag_name(idx);
+}
+
+inline atom_t node_ptr::GetElementTagAtom() const
+{
+  return doc->tag_atom(idx);
+}
+
+inline index_t node_ptr::child_index() const
+{
+  return doc->child_index(idx);
+}
+
+inline index_t node_ptr::depth() const
+{
+  return doc->depth(idx);
+}
+
+inline index_t node_ptr::post() const
+{
+  return doc->post(idx);
+}
+
+inline bool node_ptr::is_ancestor_of(
+  const node_ptr& o
+) const
+{
+  assert(doc == o.doc);
+  return idx < o.idx && o.post() < post();
+}
+
+inline node_ptr node_ptr::next_preorder(
+  const node_ptr& context
+) const
+{
+  assert(doc == context.doc);
+  const index_t next = idx + 1;
+  return node_ptr(
+    doc,
+    next < doc->subtree_end(context.idx) ? next : npos
+  );
+}
+
+inline node_ptr node_ptr::prev_preorder(
+  const node_ptr& context
+) const
+{
+  assert(doc == context.doc);
+  return node_ptr(
+    doc, 
+    idx > context.idx + 1 ? idx - 1 : npos
+  );
+}
+
+inline node_ptr node_ptr::last_descendant() const
+{
+  const index_t last = doc->subtree_end(idx) - 1;
+  return node_ptr(doc, last != idx ? last : npos);
+}
+
+inline node_ptr node_ptr::next_tagged(
+  atom_t atom, 
+  const node_ptr& context
+) const
+{
+  assert(doc == context.doc);
+  return node_ptr(
+    doc, 
+    doc->next_tagged(
+      atom, 
+      idx + 1, 
+      doc->subtree_end(context.idx)
+    )
+  );
+}
+
+inline node_ptr node_ptr::next_with_attr(
+  const std::string& name,
+  const std::string& value,
+  const node_ptr& context
+) const
+{
+  assert(doc == context.doc);
+  return node_ptr(
+    doc, 
+    doc->next_with_attr(
+      name,
+      value,
+      idx + 1, 
+      doc->subtree_end(context.idx)
+    )
+  );
+}
+
+inline bool node_ptr::has_attr_index() const
+{
+  return doc->has_attr_index();
+}
+
+inline size_t node_ptr::GetNumberOfElementAttributes()
+  const
+{
+  return doc->n_attrs(idx);
+}
+
+inline void node_ptr::GetElementAttributeByIdx(
+  size_t attr_idx,
+  CefString& name,
+  CefString& value
+) const
+{
+  assert(attr_idx < doc->n_attrs(idx));
+  name = doc->attr_name(idx, attr_idx);
+  value = doc->attr_value(idx, attr_idx);
+}
+
+inline CefRect node_ptr::GetBoundingClientRect() const
+{
+  return doc->has_rects() ? doc->rect_[idx] : CefRect();
+}
+
+inline std::string node_ptr::get_attribute(
+  const std::string& name
+) const
+{
+  return doc->attr_value(idx, name);
+}
+
+inline bool node_ptr::has_attribute(
+  const std::string& name
+) const
+{
+  return doc->has_attr(idx, name);
+}
+
+inline bool node_ptr::match_attribute(
+  const std::string& name,
+  string_fn fn,
+  const std::string& arg
+) const
+{
+  return doc->attr_match(idx, name, fn, arg);
+}
+
+} // snapshot
+} // xpath
+
+namespace std {
+
+template<>
+struct hash<xpath::snapshot::node_ptr>
+{
+  size_t operator()(
+    const xpath::snapshot::node_ptr& p
+  ) const
+  {
+    return hash<uint64_t>()(p.key());
+  }
+};
+
+}
+
+#endif